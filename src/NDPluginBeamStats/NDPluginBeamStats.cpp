@@ -11,9 +11,12 @@ using namespace std;
 
 static const char* pluginName = "NDPluginBeamStats";
 
-NDPluginBeamStats::NDPluginBeamStats ( const char *portName, int queueSize, int blockingCallbacks, const char *NDArrayPort, int NDArrayAddr, int maxBuffers, size_t maxMemory, int priority, int stackSize ):
+/* The moments of a row are accumulated in this many independent lanes, which the compiler can keep in vector registers */
+static const size_t moment_lanes = 8;
+
+NDPluginBeamStats::NDPluginBeamStats ( const char *portName, int queueSize, int blockingCallbacks, const char *NDArrayPort, int NDArrayAddr, int maxBuffers, size_t maxMemory, int priority, int stackSize, int maxScreens ):
 	ViewScreenConfiguredNDPlugin (
-		portName, queueSize, blockingCallbacks, NDArrayPort, NDArrayAddr, 1,
+		portName, queueSize, blockingCallbacks, NDArrayPort, NDArrayAddr, (maxScreens < 1)? 1: maxScreens,
 		NUM_NDPluginBeamStats_PARAMS, maxBuffers, maxMemory,
 		asynGenericPointerMask,
 		asynGenericPointerMask,
@@ -47,8 +50,67 @@ NDPluginBeamStats::NDPluginBeamStats ( const char *portName, int queueSize, int
 }
 
 
+/** Calculates the raw moments of a row, r0 = sum p, r1 = sum p*u and r2 = sum p*u^2, in one pass without a multiplication
+ *  per pixel. Each lane keeps the sum of its pixels, the sum of those sums and the sum of the latter, from which the
+ *  u-weighted sums follow once the row is done. The second sum of sums reaches max(p) * (width/moment_lanes)^3 / 6,
+ *  which accumulatorType must hold; integer accumulators keep the row sums exact.
+ */
 template <typename dataType, typename accumulatorType>
-void NDPluginBeamStats::calculate_beam_statistics ( NDArray *pArray ) {
+static inline void accumulate_row_moments ( const dataType *row, const size_t width, double &r0, double &r1, double &r2 ) {
+
+	accumulatorType a[moment_lanes], b[moment_lanes], c[moment_lanes];
+	for ( size_t l = 0; l < moment_lanes; l++ ) {
+
+		a[l] = 0;
+		b[l] = 0;
+		c[l] = 0;
+	}
+
+	const size_t blocks = width / moment_lanes;
+	for ( size_t k = 0; k < blocks; k++ ) {
+
+		const dataType *block = row + k * moment_lanes;
+		for ( size_t l = 0; l < moment_lanes; l++ ) {
+
+			a[l] += block[l];
+			b[l] += a[l];
+			c[l] += b[l];
+		}
+	}
+
+	/* With j = blocks - k counting the blocks of pixel u = k*moment_lanes + l from the end of the row,
+	 * a = sum p, b = sum j*p and c = sum j*(j+1)/2*p */
+	const double K = blocks, L = moment_lanes;
+	r0 = 0.;
+	r1 = 0.;
+	r2 = 0.;
+
+	for ( size_t l = 0; l < moment_lanes; l++ ) {
+
+		const double sum = a[l];
+		const double sum_j = b[l];
+		const double sum_jj = 2. * c[l] - sum_j;
+		const double sum_k = K * sum - sum_j;
+		const double sum_kk = K * K * sum - 2. * K * sum_j + sum_jj;
+
+		r0 += sum;
+		r1 += L * sum_k + l * sum;
+		r2 += L * L * sum_kk + 2. * L * l * sum_k + (double)(l * l) * sum;
+	}
+
+	/* The pixels after the last full block */
+	for ( size_t u = blocks * moment_lanes; u < width; u++ ) {
+
+		const double p = row[u];
+		r0 += p;
+		r1 += p * u;
+		r2 += p * u * u;
+	}
+}
+
+
+template <typename dataType, typename accumulatorType>
+void NDPluginBeamStats::calculate_beam_statistics ( const Configuration &configuration, NDArray *pArray, beam_statistics_t &statistics ) {
 
 	/* get the pre-processing information */
 	float background_threshold;
@@ -77,8 +139,8 @@ void NDPluginBeamStats::calculate_beam_statistics ( NDArray *pArray ) {
 		asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s:COULDN'T OPEN FILE.\n", pluginName );
 	}*/
 
-	/* Calculate the raw moments in image coordinates */
-	accumulatorType m00, m10, m01, m11, m20, m02;
+	/* Calculate the raw moments in image coordinates; the v-weighted moments follow from the moments of each row */
+	double m00, m10, m01, m11, m20, m02;
 	m00 = 0;
 	m10 = 0;
 	m01 = 0;
@@ -86,23 +148,17 @@ void NDPluginBeamStats::calculate_beam_statistics ( NDArray *pArray ) {
 	m20 = 0;
 	m02 = 0;
 
-	/* A single loop is used because gcc isn't very good at vectorizing inner loops */
-	for ( size_t px = 0; px < array_height*array_width; px++ ) {
-
-		const size_t v = px / array_width;
-		const size_t u = px % array_width;
-
-		accumulatorType su = pData[px];
-		accumulatorType sv = su;
-
-		m00 += su;
-		su *= u;
-		sv *= v;
-		m10 += su;
-		m01 += sv;
-		m20 += su*u;
-		m11 += sv*u;
-		m02 += sv*v;
+	for ( size_t v = 0; v < array_height; v++ ) {
+
+		double r0, r1, r2;
+		accumulate_row_moments<dataType, accumulatorType> ( pData + v * array_width, array_width, r0, r1, r2 );
+
+		m00 += r0;
+		m10 += r1;
+		m20 += r2;
+		m01 += v * r0;
+		m11 += v * r1;
+		m02 += (double)v * v * r0;
 	}
 
 	/*cout << "m00: " << m00 << endl;
@@ -114,12 +170,12 @@ void NDPluginBeamStats::calculate_beam_statistics ( NDArray *pArray ) {
 
 	/* Scale the raw image moments into beamspace */
 	// x = a*u+b; y = c*v+d
-	const double a = ( this->get_xf() - this->get_xi() ) / this->get_output_image_width();
-	const double b = 0.5*a + this->get_xi();
-	const double c = -1.*( this->get_yf() - this->get_yi() ) / this->get_output_image_height();
-	const double d = 0.5*c + this->get_yf();
+	const double a = ( configuration.xf - configuration.xi ) / configuration.get_output_image_width();
+	const double b = 0.5*a + configuration.xi;
+	const double c = -1.*( configuration.yf - configuration.yi ) / configuration.get_output_image_height();
+	const double d = 0.5*c + configuration.yf;
 
-	double M00, M10, M01, M11, M20, M02;
+	double &M00 = statistics.M00, &M10 = statistics.M10, &M01 = statistics.M01, &M11 = statistics.M11, &M20 = statistics.M20, &M02 = statistics.M02;
 	M00 = m00;
 	M10 = a*m10 + b*m00;
 	M01 = c*m01 + d*m00;
@@ -128,7 +184,7 @@ void NDPluginBeamStats::calculate_beam_statistics ( NDArray *pArray ) {
 	M02 = c*(c*m02 + d*m01) + d*M01;
 
 	/* Calculate the central moments in beamspace */
-	double U00, U10, U01, U20, U11, U02;
+	double &U00 = statistics.U00, &U10 = statistics.U10, &U01 = statistics.U01, &U20 = statistics.U20, &U11 = statistics.U11, &U02 = statistics.U02;
 	U00 = m00;
 	U01 = 0.;
 	U10 = 0.;
@@ -154,11 +210,11 @@ void NDPluginBeamStats::calculate_beam_statistics ( NDArray *pArray ) {
 	cout << "U02: " << U02 << endl;*/
 
 	/* Calculate the derived statistics */
-	double centroidx, centroidy, correlation;
+	double &centroidx = statistics.centroidx, &centroidy = statistics.centroidy, &correlation = statistics.correlation;
 	centroidx = M10/M00;
 	centroidy = M01/M00;
 
-	double stdevx, stdevy;
+	double &stdevx = statistics.stdevx, &stdevy = statistics.stdevy;
 	stdevx = sqrt ( U20 / M00 );
 	stdevy = sqrt ( U02 / M00 );
 
@@ -176,35 +232,42 @@ void NDPluginBeamStats::calculate_beam_statistics ( NDArray *pArray ) {
 	U20 /= U00;
 	U11 /= U00;
 	U02 /= U00;
+}
 
-	this->setDoubleParam ( NDPluginBeamStatsM00, M00 );
-	this->setDoubleParam ( NDPluginBeamStatsM10, M10 );
-	this->setDoubleParam ( NDPluginBeamStatsM01, M01 );
-	this->setDoubleParam ( NDPluginBeamStatsM20, M20 );
-	this->setDoubleParam ( NDPluginBeamStatsM11, M11 );
-	this->setDoubleParam ( NDPluginBeamStatsM02, M02 );
-	this->setDoubleParam ( NDPluginBeamStatsU00, U00 );
-	this->setDoubleParam ( NDPluginBeamStatsU10, U10 );
-	this->setDoubleParam ( NDPluginBeamStatsU01, U01 );
-	this->setDoubleParam ( NDPluginBeamStatsU20, U20 );
-	this->setDoubleParam ( NDPluginBeamStatsU11, U11 );
-	this->setDoubleParam ( NDPluginBeamStatsU02, U02 );
-	this->setDoubleParam ( NDPluginBeamStatsBeamCentroidX, centroidx );
-	this->setDoubleParam ( NDPluginBeamStatsBeamCentroidY, centroidy );
-	this->setDoubleParam ( NDPluginBeamStatsBeamStDevX, stdevx );
-	this->setDoubleParam ( NDPluginBeamStatsBeamStDevY, stdevy );
-	this->setDoubleParam ( NDPluginBeamStatsBeamCorrelation, correlation );
+
+void NDPluginBeamStats::publish_beam_statistics ( const int addr, const beam_statistics_t &statistics ) {
+
+	/* This function should be called from a locked state */
+
+	this->setDoubleParam ( addr, NDPluginBeamStatsM00, statistics.M00 );
+	this->setDoubleParam ( addr, NDPluginBeamStatsM10, statistics.M10 );
+	this->setDoubleParam ( addr, NDPluginBeamStatsM01, statistics.M01 );
+	this->setDoubleParam ( addr, NDPluginBeamStatsM20, statistics.M20 );
+	this->setDoubleParam ( addr, NDPluginBeamStatsM11, statistics.M11 );
+	this->setDoubleParam ( addr, NDPluginBeamStatsM02, statistics.M02 );
+	this->setDoubleParam ( addr, NDPluginBeamStatsU00, statistics.U00 );
+	this->setDoubleParam ( addr, NDPluginBeamStatsU10, statistics.U10 );
+	this->setDoubleParam ( addr, NDPluginBeamStatsU01, statistics.U01 );
+	this->setDoubleParam ( addr, NDPluginBeamStatsU20, statistics.U20 );
+	this->setDoubleParam ( addr, NDPluginBeamStatsU11, statistics.U11 );
+	this->setDoubleParam ( addr, NDPluginBeamStatsU02, statistics.U02 );
+	this->setDoubleParam ( addr, NDPluginBeamStatsBeamCentroidX, statistics.centroidx );
+	this->setDoubleParam ( addr, NDPluginBeamStatsBeamCentroidY, statistics.centroidy );
+	this->setDoubleParam ( addr, NDPluginBeamStatsBeamStDevX, statistics.stdevx );
+	this->setDoubleParam ( addr, NDPluginBeamStatsBeamStDevY, statistics.stdevy );
+	this->setDoubleParam ( addr, NDPluginBeamStatsBeamCorrelation, statistics.correlation );
 }
 
 
-ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginBeamStats::configuration_change_callback ( ) {
+ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginBeamStats::configuration_change_callback ( const int addr ) {
 
 	/* This function should be called from a locked state */
 
 	asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "NDPluginBeamStats::Calibrate: Beginning calibration.\n" );
 
-	const size_t image_width = this->get_output_image_width();
-	const size_t image_height = this->get_output_image_height();
+	const std::shared_ptr<const Configuration> configuration = this->get_configuration ( addr );
+	const size_t image_width = configuration->get_output_image_width();
+	const size_t image_height = configuration->get_output_image_height();
 
 	if ( 0 == image_width || 0 == image_height ) {
 
@@ -217,14 +280,15 @@ ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginBeamStats::configura
 
 /** Report the compatibility of the input array and correction table
   * \param[in] pArray  Pointer to the NDArray to check
+  * \param[in] addr  The screen which the array belongs to
   * @return true if the correction may be applied; false otherwise.
   */
-bool NDPluginBeamStats::preprocess_check ( NDArray *pArray ) {
+bool NDPluginBeamStats::preprocess_check ( NDArray *pArray, const int addr ) {
 
 	/* This function should be called while locked */
 
 	/* Check the configuration status */
-	if ( false == this->is_configured() ) {
+	if ( false == this->is_configured ( addr ) ) {
 
 		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "NDPluginBeamStats::preprocess_check: View screen configuration not loaded.\n" );
 		// The plugin is uncalibrated; there is no point in performing further checks.
@@ -235,6 +299,7 @@ bool NDPluginBeamStats::preprocess_check ( NDArray *pArray ) {
 	NDArrayInfo_t ndarray_info;
 	pArray->getInfo ( &ndarray_info );
 
+	const std::shared_ptr<const Configuration> configuration = this->get_configuration ( addr );
 	bool perform_correction = true;
 
 	/* We will only operate on two dimensional arrays */
@@ -252,9 +317,9 @@ bool NDPluginBeamStats::preprocess_check ( NDArray *pArray ) {
 	}
 
 	/* Confirm that the dimensions of the array match the ones provided by the configuration file */
-	if ( (ndarray_info.xSize != this->get_output_image_width()) || (ndarray_info.ySize != this->get_output_image_height()) ) {
+	if ( (ndarray_info.xSize != configuration->get_output_image_width()) || (ndarray_info.ySize != configuration->get_output_image_height()) ) {
 
-		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::preprocess_check: Input image dimensions (%lu,%lu) do not match configuration input image dimensions (%lux%lu).\n", pluginName, ndarray_info.xSize, ndarray_info.ySize, this->get_input_image_width(), this->get_input_image_height() );
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::preprocess_check: Input image dimensions (%lu,%lu) do not match configuration input image dimensions (%lux%lu).\n", pluginName, ndarray_info.xSize, ndarray_info.ySize, configuration->get_input_image_width(), configuration->get_input_image_height() );
 		perform_correction = false;
 	}
 
@@ -277,7 +342,23 @@ void NDPluginBeamStats::processCallbacks ( NDArray *pArray ) {
 
 	NDArray *pArrayOut = NULL;
 
-	const bool calculate_statistics = this->preprocess_check ( pArray );
+	const int addr = this->get_screen_address ( pArray );
+	if ( 0 > addr ) {
+
+		callParamCallbacks();
+		return;
+	}
+
+	const bool calculate_statistics = this->preprocess_check ( pArray, addr );
+
+	/* Take a reference to the active configuration; the statistics are calculated without the lock and a reload may replace it meanwhile */
+	const std::shared_ptr<const Configuration> configuration = this->get_configuration ( addr );
+
+	beam_statistics_t statistics;
+	bool statistics_calculated = false;
+
+	/* The calculation only uses the array and the configuration; release the lock so that parameter reads and writes are not held up */
+	this->unlock();
 
 	if ( calculate_statistics ) {
 
@@ -288,28 +369,36 @@ void NDPluginBeamStats::processCallbacks ( NDArray *pArray ) {
 
 			switch ( pArray->dataType ) {
 				case NDInt8:
-					this->calculate_beam_statistics<epicsInt8, int>( pArrayOut );
+					this->calculate_beam_statistics<epicsInt8, long long>( *configuration, pArrayOut, statistics );
+					statistics_calculated = true;
 					break;
 				case NDUInt8:
-					this->calculate_beam_statistics<epicsUInt8, unsigned int>( pArrayOut );
+					this->calculate_beam_statistics<epicsUInt8, unsigned long long>( *configuration, pArrayOut, statistics );
+					statistics_calculated = true;
 					break;
 				case NDInt16:
-					this->calculate_beam_statistics<epicsInt16, long long>( pArrayOut );
+					this->calculate_beam_statistics<epicsInt16, long long>( *configuration, pArrayOut, statistics );
+					statistics_calculated = true;
 					break;
 				case NDUInt16:
-					this->calculate_beam_statistics<epicsUInt16, unsigned long long>( pArrayOut );
+					this->calculate_beam_statistics<epicsUInt16, unsigned long long>( *configuration, pArrayOut, statistics );
+					statistics_calculated = true;
 					break;
 				case NDInt32:
-					this->calculate_beam_statistics<epicsInt32, long long>( pArrayOut );
+					this->calculate_beam_statistics<epicsInt32, long long>( *configuration, pArrayOut, statistics );
+					statistics_calculated = true;
 					break;
 				case NDUInt32:
-					this->calculate_beam_statistics<epicsUInt32, unsigned long long>( pArrayOut );
+					this->calculate_beam_statistics<epicsUInt32, unsigned long long>( *configuration, pArrayOut, statistics );
+					statistics_calculated = true;
 					break;
 				case NDFloat32:
-					this->calculate_beam_statistics<epicsFloat32, double>( pArrayOut );
+					this->calculate_beam_statistics<epicsFloat32, double>( *configuration, pArrayOut, statistics );
+					statistics_calculated = true;
 					break;
 			    case NDFloat64:
-					this->calculate_beam_statistics<epicsFloat64, double>( pArrayOut );
+					this->calculate_beam_statistics<epicsFloat64, double>( *configuration, pArrayOut, statistics );
+					statistics_calculated = true;
 					break;
 				default:
 					asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s:%s: ERROR: unknown data type=%d\n", pluginName, "processCallbacks", pArrayOut->dataType);
@@ -325,22 +414,29 @@ void NDPluginBeamStats::processCallbacks ( NDArray *pArray ) {
 		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s:processCallbacks: Preprocessing check failed; processing terminated.\n", pluginName );
 	}
 
+	this->lock();
+
+	if ( statistics_calculated ) {
+
+		this->publish_beam_statistics ( addr, statistics );
+	}
+
 	if ( NULL != pArrayOut ) {
 
 		// Add the configuration parameters to the NDArray
 		this->getAttributes( pArrayOut->pAttributeList );
 
 		this->unlock();
-		doCallbacksGenericPointer ( pArrayOut, NDArrayData, 0 );
+		doCallbacksGenericPointer ( pArrayOut, NDArrayData, addr );
 		this->lock();
 
-		/* Release the last array */
-		if ( this->pArrays[0] ) {
+		/* Release the last array of this screen */
+		if ( this->pArrays[addr] ) {
 
-			this->pArrays[0]->release ();
-			this->pArrays[0] = NULL;
+			this->pArrays[addr]->release ();
+			this->pArrays[addr] = NULL;
 		}
-		this->pArrays[0] = pArrayOut;
+		this->pArrays[addr] = pArrayOut;
 
 	}
 	else {
@@ -351,4 +447,5 @@ void NDPluginBeamStats::processCallbacks ( NDArray *pArray ) {
 
 	/* This isn't called by NDPluginDriver::processCallbacks; therefore, it needs to be done manually. */
 	callParamCallbacks();
+	if ( 0 != addr ) callParamCallbacks ( addr );
 }
@@ -32,7 +32,7 @@ public:
     NDPluginBeamStats(const char *portName, int queueSize, int blockingCallbacks,
                  const char *NDArrayPort, int NDArrayAddr,
                  int maxBuffers, size_t maxMemory,
-                 int priority, int stackSize);
+                 int priority, int stackSize, int maxScreens);
     /* These methods override the virtual methods in the base class */
     void processCallbacks(NDArray *pArray);
 
@@ -64,15 +64,30 @@ private:
 	/** ViewScreenConfiguredNDPlugin::configuration_change_callback
 	 *	This function is called when the configuration changes
 	 */
-	virtual ConfigurationStatus_t configuration_change_callback ();
+	virtual ConfigurationStatus_t configuration_change_callback ( const int addr );
 
-	/** Report the compatibility of the input array and correction table
+	/** Report the compatibility of the input array and the configuration of its screen
 	 */
-	bool preprocess_check ( NDArray *pArray );
+	bool preprocess_check ( NDArray *pArray, const int addr );
 
-	/** Calculate the beam statistics
+	/** The beamspace moments and derived statistics of an image */
+	struct beam_statistics_t {
+
+		double M00, M10, M01, M20, M11, M02;
+		double U00, U10, U01, U20, U11, U02;
+		double centroidx, centroidy;
+		double stdevx, stdevy;
+		double correlation;
+	};
+
+	/** Calculate the beam statistics; this only uses the configuration passed to it and may be called without the lock.
+	 *  accumulatorType holds the per-lane sums of a row, so it must not overflow over a row of dataType pixels
+	*/
+	template <typename dataType, typename accumulatorType> void calculate_beam_statistics ( const Configuration &configuration, NDArray *pArray, beam_statistics_t &statistics );
+
+	/** Write the beam statistics of a screen to the parameter library; called from a locked state
 	*/
-	template <typename dataType, typename accumulatorType> void calculate_beam_statistics ( NDArray *pArray );
+	void publish_beam_statistics ( const int addr, const beam_statistics_t &statistics );
 	
 
 	/** Calibration parameters **/
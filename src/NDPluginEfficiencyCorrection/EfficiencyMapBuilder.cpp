@@ -0,0 +1,260 @@
+/** Builds the efficiency maps of a view screen target from ray-traced point spread functions, without an IOC.
+ *
+ *  The input has one ray per line: the iris diameter, the beamspace position (x, y) of the source on the screen,
+ *  the ccd pixel (u, v) which collected the ray and its intensity. Lines starting with # are ignored. The rays of a
+ *  position form its point spread function, and the positions of each iris diameter must form a regular grid.
+ *
+ *  The efficiency of a position is the intensity collected near the brightest pixel of its point spread function,
+ *  counted as NDPluginEfficiencyCorrection counts it. One map is written per iris diameter in the text format read by
+ *  the plugin, together with the binary cache which the plugin would otherwise build when it first loads the maps.
+ */
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <tuple>
+#include <unistd.h>
+
+#include <epicsTime.h>
+
+#include "EfficiencyMaps.h"
+
+using namespace std;
+
+static void usage ( const char *program ) {
+
+	fprintf ( stderr, "Usage: %s [-p nearest_max_points] [-r nearest_max_radius] [-e beam_energy] [-n name] psf_file output_directory\n", program );
+	fprintf ( stderr, "  -p  the most rays counted around the brightest pixel of each point spread function; default 9\n" );
+	fprintf ( stderr, "  -r  the largest distance in pixels from the brightest pixel of a counted ray; default 1.5\n" );
+	fprintf ( stderr, "  -e  the beam energy of the maps, for targets whose efficiency depends on it (OTR); it's part of the file names; default none\n" );
+	fprintf ( stderr, "  -n  the start of the map file names; default efficiency\n" );
+}
+
+/** The positions of the point spread functions of one iris diameter, and where their rays are */
+struct iris_positions_t {
+
+	set<float> x, y;
+	map< pair<float,float>, size_t > psfs;	// the index of the point spread function of each position
+};
+
+/** Finds the first coordinate and the stride of a regular set of coordinates */
+static bool regular_coordinates ( const set<float> &coordinates, float &first, float &stride ) {
+
+	if ( coordinates.size() < 2 ) return false;
+
+	first = *coordinates.begin();
+	stride = (*coordinates.rbegin() - first) / (coordinates.size() - 1);
+	if ( stride <= 0. ) return false;
+
+	size_t i = 0;
+	for ( auto coordinate = coordinates.begin(); coordinate != coordinates.end(); coordinate++, i++ ) {
+
+		if ( fabs ( *coordinate - (first + i * stride) ) > 1e-3 * stride ) return false;
+	}
+	return true;
+}
+
+/** Whether two slices hold the same map, compared sample by sample */
+static bool same_efficiency_map ( const efficiency_map_slice &a, const efficiency_map_slice &b ) {
+
+	if ( a.iris_diameter != b.iris_diameter || a.beam_energy != b.beam_energy || a.roi_xi != b.roi_xi || a.roi_yf != b.roi_yf
+		|| a.roi_width_stride != b.roi_width_stride || a.roi_height_stride != b.roi_height_stride ) return false;
+
+	if ( a.data.get_rows() != b.data.get_rows() || a.data.get_columns() != b.data.get_columns() ) return false;
+
+	for ( size_t y = 0; y < a.data.get_rows(); y++ ) {
+
+		if ( !equal ( a.data.row ( y ), a.data.row ( y ) + a.data.get_columns(), b.data.row ( y ) ) ) return false;
+	}
+	return true;
+}
+
+int main ( int argc, char *argv[] ) {
+
+	size_t nearest_max_points = 9;
+	float nearest_max_radius = 1.5;
+	float beam_energy = 0.;
+	string name = "efficiency";
+
+	int option;
+	while ( -1 != (option = getopt ( argc, argv, "p:r:e:n:" )) ) {
+
+		switch ( option ) {
+			case 'p': nearest_max_points = strtoul ( optarg, NULL, 10 ); break;
+			case 'r': nearest_max_radius = strtod ( optarg, NULL ); break;
+			case 'e': beam_energy = strtod ( optarg, NULL ); break;
+			case 'n': name = optarg; break;
+			default:
+				usage ( argv[0] );
+				return 1;
+		}
+	}
+
+	if ( argc - optind != 2 ) {
+
+		usage ( argv[0] );
+		return 1;
+	}
+
+	const string psf_filename = argv[optind];
+	string directory = argv[optind+1];
+	if ( directory.empty() || '/' != directory[directory.size()-1] ) directory += '/';
+
+	epicsTimeStamp start_time;
+	epicsTimeGetCurrent ( &start_time );
+
+	/* Group the rays by iris diameter and position */
+	FILE *psf_file = fopen ( psf_filename.c_str(), "r" );
+	if ( NULL == psf_file ) {
+
+		fprintf ( stderr, "%s: Unable to open %s: %s\n", argv[0], psf_filename.c_str(), strerror ( errno ) );
+		return 1;
+	}
+
+	map<float,iris_positions_t> irises;
+	vector<point_spread_function_t> psfs;
+	size_t line_number = 0, rays = 0;
+	char line[512];
+
+	while ( NULL != fgets ( line, sizeof(line), psf_file ) ) {
+
+		line_number++;
+
+		char *position = line;
+		while ( ' ' == *position || '\t' == *position ) position++;
+		if ( '#' == *position || '\n' == *position || '\0' == *position ) continue;
+
+		double values[6];
+		size_t count = 0;
+		for ( ; count < 6; count++ ) {
+
+			char *end = NULL;
+			values[count] = strtod ( position, &end );
+			if ( end == position ) break;
+			position = end;
+		}
+
+		if ( 6 != count || values[3] < 0. || values[4] < 0. ) {
+
+			fprintf ( stderr, "%s: %s:%lu: Expected an iris diameter, x, y, u, v and an intensity.\n", argv[0], psf_filename.c_str(), line_number );
+			fclose ( psf_file );
+			return 1;
+		}
+
+		iris_positions_t &positions = irises[(float)values[0]];
+		const pair<float,float> xy ( (float)values[1], (float)values[2] );
+
+		auto psf = positions.psfs.find ( xy );
+		if ( positions.psfs.end() == psf ) {
+
+			psf = positions.psfs.insert ( make_pair ( xy, psfs.size() ) ).first;
+			psfs.push_back ( point_spread_function_t () );
+			positions.x.insert ( xy.first );
+			positions.y.insert ( xy.second );
+		}
+
+		psfs[psf->second].push_back ( make_tuple ( (size_t)values[3], (size_t)values[4], (float)values[5] ) );
+		rays++;
+	}
+	fclose ( psf_file );
+
+	printf ( "Read %lu rays of %lu point spread functions for %lu iris diameters.\n", rays, psfs.size(), irises.size() );
+
+	/* Every position is independent, so the point spread functions of all the maps are counted together */
+	vector<float> totals;
+	count_collected_rays ( psfs, nearest_max_points, nearest_max_radius, totals );
+
+	/* The maps are built in their slices of the grid, which never grows past its reservation, so none is copied */
+	vector<efficiency_map_slice> grid;
+	vector<string> filenames;
+	grid.reserve ( irises.size() );
+
+	for ( auto iris = irises.begin(); iris != irises.end(); iris++ ) {
+
+		const iris_positions_t &positions = iris->second;
+
+		grid.resize ( grid.size() + 1 );
+		efficiency_map_slice &slice = grid.back();
+		slice.iris_diameter = iris->first;
+		slice.beam_energy = beam_energy;
+
+		float roi_yi = 0.;
+		if ( !regular_coordinates ( positions.x, slice.roi_xi, slice.roi_width_stride ) || !regular_coordinates ( positions.y, roi_yi, slice.roi_height_stride ) ) {
+
+			fprintf ( stderr, "%s: The positions of iris diameter %g don't form a regular grid.\n", argv[0], iris->first );
+			return 1;
+		}
+		slice.roi_yf = *positions.y.rbegin();
+
+		/* The rows of a map run from the upper-most y coordinate down */
+		slice.data.resize ( positions.y.size(), positions.x.size() );
+		size_t row = 0;
+		for ( auto y = positions.y.rbegin(); y != positions.y.rend(); y++, row++ ) {
+
+			size_t column = 0;
+			for ( auto x = positions.x.begin(); x != positions.x.end(); x++, column++ ) {
+
+				auto psf = positions.psfs.find ( make_pair ( *x, *y ) );
+				if ( positions.psfs.end() == psf ) {
+
+					fprintf ( stderr, "%s: Iris diameter %g has no rays from position (%g, %g).\n", argv[0], iris->first, *x, *y );
+					return 1;
+				}
+				slice.data.row ( row )[column] = totals[psf->second];
+			}
+		}
+
+		/* Maps of several beam energies share a directory, so the energy is part of their names */
+		char filename[256];
+		if ( 0. != beam_energy ) snprintf ( filename, sizeof(filename), "%s_energy%08.3f_iris%08.3f.cform", name.c_str(), beam_energy, iris->first );
+		else snprintf ( filename, sizeof(filename), "%s_iris%08.3f.cform", name.c_str(), iris->first );
+
+		if ( !write_efficiency_map ( directory + filename, slice ) ) {
+
+			fprintf ( stderr, "%s: Unable to write %s%s: %s\n", argv[0], directory.c_str(), filename, strerror ( errno ) );
+			return 1;
+		}
+
+		filenames.push_back ( filename );
+		printf ( "Wrote %s%s (%lux%lu).\n", directory.c_str(), filename, slice.data.get_columns(), slice.data.get_rows() );
+	}
+
+	/* The cache holds every map of the directory in the order the plugin lists them, so it's only written when the directory holds just these maps */
+	vector<string> listed_filenames;
+	if ( !list_efficiency_maps ( directory, listed_filenames ) || listed_filenames != filenames ) {
+
+		printf ( "%s holds other efficiency maps; the plugin will write the cache when it first loads them.\n", directory.c_str() );
+	}
+	else {
+
+		const unsigned long long signature = efficiency_maps_signature ( directory, filenames );
+		vector<efficiency_map_slice> cached_grid;
+
+		if ( !write_efficiency_grid_cache ( directory, signature, grid ) ) {
+
+			fprintf ( stderr, "%s: Unable to write %s%s: %s\n", argv[0], directory.c_str(), efficiency_grid_cache_filename, strerror ( errno ) );
+			return 1;
+		}
+
+		if ( !read_efficiency_grid_cache ( directory, signature, cached_grid ) || cached_grid.size() != grid.size()
+			|| !equal ( grid.begin(), grid.end(), cached_grid.begin(), same_efficiency_map ) ) {
+
+			fprintf ( stderr, "%s: The cache %s%s doesn't read back.\n", argv[0], directory.c_str(), efficiency_grid_cache_filename );
+			return 1;
+		}
+
+		printf ( "Wrote %s%s.\n", directory.c_str(), efficiency_grid_cache_filename );
+	}
+
+	epicsTimeStamp end_time;
+	epicsTimeGetCurrent ( &end_time );
+	printf ( "Built %lu efficiency maps in %.3f s.\n", grid.size(), epicsTimeDiffInSeconds ( &end_time, &start_time ) );
+
+	return 0;
+}
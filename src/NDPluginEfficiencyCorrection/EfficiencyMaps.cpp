@@ -0,0 +1,543 @@
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+
+#include <epicsTypes.h>
+#include <epicsThread.h>
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+
+#include "EfficiencyMaps.h"
+
+using namespace std;
+
+#if (__GNUC__ <= 4) && (__GNUC_MINOR__ <= 4)
+class third_tuple_element {
+	public:
+		bool operator () (tuple<size_t, size_t, float> a, tuple<size_t, size_t, float> b) {
+
+			return get<2>(a) < get<2>(b);
+		}
+};
+
+static int select_cform ( const dirent *d ) {
+
+	if ( string::npos != string(d->d_name).find( "cform" ) ) {
+
+		return true;
+	}
+	else {
+
+		return false;
+	}
+};
+#endif
+
+// the most threads used to work through a list of jobs, such as loading the efficiency map files of a directory
+static const size_t max_worker_threads = 8;
+
+
+void efficiency_map_samples::resize ( const size_t rows, const size_t columns ) {
+
+	const size_t samples_per_alignment = grid_alignment / sizeof(float);
+
+	this->rows = rows;
+	this->columns = columns;
+	this->row_stride = ((columns + 2 + samples_per_alignment - 1) / samples_per_alignment) * samples_per_alignment;
+
+	/* The storage has room to move its start to an alignment boundary */
+	std::vector<float> ().swap ( this->storage );
+	this->offset = 0;
+	if ( 0 == rows || 0 == columns ) return;
+
+	this->storage.assign ( (rows + 2) * this->row_stride + samples_per_alignment, 0.f );
+	const uintptr_t misalignment = (uintptr_t)&this->storage[0] % grid_alignment;
+	if ( 0 != misalignment ) this->offset = (grid_alignment - misalignment) / sizeof(float);
+}
+
+
+efficiency_map_samples::efficiency_map_samples ( const efficiency_map_samples &other ): rows ( 0 ), columns ( 0 ), row_stride ( 0 ), offset ( 0 ) {
+
+	*this = other;
+}
+
+
+efficiency_map_samples &efficiency_map_samples::operator= ( const efficiency_map_samples &other ) {
+
+	if ( this == &other ) return *this;
+
+	/* The padding stays zero, so only the samples are copied */
+	this->resize ( other.rows, other.columns );
+	for ( size_t y = 0; y < this->rows; y++ ) {
+
+		std::copy ( other.row ( y ), other.row ( y ) + this->columns, this->row ( y ) );
+	}
+
+	return *this;
+}
+
+
+/** Counts the number of rays which were emitted by the foil and collected within a specific distance of the brightest pixel on the ccd.
+  * The rays within the radius are found in one pass with integer squared distances, and only the nearest_max_points nearest of those
+  * are selected, rather than sorting every ray by its distance; a spatial index would cost as much to build as this single query.
+  */
+float count_collected_rays ( const point_spread_function_t &psfdata, const size_t nearest_max_points, const float nearest_max_radius ) {
+
+	// find the maximum value
+	typedef tuple<size_t, size_t, float> tuple_type;
+	auto maxpixel = max_element( psfdata.begin(), psfdata.end(),
+		#if (__GNUC__ <= 4) && (__GNUC_MINOR__ <= 4)
+		third_tuple_element()
+		#else
+		[] (const tuple_type &a, const tuple_type &b) { return get<2>(a) < get<2>(b); }
+		#endif
+	);
+	if ( maxpixel == psfdata.end() || 0 == nearest_max_points || nearest_max_radius < 0. ) return 0.;
+
+	const long long u = get<0>(*maxpixel);
+	const long long v = get<1>(*maxpixel);
+	const double max_distance_squared = (double)nearest_max_radius * nearest_max_radius;
+
+	// the squared distance and intensity of every ray within the radius
+	vector< pair<long long, float> > collected;
+	for ( auto ray = psfdata.begin(); ray != psfdata.end(); ray++ ) {
+
+		const long long du = (long long)get<0>(*ray) - u;
+		const long long dv = (long long)get<1>(*ray) - v;
+		const long long distance_squared = du*du + dv*dv;
+
+		if ( (double)distance_squared <= max_distance_squared ) collected.push_back ( make_pair ( distance_squared, get<2>(*ray) ) );
+	}
+
+	if ( collected.size() > nearest_max_points ) {
+
+		nth_element ( collected.begin(), collected.begin() + nearest_max_points, collected.end() );
+		collected.resize ( nearest_max_points );
+	}
+
+	double total = 0.;
+	for ( auto ray = collected.begin(); ray != collected.end(); ray++ ) total += ray->second;
+
+	return total;
+}
+
+
+/** The point spread functions whose collected rays are counted by a pool of threads */
+struct collected_rays_jobs_t {
+
+	const std::vector<point_spread_function_t> *psfs;
+	std::vector<float> *totals;
+	size_t nearest_max_points;
+	float nearest_max_radius;
+};
+
+static void count_collected_rays_job ( void *context, const size_t job ) {
+
+	collected_rays_jobs_t &jobs = *(collected_rays_jobs_t*)context;
+	(*jobs.totals)[job] = count_collected_rays ( (*jobs.psfs)[job], jobs.nearest_max_points, jobs.nearest_max_radius );
+}
+
+
+void count_collected_rays ( const std::vector<point_spread_function_t> &psfs, const size_t nearest_max_points, const float nearest_max_radius, std::vector<float> &totals ) {
+
+	totals.assign ( psfs.size(), 0. );
+
+	collected_rays_jobs_t jobs;
+	jobs.psfs = &psfs;
+	jobs.totals = &totals;
+	jobs.nearest_max_points = nearest_max_points;
+	jobs.nearest_max_radius = nearest_max_radius;
+
+	run_parallel_jobs ( psfs.size(), count_collected_rays_job, &jobs, "raycounter" );
+}
+
+
+/** The state shared by the threads which work through a list of jobs */
+struct parallel_jobs_t {
+
+	void (*run_job) ( void *context, const size_t job );
+	void *context;				// what the jobs work on
+	size_t job_count;
+	size_t next_job;			// the next job which no thread has taken
+	size_t running_threads;		// the worker threads which haven't finished yet
+	epicsMutex mutex;
+	epicsEvent finished;		// signalled by the last worker thread to finish
+};
+
+/** Takes jobs until none are left; run by the calling thread and by each worker thread **/
+static void run_jobs ( parallel_jobs_t &jobs ) {
+
+	while ( true ) {
+
+		jobs.mutex.lock();
+		const size_t job_number = jobs.next_job;
+		if ( job_number < jobs.job_count ) jobs.next_job++;
+		jobs.mutex.unlock();
+
+		if ( job_number >= jobs.job_count ) return;
+
+		jobs.run_job ( jobs.context, job_number );
+	}
+}
+
+static void parallel_jobs_thread ( void *jobs ) {
+
+	parallel_jobs_t &state = *(parallel_jobs_t*)jobs;
+	run_jobs ( state );
+
+	/* The jobs belong to the waiting thread; they can't be used after this thread is no longer counted */
+	state.mutex.lock();
+	state.running_threads--;
+	if ( 0 == state.running_threads ) state.finished.signal();
+	state.mutex.unlock();
+}
+
+
+size_t run_parallel_jobs ( const size_t job_count, void (*run_job) ( void *context, const size_t job ), void *context, const std::string thread_name ) {
+
+	if ( 0 == job_count ) return 0;
+
+	const long cpus = sysconf ( _SC_NPROCESSORS_ONLN );
+	const size_t thread_count = std::min ( std::min ( max_worker_threads, (cpus > 0)? (size_t)cpus: 1 ), job_count );
+
+	parallel_jobs_t jobs;
+	jobs.run_job = run_job;
+	jobs.context = context;
+	jobs.job_count = job_count;
+	jobs.next_job = 0;
+	jobs.running_threads = 0;
+
+	size_t threads = 1;
+	for ( ; threads < thread_count; threads++ ) {
+
+		/* Count the thread before it starts, so it can't finish before being counted */
+		jobs.mutex.lock();
+		jobs.running_threads++;
+		jobs.mutex.unlock();
+
+		if ( NULL == epicsThreadCreate ( thread_name.c_str(), epicsThreadPriorityLow, epicsThreadGetStackSize ( epicsThreadStackMedium ), parallel_jobs_thread, &jobs ) ) {
+
+			jobs.mutex.lock();
+			jobs.running_threads--;
+			jobs.mutex.unlock();
+			break;
+		}
+	}
+
+	run_jobs ( jobs );
+
+	/* Wait for the worker threads to finish their last jobs */
+	while ( true ) {
+
+		jobs.mutex.lock();
+		const bool running = (0 < jobs.running_threads);
+		jobs.mutex.unlock();
+
+		if ( !running ) break;
+		jobs.finished.wait();
+	}
+
+	return threads;
+}
+
+
+bool list_efficiency_maps ( const std::string directory, std::vector<std::string> &filenames ) {
+
+	struct dirent **eps = NULL;
+	int n;
+
+	#if (__GNUC__ <= 4) && (__GNUC_MINOR__ <= 4)
+	#else
+	auto findcform = [] (const struct dirent *d) {
+
+		string entryname(d->d_name);
+		if ( entryname.find("cform") != string::npos ) {
+
+			return 1;
+		}
+		return 0;
+	 };
+	#endif
+
+	n = scandir ( directory.c_str(), &eps,
+		#if (__GNUC__ <= 4) && (__GNUC_MINOR__ <= 4)
+		select_cform,
+		#else
+		findcform,
+		#endif
+		alphasort );
+
+	if ( n < 0 ) {
+
+		return false;
+	}
+
+	filenames.clear();
+	for ( int cnt = 0; cnt < n; ++cnt ) {
+
+		filenames.push_back ( string ( eps[cnt]->d_name ) );
+		free ( eps[cnt] );
+	}
+
+	if ( eps ) {
+
+		free( eps );
+	}
+	return true;
+}
+
+
+/** The binary cache of the grid of an efficiency map directory.
+  * It holds a header, then a slice header and the row-major samples of each slice, in the byte order of the host.
+  */
+const char efficiency_grid_cache_filename[] = ".efficiency_grids.cache";
+static const char efficiency_grid_cache_magic[8] = { 'E', 'F', 'F', 'G', 'R', 'I', 'D', '\0' };
+static const epicsUInt32 efficiency_grid_cache_version = 2;
+static const epicsUInt32 efficiency_grid_cache_byte_order = 0x01020304;
+
+struct efficiency_grid_cache_header_t {
+
+	char magic[8];
+	epicsUInt32 version;
+	epicsUInt32 byte_order;
+	unsigned long long signature;
+	unsigned long long slice_count;
+};
+
+struct efficiency_grid_cache_slice_t {
+
+	float iris_diameter;
+	float roi_width_stride;
+	float roi_height_stride;
+	float roi_xi;
+	float roi_yf;
+	float beam_energy;
+	epicsUInt32 rows;
+	epicsUInt32 columns;
+};
+
+/** 64-bit FNV-1a */
+static unsigned long long hash_bytes ( unsigned long long hash, const void *data, const size_t length ) {
+
+	const unsigned char *bytes = (const unsigned char*)data;
+	for ( size_t i = 0; i < length; i++ ) {
+
+		hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+
+unsigned long long efficiency_maps_signature ( const std::string directory, const std::vector<std::string> &filenames ) {
+
+	unsigned long long signature = 14695981039346656037ULL;
+	signature = hash_bytes ( signature, &efficiency_grid_cache_version, sizeof(efficiency_grid_cache_version) );
+
+	for ( auto filename = filenames.begin(); filename != filenames.end(); filename++ ) {
+
+		struct stat status;
+		if ( 0 != stat ( (directory + *filename).c_str(), &status ) ) return 0;
+
+		const unsigned long long size = status.st_size;
+		const unsigned long long modified_seconds = status.st_mtim.tv_sec;
+		const unsigned long long modified_nanoseconds = status.st_mtim.tv_nsec;
+
+		signature = hash_bytes ( signature, filename->c_str(), filename->size() + 1 );
+		signature = hash_bytes ( signature, &size, sizeof(size) );
+		signature = hash_bytes ( signature, &modified_seconds, sizeof(modified_seconds) );
+		signature = hash_bytes ( signature, &modified_nanoseconds, sizeof(modified_nanoseconds) );
+	}
+
+	return (0 == signature)? 1: signature;
+}
+
+
+bool read_efficiency_grid_cache ( const std::string directory, const unsigned long long signature, std::vector<efficiency_map_slice> &grid ) {
+
+	if ( 0 == signature ) return false;
+
+	const std::string filename = directory + efficiency_grid_cache_filename;
+	const int fd = ::open ( filename.c_str(), O_RDONLY );
+	if ( fd < 0 ) return false;
+
+	struct stat status;
+	void *mapping = MAP_FAILED;
+	if ( (0 == fstat ( fd, &status )) && ((size_t)status.st_size >= sizeof(efficiency_grid_cache_header_t)) ) {
+
+		mapping = mmap ( NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	}
+	::close ( fd );
+
+	if ( MAP_FAILED == mapping ) return false;
+
+	const char *position = (const char*)mapping;
+	const char *end = position + status.st_size;
+
+	efficiency_grid_cache_header_t header;
+	memcpy ( &header, position, sizeof(header) );
+	position += sizeof(header);
+
+	bool valid = (0 == memcmp ( header.magic, efficiency_grid_cache_magic, sizeof(header.magic) ))
+		&& (efficiency_grid_cache_version == header.version)
+		&& (efficiency_grid_cache_byte_order == header.byte_order)
+		&& (signature == header.signature)
+		&& (0 < header.slice_count);
+
+	std::vector<efficiency_map_slice> cached_grid;
+	if ( valid ) cached_grid.resize ( header.slice_count );
+
+	for ( auto slice = cached_grid.begin(); valid && slice != cached_grid.end(); slice++ ) {
+
+		efficiency_grid_cache_slice_t slice_header;
+		if ( (size_t)(end - position) < sizeof(slice_header) ) {
+
+			valid = false;
+			break;
+		}
+		memcpy ( &slice_header, position, sizeof(slice_header) );
+		position += sizeof(slice_header);
+
+		const size_t row_length = slice_header.columns * sizeof(float);
+		if ( (size_t)(end - position) / (row_length? row_length: 1) < slice_header.rows ) {
+
+			valid = false;
+			break;
+		}
+
+		slice->iris_diameter = slice_header.iris_diameter;
+		slice->roi_width_stride = slice_header.roi_width_stride;
+		slice->roi_height_stride = slice_header.roi_height_stride;
+		slice->roi_xi = slice_header.roi_xi;
+		slice->roi_yf = slice_header.roi_yf;
+		slice->beam_energy = slice_header.beam_energy;
+		slice->data.resize ( slice_header.rows, slice_header.columns );
+
+		for ( size_t row = 0; row < slice_header.rows; row++ ) {
+
+			if ( row_length ) memcpy ( slice->data.row ( row ), position, row_length );
+			position += row_length;
+		}
+	}
+
+	munmap ( mapping, (size_t)status.st_size );
+
+	if ( !valid || position != end ) return false;
+
+	grid.swap ( cached_grid );
+	return true;
+}
+
+
+bool write_efficiency_grid_cache ( const std::string directory, const unsigned long long signature, const std::vector<efficiency_map_slice> &grid ) {
+
+	if ( 0 == signature ) {
+
+		errno = EINVAL;
+		return false;
+	}
+
+	efficiency_grid_cache_header_t header;
+	memset ( &header, 0, sizeof(header) );
+	memcpy ( header.magic, efficiency_grid_cache_magic, sizeof(header.magic) );
+	header.version = efficiency_grid_cache_version;
+	header.byte_order = efficiency_grid_cache_byte_order;
+	header.signature = signature;
+	header.slice_count = grid.size();
+
+	std::vector<char> contents ( (const char*)&header, (const char*)&header + sizeof(header) );
+
+	for ( auto slice = grid.begin(); slice != grid.end(); slice++ ) {
+
+		efficiency_grid_cache_slice_t slice_header;
+		memset ( &slice_header, 0, sizeof(slice_header) );
+		slice_header.iris_diameter = slice->iris_diameter;
+		slice_header.roi_width_stride = slice->roi_width_stride;
+		slice_header.roi_height_stride = slice->roi_height_stride;
+		slice_header.roi_xi = slice->roi_xi;
+		slice_header.roi_yf = slice->roi_yf;
+		slice_header.beam_energy = slice->beam_energy;
+		slice_header.rows = slice->data.get_rows();
+		slice_header.columns = slice->data.get_columns();
+		contents.insert ( contents.end(), (const char*)&slice_header, (const char*)&slice_header + sizeof(slice_header) );
+
+		/* The padding isn't written; it's recreated when the cache is read */
+		for ( size_t row = 0; row < slice_header.rows && 0 < slice_header.columns; row++ ) {
+
+			const char *samples = (const char*)slice->data.row ( row );
+			contents.insert ( contents.end(), samples, samples + slice_header.columns * sizeof(float) );
+		}
+	}
+
+	/* Write a temporary file and rename it, so a reader never sees a partial cache */
+	const std::string filename = directory + efficiency_grid_cache_filename;
+	std::vector<char> temporary_filename ( filename.begin(), filename.end() );
+	const char suffix[] = ".XXXXXX";
+	temporary_filename.insert ( temporary_filename.end(), suffix, suffix + sizeof(suffix) );
+
+	const int fd = mkstemp ( &temporary_filename[0] );
+	if ( fd < 0 ) return false;
+	fchmod ( fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH );
+
+	size_t written = 0;
+	while ( written < contents.size() ) {
+
+		const ssize_t length = ::write ( fd, &contents[written], contents.size() - written );
+		if ( length <= 0 ) break;
+		written += length;
+	}
+
+	if ( (0 != ::close ( fd )) || (written != contents.size()) || (0 != rename ( &temporary_filename[0], filename.c_str() )) ) {
+
+		const int error = errno;
+		unlink ( &temporary_filename[0] );
+		errno = error;
+		return false;
+	}
+
+	return true;
+}
+
+
+/** Writes the parameters of the map, one per line, then a Data line followed by the samples, one row per line from the upper-most row.
+  * Numbers are written with enough digits to read back exactly.
+  */
+bool write_efficiency_map ( const std::string filename, const efficiency_map_slice &slice ) {
+
+	FILE *mapfile = fopen ( filename.c_str(), "w" );
+	if ( NULL == mapfile ) return false;
+
+	const size_t rows = slice.data.get_rows();
+	const size_t columns = slice.data.get_columns();
+
+	fprintf ( mapfile, "IrisDiameter %.9g\n", slice.iris_diameter );
+	if ( 0. != slice.beam_energy ) fprintf ( mapfile, "BeamEnergy %.9g\n", slice.beam_energy );
+	fprintf ( mapfile, "ROIWidthStride %.9g\n", slice.roi_width_stride );
+	fprintf ( mapfile, "ROIHeightStride %.9g\n", slice.roi_height_stride );
+	fprintf ( mapfile, "ROIWidthNSamples %lu\n", columns );
+	fprintf ( mapfile, "ROIHeightNSamples %lu\n", rows );
+
+	fprintf ( mapfile, "ROIXCoordinates" );
+	for ( size_t xi = 0; xi < columns; xi++ ) fprintf ( mapfile, " %.9g", slice.roi_xi + xi * slice.roi_width_stride );
+	fprintf ( mapfile, "\nROIYCoordinates" );
+	for ( size_t yi = 0; yi < rows; yi++ ) fprintf ( mapfile, " %.9g", slice.roi_yf - yi * slice.roi_height_stride );
+	fprintf ( mapfile, "\nData\n" );
+
+	for ( size_t yi = 0; yi < rows; yi++ ) {
+
+		const float *row = slice.data.row ( yi );
+		for ( size_t xi = 0; xi < columns; xi++ ) fprintf ( mapfile, (0 == xi)? "%.9g": " %.9g", row[xi] );
+		fprintf ( mapfile, "\n" );
+	}
+
+	const bool written = !ferror ( mapfile );
+	return (0 == fclose ( mapfile )) && written;
+}
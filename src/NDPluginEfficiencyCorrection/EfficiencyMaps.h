@@ -0,0 +1,90 @@
+#ifndef EfficiencyMaps_H
+#define EfficiencyMaps_H
+
+#include <stdint.h>
+#include <tuple>
+#include <vector>
+#include <string>
+
+/** The efficiency maps of a view screen target, and the parts of their processing which don't need an IOC.
+ *  These are shared by NDPluginEfficiencyCorrection and the offline EfficiencyMapBuilder.
+ */
+
+/** The samples of an efficiency map, stored row after row in one block. Each row starts on a grid_alignment boundary,
+ *  and the samples are followed by at least two zero rows and columns, so the 2x2 neighbourhood of any cell, or of the
+ *  padding cell (rows, columns), can be read without bounds checks; points outside the map are read from the padding.
+ */
+class efficiency_map_samples {
+
+	public:
+		static const size_t grid_alignment = 32;	// bytes; wide enough for AVX loads
+
+		efficiency_map_samples (): rows ( 0 ), columns ( 0 ), row_stride ( 0 ), offset ( 0 ) {};
+
+		/** Copies lay the samples out again in their own storage, whose start is aligned differently */
+		efficiency_map_samples ( const efficiency_map_samples &other );
+		efficiency_map_samples &operator= ( const efficiency_map_samples &other );
+
+		/** Sets the dimensions of the map, with every sample zero */
+		void resize ( const size_t rows, const size_t columns );
+		void clear () { resize ( 0, 0 ); };
+
+		bool empty () const { return 0 == rows || 0 == columns; };
+		size_t get_rows () const { return rows; };
+		size_t get_columns () const { return columns; };
+		size_t get_row_stride () const { return row_stride; };	// in samples
+		size_t memory_usage () const { return storage.size() * sizeof(float); };
+
+		float *row ( const size_t y ) { return storage.data() + offset + y * row_stride; };
+		const float *row ( const size_t y ) const { return storage.data() + offset + y * row_stride; };
+
+	private:
+		std::vector<float> storage;
+		size_t rows, columns, row_stride;
+		size_t offset;	// the samples from the start of the storage to the first aligned one
+};
+
+/** An efficiency map: the efficiency at a regular grid of beamspace positions for one iris diameter and beam energy */
+struct efficiency_map_slice {
+	efficiency_map_samples data;
+	float iris_diameter;
+	float roi_width_stride; // the positive distance between two x-coordinates
+	float roi_height_stride; // positive positive distance between two y-coordinates
+	float roi_xi; // the x-value of the left-most row
+	float roi_yf; // the y-value of the upper-most row
+	float beam_energy; // the beam energy of the map; 0 for maps which don't depend on it
+};
+
+/** The point spread function of a screen position: the pixel coordinates and intensities of the rays collected on the ccd */
+typedef std::vector< std::tuple<size_t, size_t, float> > point_spread_function_t;
+
+/** Calculates the number of rays which were emitted by the foil and collected within a specific distance of the brightest pixel on the ccd **/
+float count_collected_rays ( const point_spread_function_t &psfdata, const size_t nearest_max_points, const float nearest_max_radius );
+
+/** Counts the collected rays of every point spread function on a bounded pool of threads; totals[i] belongs to psfs[i] **/
+void count_collected_rays ( const std::vector<point_spread_function_t> &psfs, const size_t nearest_max_points, const float nearest_max_radius, std::vector<float> &totals );
+
+/** Calls run_job for every job number on up to max_worker_threads threads, including the calling one, and returns when all of
+ *  the jobs are done, even if no worker thread could be started. Returns the number of threads which worked on the jobs.
+ */
+size_t run_parallel_jobs ( const size_t job_count, void (*run_job) ( void *context, const size_t job ), void *context, const std::string thread_name );
+
+/** The name of the binary cache of the efficiency maps in a directory */
+extern const char efficiency_grid_cache_filename[];
+
+/** Lists the efficiency map files in directory in sorted order; returns false if the directory can't be read **/
+bool list_efficiency_maps ( const std::string directory, std::vector<std::string> &filenames );
+
+/** Returns the signature of the map files in directory, which a cache of their grid must match; 0 if a file can't be examined **/
+unsigned long long efficiency_maps_signature ( const std::string directory, const std::vector<std::string> &filenames );
+
+/** Fills the grid from the binary cache in directory, if there is one with a matching signature **/
+bool read_efficiency_grid_cache ( const std::string directory, const unsigned long long signature, std::vector<efficiency_map_slice> &grid );
+
+/** Writes the grid to the binary cache in directory; errno describes a failure **/
+bool write_efficiency_grid_cache ( const std::string directory, const unsigned long long signature, const std::vector<efficiency_map_slice> &grid );
+
+/** Writes a map in the text format read by NDPluginEfficiencyCorrection; the file name should contain "cform" for the plugin to find it **/
+bool write_efficiency_map ( const std::string filename, const efficiency_map_slice &slice );
+
+#endif // EfficiencyMaps_H
@@ -8,90 +8,63 @@
 //#include <sstream>
 #include <sstream>
 #include <map>
+#include <set>
 #include <algorithm>
 #include <numeric>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+
+#include <epicsTime.h>
+#include <epicsThread.h>
 
 #include "NDPluginEfficiencyCorrection.h"
 
 using namespace std;
 
-#if (__GNUC__ <= 4) && (__GNUC_MINOR__ <= 4)
-class third_tuple_element {
-	public:
-		bool operator () (tuple<size_t, size_t, float> a, tuple<size_t, size_t, float> b) {
-
-			return get<2>(a) < get<2>(b);
-		}
-};
-
-class by_closest_to {
-	private:
-		const size_t u, v;
-	public:
-		by_closest_to ( size_t u, size_t v ): u(u), v(v) {};
-		bool operator () ( const tuple<size_t, size_t, float> &a, const tuple<size_t, size_t, float> &b ) {
-			return (pow((int)get<0>(a)-(int)u,2)+pow((int)get<1>(a)-(int)v,2) < pow((int)get<0>(b)-(int)u,2)+pow((int)get<1>(b)-(int)v,2) );
-		}
-};
-
-class within_distance_and_amount_limits {
-
-	private:
-		const size_t u, v;
-		const float max_radius;
-		size_t remaining;
-	public:
-		within_distance_and_amount_limits ( const size_t u, const size_t v, const float max_radius, const size_t amount ): u(u), v(v), max_radius(max_radius), remaining(amount) {};
-		bool operator () ( const tuple<size_t, size_t, float> &t ) {
-
-			if ( remaining == 0 ) return true;
-
-			remaining--;
-			const float distance = sqrt(pow((int)get<0>(t)-(int)u,2)+pow((int)get<1>(t)-(int)v,2) );
-			return (distance > max_radius);
-		}
-};
-
-class total_rays {
-
-	public:
-		double operator () ( const double total, const tuple<size_t, size_t, float> &t ) {
-
-			return total + get<2>(t);
-		}
-};
+static const char* pluginName = "NDPluginEfficiencyCorrection";
 
-int select_cform ( const dirent *d ) {
+/** Rounds a machine parameter to the nearest multiple of its tolerance; a tolerance of 0 keeps it exact */
+static inline double quantize_machine_parameter ( const double value, const double tolerance ) {
 
-	if ( string::npos != string(d->d_name).find( "cform" ) ) {
+	return (tolerance > 0.)? floor ( value / tolerance + 0.5 ) * tolerance: value;
+}
 
-		return true;
-	}
-	else {
+static void efficiency_grid_loader_thread ( void *drvPvt ) {
 
-		return false;
-	}
-};
+	NDPluginEfficiencyCorrection *plugin = (NDPluginEfficiencyCorrection*)drvPvt;
+	plugin->load_requested_efficiency_grids ();
+}
 
-#endif
+static void efficiency_table_builder_thread ( void *drvPvt ) {
 
-static const char* pluginName = "NDPluginEfficiencyCorrection";
+	NDPluginEfficiencyCorrection *plugin = (NDPluginEfficiencyCorrection*)drvPvt;
+	plugin->build_requested_efficiency_tables ();
+}
 
-NDPluginEfficiencyCorrection::NDPluginEfficiencyCorrection ( const char *portName, int queueSize, int blockingCallbacks, const char *NDArrayPort, int NDArrayAddr, int maxBuffers, size_t maxMemory, int priority, int stackSize ):
+NDPluginEfficiencyCorrection::NDPluginEfficiencyCorrection ( const char *portName, int queueSize, int blockingCallbacks, const char *NDArrayPort, int NDArrayAddr, int maxBuffers, size_t maxMemory, int priority, int stackSize, int maxScreens ):
 	ViewScreenConfiguredNDPlugin (
-		portName, queueSize, blockingCallbacks, NDArrayPort, NDArrayAddr, 1,
+		portName, queueSize, blockingCallbacks, NDArrayPort, NDArrayAddr, (maxScreens < 1)? 1: maxScreens,
 		NUM_NDPluginEfficiencyCorrection_PARAMS, maxBuffers, maxMemory,
 		asynGenericPointerMask,
-		asynGenericPointerMask, ASYN_CANBLOCK, 1, priority, stackSize ) {
+		asynGenericPointerMask, ASYN_CANBLOCK, 1, priority, stackSize ),
+	loaded_grid_clock ( 0 ),
+	efficiency_grid_loader_running ( false ),
+	efficiency_table_builder_running ( false ) {
 
 
 	/* Create an empty magnification correction table */
 	#ifdef USE_OPENCV
 	//this->efficiency_correction_table.create ( 0, 0, cv::CV_32FC1 );
 	#else
-	this->efficiency_grids.clear();
-	this->efficiency_correction_table.clear();
+	screen_correction_t screen_correction;
+	screen_correction.tables.reset ( new EfficiencyCorrectionTables () );
+	this->screen_corrections.assign ( this->get_screen_count(), screen_correction );
 	#endif
 
 	setStringParam  ( NDPluginDriverPluginType, "NDPluginEfficiencyCorrection" );
@@ -99,77 +72,146 @@ NDPluginEfficiencyCorrection::NDPluginEfficiencyCorrection ( const char *portNam
 	createParam ( NDPluginEfficiencyCorrectionCurrentTargetNumberString, asynParamInt32, &this->NDPluginEfficiencyCorrectionCurrentTargetNumber );
 	createParam ( NDPluginEfficiencyCorrectionCurrentIrisDiameterString, asynParamFloat64, &this->NDPluginEfficiencyCorrectionCurrentIrisDiameter );
 	createParam ( NDPluginEfficiencyCorrectionCurrentBeamEnergyString, asynParamFloat64, &this->NDPluginEfficiencyCorrectionCurrentBeamEnergy );
-
-	setIntegerParam ( this->NDPluginEfficiencyCorrectionCurrentTargetNumber, -1 );
-	setDoubleParam  ( this->NDPluginEfficiencyCorrectionCurrentIrisDiameter, 0. );
-	setDoubleParam  ( this->NDPluginEfficiencyCorrectionCurrentBeamEnergy, 0. );
+	createParam ( NDPluginEfficiencyCorrectionGridStatusString, asynParamInt32, &this->NDPluginEfficiencyCorrectionGridStatus );
+	createParam ( NDPluginEfficiencyCorrectionGridPrefetchString, asynParamInt32, &this->NDPluginEfficiencyCorrectionGridPrefetch );
+	createParam ( NDPluginEfficiencyCorrectionGridMemoryLimitString, asynParamInt32, &this->NDPluginEfficiencyCorrectionGridMemoryLimit );
+	createParam ( NDPluginEfficiencyCorrectionIrisToleranceString, asynParamFloat64, &this->NDPluginEfficiencyCorrectionIrisTolerance );
+	createParam ( NDPluginEfficiencyCorrectionEnergyToleranceString, asynParamFloat64, &this->NDPluginEfficiencyCorrectionEnergyTolerance );
+	createParam ( NDPluginEfficiencyCorrectionTableCacheSizeString, asynParamInt32, &this->NDPluginEfficiencyCorrectionTableCacheSize );
+	createParam ( NDPluginEfficiencyCorrectionTablePrecisionString, asynParamInt32, &this->NDPluginEfficiencyCorrectionTablePrecision );
+	createParam ( NDPluginEfficiencyCorrectionTableErrorString, asynParamFloat64, &this->NDPluginEfficiencyCorrectionTableError );
+	createParam ( NDPluginEfficiencyCorrectionTableMemoryString, asynParamFloat64, &this->NDPluginEfficiencyCorrectionTableMemory );
+
+	/* The grids are shared by the screens, so these apply to all of them */
+	setIntegerParam ( this->NDPluginEfficiencyCorrectionGridPrefetch, 0 );
+	setIntegerParam ( this->NDPluginEfficiencyCorrectionGridMemoryLimit, 0 );
+	setDoubleParam  ( this->NDPluginEfficiencyCorrectionIrisTolerance, 0.01 );
+	setDoubleParam  ( this->NDPluginEfficiencyCorrectionEnergyTolerance, 0.01 );
+	setIntegerParam ( this->NDPluginEfficiencyCorrectionTableCacheSize, 8 );
+	setIntegerParam ( this->NDPluginEfficiencyCorrectionTablePrecision, EfficiencyTableFloat32 );
+
+	/* Each screen has its own target, iris and beam */
+	for ( int addr = 0; addr < this->get_screen_count(); addr++ ) {
+
+		setIntegerParam ( addr, this->NDPluginEfficiencyCorrectionCurrentTargetNumber, -1 );
+		setDoubleParam  ( addr, this->NDPluginEfficiencyCorrectionCurrentIrisDiameter, 0. );
+		setDoubleParam  ( addr, this->NDPluginEfficiencyCorrectionCurrentBeamEnergy, 0. );
+		setIntegerParam ( addr, this->NDPluginEfficiencyCorrectionGridStatus, EfficiencyGridUnavailable );
+		setDoubleParam  ( addr, this->NDPluginEfficiencyCorrectionTableError, 0. );
+		setDoubleParam  ( addr, this->NDPluginEfficiencyCorrectionTableMemory, 0. );
+	}
 
 	/* Try to connect to the NDArray port */
 	this->connectToArrayPort();
 
-	this->callParamCallbacks();
+	this->call_screen_param_callbacks();
 }
 
 
-ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginEfficiencyCorrection::configuration_change_callback ( ) {
-
-	/* This function should be called from a locked state */
+/** Finds the efficiency map directories of the targets of a configuration.
+  * Their grids are loaded in the background when a screen first uses the target; the signatures recorded
+  * here let a reload of the configuration replace grids whose map files have changed.
+  * This function is called without the port lock; it only uses the configuration passed to it.
+  */
+ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginEfficiencyCorrection::prepare_configuration_tables ( const Configuration &configuration, std::shared_ptr<const ConfigurationTables> &tables ) {
 
-	asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "%s::configuration_change_callback: Beginning calibration.\n", pluginName );
+	asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "%s::%s: Beginning calibration.\n", pluginName, __func__ );
 
-	const size_t image_width = this->get_output_image_width();
-	const size_t image_height = this->get_output_image_height();
+	const size_t image_width = configuration.get_output_image_width();
+	const size_t image_height = configuration.get_output_image_height();
 
 	if ( 0 == image_width || 0 == image_height ) {
 
 		return ConfigurationStatusBadParameter;
 	}
-	
-	size_t invalid_grids = 0;
 
-	/* Load the efficiency maps */
-	for ( size_t target_number = 0; target_number < this->get_maximum_target_count(); target_number++ ) {
+	std::shared_ptr<EfficiencyCorrectionTables> new_tables ( new EfficiencyCorrectionTables () );
 
-		std::vector<grid_slice> &grid = this->efficiency_grids[this->get_target_info ( target_number )];
-		const std::string directory = this->get_efficiency_map_directory ( target_number );
+	size_t invalid_grids = 0;
+	for ( size_t target_number = 0; target_number < configuration.targets.size(); target_number++ ) {
+
+		const TargetInfo target_info = configuration.get_target_info ( target_number );
+		efficiency_grid_source_t source;
+		source.directory = configuration.get_efficiency_map_directory ( target_number );
 
-		if ( 0 == directory.compare ( "" ) ) {
+		if ( 0 == source.directory.compare ( "" ) ) {
 
 			asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::%s: Skipping target number %lu; undefined efficiency map directory.\n", pluginName, __func__, target_number );
 			invalid_grids++;
 			continue;
 		}
 
-		const ConfigurationStatus_t status = load_efficiency_maps ( grid, directory, this->get_target_info ( target_number ) );
+		std::vector<std::string> filenames;
+		if ( ConfigurationStatusConfigured != list_efficiency_maps ( source.directory, filenames ) || filenames.empty() ) {
 
-		if ( !(status == ConfigurationStatusConfigured) || grid.size() == 0 ) {
-
-			asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::%s: Skipping target number %lu; unable to load the efficiency maps.\n", pluginName, __func__ , target_number );
+			asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::%s: Skipping target number %lu; no efficiency maps in %s.\n", pluginName, __func__, target_number, source.directory.c_str() );
 			invalid_grids++;
 			continue;
 		}
+
+		source.signature = efficiency_maps_signature ( source.directory, filenames );
+		new_tables->efficiency_grid_sources[target_info] = source;
 	}
 
-	if ( this->get_maximum_target_count() == invalid_grids ) {
+	if ( configuration.targets.size() == invalid_grids ) {
 
-		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::%s: Unable to load any efficiency maps.\n", pluginName, __func__ );
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::%s: No efficiency maps for any target.\n", pluginName, __func__ );
 		return ConfigurationStatusUnconfigured;
 	}
 
+	tables = new_tables;
+	return ConfigurationStatusConfigured;
+}
+
+
+ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginEfficiencyCorrection::configuration_change_callback ( const int addr ) {
+
+	/* This function should be called from a locked state */
+
+	std::shared_ptr<const EfficiencyCorrectionTables> new_tables = std::static_pointer_cast<const EfficiencyCorrectionTables> ( this->get_configuration_tables ( addr ) );
+
+	if ( !new_tables ) {
+
+		return ConfigurationStatusBadParameter;
+	}
+
+	screen_correction_t &screen_correction = this->screen_corrections[addr];
+	screen_correction.tables = new_tables;
+
+	/* The efficiency correction table was built from the previous grids; force it to be recreated */
+	screen_correction.grid.reset ();
+	screen_correction.efficiency_correction_tables.clear ();
+	screen_correction.rendered_slices.clear ();
+	screen_correction.table_requested = false;
+	setDoubleParam ( addr, NDPluginEfficiencyCorrectionTableMemory, 0. );
+
+	/* Start loading the grid of the current target before the next frame asks for it */
+	int target_number = -1;
+	this->getIntegerParam ( addr, NDPluginEfficiencyCorrectionCurrentTargetNumber, &target_number );
+
+	std::shared_ptr<const Configuration> configuration = this->get_configuration ( addr );
+	if ( configuration && (0 <= target_number) && ((size_t)target_number < configuration->targets.size()) ) {
+
+		auto source = new_tables->efficiency_grid_sources.find ( configuration->get_target_info ( (size_t)target_number ) );
+		if ( new_tables->efficiency_grid_sources.end() != source ) this->request_efficiency_grid ( source->second, false );
+	}
+
 	return ConfigurationStatusConfigured;
 }
 
 
 /** Report the compatibility of the input array and correction table
   * \param[in] pArray  Pointer to the NDArray to check
+  * \param[in] addr  The screen which the array belongs to
+  * \param[out] snapshot  The configuration, tables and machine parameters with which the array should be corrected
   * @return true if the correction may be applied; false otherwise.
   */
-bool NDPluginEfficiencyCorrection::preprocess_check ( NDArray *pArray ) {
+bool NDPluginEfficiencyCorrection::preprocess_check ( NDArray *pArray, const int addr, correction_snapshot_t &snapshot ) {
 
 	/* This function should be called while locked */
 
 	/* Check the configuration status */
-	if ( false == this->is_configured() ) {
+	if ( false == this->is_configured ( addr ) ) {
 
 		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::%s: View screen configuration not loaded.\n", pluginName, __func__ );
 		// The plugin is uncalibrated; there is no point in performing further checks.
@@ -204,25 +246,42 @@ bool NDPluginEfficiencyCorrection::preprocess_check ( NDArray *pArray ) {
 	}
 
 	/* The NDArray is one which may be transformed. Let's check if the efficiency correction table is valid and compatible. */
+	return this->select_efficiency_correction_table ( addr, ndarray_info.xSize * ndarray_info.ySize, snapshot );
+}
+
+
+/** Finds the efficiency correction table of a screen's current machine state, requesting its grid and table as needed
+  * \param[in] addr  The screen
+  * \param[in] pixels  The number of pixels of the arrays to be corrected
+  * \param[out] snapshot  The table with which the arrays should be corrected
+  * @return true if the correction may be applied; false otherwise.
+  */
+bool NDPluginEfficiencyCorrection::select_efficiency_correction_table ( const int addr, const size_t pixels, correction_snapshot_t &snapshot ) {
+
+	/* This function should be called while locked */
+
+	const std::shared_ptr<const Configuration> configuration = this->get_configuration ( addr );
+	screen_correction_t &screen_correction = this->screen_corrections[addr];
+	bool perform_correction = true;
 
 	/* Grab the beam and optics parameters which affect the efficiency corrections. */
 	int target_number = 0;
-	if ( asynSuccess != this->getIntegerParam ( NDPluginEfficiencyCorrectionCurrentTargetNumber, &target_number ) ) {
+	if ( asynSuccess != this->getIntegerParam ( addr, NDPluginEfficiencyCorrectionCurrentTargetNumber, &target_number ) ) {
 
 		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::%s: Unable to read the target number parameter from the parameter library.\n", pluginName, __func__ );
 		perform_correction = false;
 	}
-	else if ( (0 > target_number) || (this->get_maximum_target_count() <= (size_t)target_number) ) {
+	else if ( (0 > target_number) || (configuration->targets.size() <= (size_t)target_number) ) {
 
 		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::%s: Target number is out of range; target_number=%i.\n", pluginName, __func__, target_number );
-		perform_correction = false;
+		return false;
 	}	
 
 	/* Let's learn a little bit about the current target, if it's an OTR foil, then the efficiency corrections depend on energy */
-	const TargetInfo current_target_info = this->get_target_info ( (size_t)target_number );
+	const TargetInfo current_target_info = configuration->get_target_info ( (size_t)target_number );
 
 	double iris_diameter = 0.;
-	if ( asynSuccess != this->getDoubleParam ( NDPluginEfficiencyCorrectionCurrentIrisDiameter, &iris_diameter ) ) {
+	if ( asynSuccess != this->getDoubleParam ( addr, NDPluginEfficiencyCorrectionCurrentIrisDiameter, &iris_diameter ) ) {
 
 		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::%s: Unable to read the current iris diameter parameter from the parameter library.\n", pluginName, __func__ );
 		perform_correction = false;
@@ -234,97 +293,153 @@ bool NDPluginEfficiencyCorrection::preprocess_check ( NDArray *pArray ) {
 	}	
 
 	double beam_energy = 0.;
-	if ( asynSuccess != this->getDoubleParam ( NDPluginEfficiencyCorrectionCurrentBeamEnergy, &beam_energy ) ) {
+	if ( asynSuccess != this->getDoubleParam ( addr, NDPluginEfficiencyCorrectionCurrentBeamEnergy, &beam_energy ) ) {
 
 		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::%s: Couldn't read the current beam energy parameter.\n", pluginName, __func__ );
 		perform_correction = false;
 	}
-	else {
 
-		if ( 0 == current_target_info.light_distribution.compare ( "otr" ) ) {
+	if ( false == perform_correction ) {
 
-			asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::%s: FIXME:Efficiency corrections do not account for beam energy!!!; beam_energy=%f.\n", pluginName, __func__, beam_energy );
-		}
-		//perform_correction = false;
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::%s: Aborting; unable to continue due to previous warnings.\n", pluginName, __func__ );
+		return false;
 	}
 
-	if ( false == perform_correction ) {
+	/* The grid of the target is loaded in the background when it's first used; until then, frames are passed on uncorrected */
+	auto source = screen_correction.tables->efficiency_grid_sources.find ( current_target_info );
+	if ( screen_correction.tables->efficiency_grid_sources.end() == source ) {
 
-		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::%s: Aborting; unable to continue due to previous warnings.\n", pluginName, __func__ );
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::%s: No efficiency maps for target number %i.\n", pluginName, __func__, target_number );
+		setIntegerParam ( addr, NDPluginEfficiencyCorrectionGridStatus, EfficiencyGridUnavailable );
 		return false;
 	}
 
-	/* We have a valid NDArray, efficiency correction parameters and target information. Let's ensure that the efficiency correction table matches the current machine state. */
-	bool recreate_table = false;
-		
-	#ifdef USE_OPENCV
-	const Size table_size = this->efficiency_correction_table.size();
-	#else
-	const size_t table_size = this->efficiency_correction_table.size();
-	#endif
+	const std::shared_ptr<const efficiency_grid_type> grid = this->request_efficiency_grid ( source->second, false );
 
-	/* Validate the correction table */
-	#ifdef USE_OPENCV
-	if ( (-1 == table_size.width) || (-1 == table_size.height) ) {
+	int prefetch = 0;
+	getIntegerParam ( NDPluginEfficiencyCorrectionGridPrefetch, &prefetch );
+	if ( prefetch ) {
 
-		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::%s: Correction table dimensions (%ix%i) invalid.\n", pluginName, __func__, table_size.width, table_size.height );
-		recreate_table = true;
+		/* The neighbouring targets are the ones the actuator passes through next */
+		for ( int neighbour = target_number - 1; neighbour <= target_number + 1; neighbour += 2 ) {
+
+			if ( (0 > neighbour) || (configuration->targets.size() <= (size_t)neighbour) ) continue;
+
+			auto neighbour_source = screen_correction.tables->efficiency_grid_sources.find ( configuration->get_target_info ( (size_t)neighbour ) );
+			if ( screen_correction.tables->efficiency_grid_sources.end() != neighbour_source ) this->request_efficiency_grid ( neighbour_source->second, true );
+		}
 	}
-	#else
-	if ( 0 == table_size ) {
 
-		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::%s: Efficiency correction table is empty.\n", pluginName, __func__ );
-		recreate_table = true;
+	if ( !grid ) {
+
+		const EfficiencyGridStatus_t grid_status = this->loaded_grids[source->second.directory].status;
+		setIntegerParam ( addr, NDPluginEfficiencyCorrectionGridStatus, grid_status );
+		snapshot.pass_through = (EfficiencyGridLoading == grid_status);
+		return false;
 	}
-	#endif	
 
-	/* Confirm that the dimensions of the input array and correction table are identical */
-	// for now, we are only using 2-dimensional arrays so the Size() method is sufficient
-	#ifdef USE_OPENCV
-	if ( (size_t)table_size.width != ndarray_info.xSize || (size_t)table_size.height != ndarray_info.ySize ) {
+	setIntegerParam ( addr, NDPluginEfficiencyCorrectionGridStatus, EfficiencyGridReady );
+
+	/* We have a valid NDArray, efficiency correction parameters and target information. Let's find the efficiency correction table for the current machine state. */
+	if ( grid != screen_correction.grid ) {
 
-		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::preprocess_check: Correction table dimensions (%dx%d) do not match image dimensions (%lux%lu).\n", pluginName, table_size.width, table_size.height, ndarray_info.xSize, ndarray_info.ySize );
-		recreate_table = true;
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "%s::%s: The efficiency grid of the screen has changed.\n", pluginName, __func__ );
+		screen_correction.grid = grid;
+		screen_correction.efficiency_correction_tables.clear ();
+		screen_correction.rendered_slices.assign ( grid->size(), rendered_slices_type::value_type () );
+		screen_correction.table_requested = false;
+		setDoubleParam ( addr, NDPluginEfficiencyCorrectionTableMemory, 0. );
 	}
-	#else
-	if ( table_size != (size_t)(ndarray_info.xSize * ndarray_info.ySize) ) {
 
-		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::preprocess_check: Efficiency correction table size (%lu) does not match image dimensions (%lux%lu).\n", pluginName, table_size, ndarray_info.xSize, ndarray_info.ySize );
-		recreate_table = true;
+	/* The tables and slices of a screen share one precision; they are recreated when it changes */
+	int table_precision = EfficiencyTableFloat32;
+	getIntegerParam ( NDPluginEfficiencyCorrectionTablePrecision, &table_precision );
+
+	if ( (EfficiencyTableFloat16 == table_precision) != screen_correction.half_precision ) {
+
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "%s::%s: The precision of the efficiency tables has changed.\n", pluginName, __func__ );
+		screen_correction.half_precision = (EfficiencyTableFloat16 == table_precision);
+		screen_correction.efficiency_correction_tables.clear ();
+		screen_correction.rendered_slices.assign ( grid->size(), rendered_slices_type::value_type () );
+		screen_correction.table_requested = false;
+		setDoubleParam ( addr, NDPluginEfficiencyCorrectionTableMemory, 0. );
 	}
-	#endif
+
+	/* Readbacks within the tolerances of a machine state share its table */
+	double iris_tolerance = 0., energy_tolerance = 0.;
+	getDoubleParam ( NDPluginEfficiencyCorrectionIrisTolerance, &iris_tolerance );
+	getDoubleParam ( NDPluginEfficiencyCorrectionEnergyTolerance, &energy_tolerance );
 
 	efficiency_correction_table_parameters_t current_machine_parameters;
-	current_machine_parameters.iris_diameter = iris_diameter;
-	current_machine_parameters.beam_energy = beam_energy;
+	current_machine_parameters.iris_diameter = quantize_machine_parameter ( iris_diameter, iris_tolerance );
+	current_machine_parameters.beam_energy = this->grid_depends_on_beam_energy ( *grid )? quantize_machine_parameter ( beam_energy, energy_tolerance ): 0.;
 	current_machine_parameters.target_material = current_target_info.material;
 	current_machine_parameters.target_light_distribution = current_target_info.light_distribution;
 
-	if ( current_machine_parameters != this->efficiency_correction_table_parameters ) {
+	std::list<cached_correction_table_t> &cached_tables = screen_correction.efficiency_correction_tables;
+	auto cached = cached_tables.begin();
+	while ( cached != cached_tables.end() && cached->parameters != current_machine_parameters ) cached++;
+
+	if ( cached != cached_tables.end() && cached->table->size() != pixels ) {
 
-		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::%s: Current machine state and efficiency correction table parameters do not match.\n", pluginName, __func__ );
-		recreate_table = true;
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::%s: Efficiency correction table size (%lu) does not match the image (%lu pixels).\n", pluginName, __func__, cached->table->size(), pixels );
+		cached_tables.erase ( cached );
+		cached = cached_tables.end();
 	}
 
-	if ( true == recreate_table ) {
+	if ( cached != cached_tables.end() ) {
 
-		const bool valid_table = this->create_efficiency_correction_table ( current_machine_parameters, this->efficiency_correction_table );
-		if ( ! valid_table ) {
+		cached_tables.splice ( cached_tables.begin(), cached_tables, cached );
+		snapshot.efficiency_correction_table = cached->table;
+		setDoubleParam ( addr, NDPluginEfficiencyCorrectionTableError, cached->table->max_relative_error );
+		return perform_correction;
+	}
 
-			asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s: Couldn't create the efficiency correction table.\n", pluginName, __func__ );
-			perform_correction = false;
-		}
-		else {
+	/* The table is created in the background, so frames don't wait while the iris or target moves; meanwhile, the
+	 * most recently used table of the grid is applied, or the frame is passed on uncorrected if there is none yet */
+	asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "%s::%s: No efficiency correction table for the current machine state.\n", pluginName, __func__ );
+	this->request_efficiency_correction_table ( addr, current_machine_parameters );
 
-			this->efficiency_correction_table_parameters = current_machine_parameters;
-			asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "%s::%s: Created an efficiency correction table; geometry: %s, light_distribution: %s., iris_diameter: %f\n", pluginName, __func__, this->get_geometry().c_str(), this->get_target_info( target_number ).light_distribution.c_str(), iris_diameter );
-		}
+	if ( cached_tables.empty() || cached_tables.front().table->size() != pixels ) {
+
+		snapshot.pass_through = true;
+		return false;
 	}
 
+	snapshot.efficiency_correction_table = cached_tables.front().table;
+	snapshot.stale_table = true;
+	setDoubleParam ( addr, NDPluginEfficiencyCorrectionTableError, cached_tables.front().table->max_relative_error );
 	return perform_correction;
 }
 
 
+/** Returns the table which the next frame of a screen with the given number of pixels would be corrected with, so that
+  * another plugin can fold it into its own pass; the grid and table of the current machine state are requested as needed,
+  * as they would be for a frame. stale_table is set when the table is the one of a previous machine state. Takes the port lock.
+  */
+std::shared_ptr<const ViewScreenConfiguredNDPlugin::CorrectionTable> NDPluginEfficiencyCorrection::get_output_correction ( const int addr, const size_t pixels, bool &stale_table ) {
+
+	stale_table = false;
+
+	std::shared_ptr<const CorrectionTable> table;
+	if ( (0 > addr) || (this->get_screen_count() <= addr) ) return table;
+
+	this->lock ();
+
+	correction_snapshot_t snapshot;
+	if ( this->is_configured ( addr ) && this->select_efficiency_correction_table ( addr, pixels, snapshot ) ) {
+
+		table = snapshot.efficiency_correction_table;
+		stale_table = snapshot.stale_table;
+	}
+
+	callParamCallbacks ( addr );
+	this->unlock ();
+
+	return table;
+}
+
+
 /** Callback function that is called by the NDArray driver with new NDArray data.
   * Corrects for a
   * \param[in] pArray  The NDArray from the callback.
@@ -338,12 +453,27 @@ void NDPluginEfficiencyCorrection::processCallbacks ( NDArray *pArray ) {
 	/* Call the base class method */
 	NDPluginDriver::processCallbacks ( pArray );
 
-	const bool perform_correction = this->preprocess_check ( pArray );
+	const int addr = this->get_screen_address ( pArray );
+	if ( 0 > addr ) {
+
+		callParamCallbacks();
+		return;
+	}
+
+	correction_snapshot_t snapshot;
+	bool perform_correction = this->preprocess_check ( pArray, addr, snapshot );
+
+	int in_place = 0;
+	getIntegerParam ( ViewScreenConfiguredNDPluginCorrectInPlace, &in_place );
 
 	NDArray *pArrayOut = NULL;
 
-	if ( perform_correction ) {
+	/* The correction only uses the input array and the snapshot; release the lock so that parameter reads and writes are not held up */
+	this->unlock();
 
+	if ( perform_correction || snapshot.pass_through ) {
+
+		#ifdef USE_OPENCV
 		/* Perform the processing with a floating point data type to reduce the accumulation of rounding errors within processing stages */
 		if ( NDFloat32 != pArray->dataType ) {
 
@@ -368,21 +498,33 @@ void NDPluginEfficiencyCorrection::processCallbacks ( NDArray *pArray ) {
 
 			asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::processCallbacks: Unable to make a copy of the input array.\n", pluginName );
 		}
-		else {
+		else if ( perform_correction ) {
 
 			NDArrayInfo_t ndarray_info;
 			const int status = pArrayOut->getInfo ( &ndarray_info );
 
-			#ifdef USE_OPENCV
 			Mat opencv_array ( ndarray_info.ySize, ndarray_info.xSize, CV_32FC1, pArrayOut->pData, sizeof(float) );
 			multiply ( opencv_array, this->magnificiation_correction_table, opencv_array );
-			#else
-			float *pixel = (float*)pArrayOut->pData;
-			for ( auto correction_factor = this->efficiency_correction_table.cbegin(); correction_factor != this->efficiency_correction_table.cend(); correction_factor++, pixel++ ) {
+		}
+		#else
+		/* Convert to a floating point data type and apply the correction in a single pass over the input; without a table, this is a plain conversion */
+		pArrayOut = this->correct_array ( pArray, perform_correction? snapshot.efficiency_correction_table.get(): NULL, 0 != in_place );
 
-				(*pixel) *= *correction_factor;
-			}
-			#endif
+		if ( NULL == pArrayOut ) {
+
+			asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::processCallbacks: Unable to correct the input array.\n", pluginName );
+		}
+		#endif
+
+		if ( ( NULL != pArrayOut ) && !perform_correction ) {
+
+			asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "%s::processCallbacks: Passing the input image on uncorrected while its efficiency grid or table is prepared.\n", pluginName );
+		}
+		else if ( NULL != pArrayOut ) {
+
+			/* Let consumers tell frames corrected for a previous machine state from the rest */
+			epicsInt32 stale_table = snapshot.stale_table? 1: 0;
+			pArrayOut->pAttributeList->add ( "EfficiencyTableStale", "Corrected with the efficiency table of a previous machine state", NDAttrInt32, (void*)&stale_table );
 		}
 	}
 	else {
@@ -390,18 +532,20 @@ void NDPluginEfficiencyCorrection::processCallbacks ( NDArray *pArray ) {
 		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s:processCallbacks: Preprocessing check failed; efficiency corrections will not be applied to the input image.\n", pluginName );
 	}
 
+	this->lock();
+
 	if ( NULL != pArrayOut ) {
 
 		this->unlock();
-		doCallbacksGenericPointer ( pArrayOut, NDArrayData, 0 );
+		doCallbacksGenericPointer ( pArrayOut, NDArrayData, addr );
 		this->lock();
 
-		/* Release the last array */
-		if ( NULL != this->pArrays[0] ) {
+		/* Release the last array of this screen */
+		if ( NULL != this->pArrays[addr] ) {
 
-			this->pArrays[0]->release ();
+			this->pArrays[addr]->release ();
 		}
-		this->pArrays[0] = pArrayOut;
+		this->pArrays[addr] = pArrayOut;
 	}
 	else {
 
@@ -413,91 +557,6 @@ void NDPluginEfficiencyCorrection::processCallbacks ( NDArray *pArray ) {
 }
 
 
-/** Counts the number of rays which were emitted by the foil and collected within a specific distance of the brightest pixel on the ccd **/
-float NDPluginEfficiencyCorrection::count_collected_rays ( vector <tuple<size_t, size_t, float> > &psfdata, const size_t nearest_max_points, const float nearest_max_radius ) {
-
-	// find the maximum value
-	typedef tuple<size_t, size_t, float> tuple_type;
-	auto maxpixel = max_element( psfdata.begin(), psfdata.end(),
-		#if (__GNUC__ <= 4) && (__GNUC_MINOR__ <= 4)
-		third_tuple_element()
-		#else
-		[] (tuple_type &a, tuple_type &b) { return get<2>(a) < get<2>(b); }
-		#endif
-	);
-	if ( maxpixel == psfdata.end() ) return 0.;
-
-	const size_t u = get<0>(*maxpixel);
-	const size_t v = get<1>(*maxpixel);
-
-	/*cout << "Data: ";
-	for_each( psfdata.begin(), psfdata.end(), [] (tuple_type &t) {
-
-		cout << get<0>(t) << " " << get<1>(t) << " " << get<2>(t) << ", ";
-	} );
-	cout << endl;
-	cout << "Max is " << get<0>(*maxpixel) << " " << get<1>(*maxpixel) << " " << get<2>(*maxpixel) << endl;*/
-
-	sort( psfdata.begin(), psfdata.end(),
-		#if (__GNUC__ <= 4) && (__GNUC_MINOR__ <= 4)
-		by_closest_to( u, v )
-		#else
-		[&u, &v] (const tuple_type &a,const tuple_type &b) { return (pow((int)get<0>(a)-(int)u,2)+pow((int)get<1>(a)-(int)v,2) < pow((int)get<0>(b)-(int)u,2)+pow((int)get<1>(b)-(int)v,2) ); }
-		#endif
-	);
-
-	#if (__GNUC__ <= 4) && (__GNUC_MINOR__ <= 4)
-	#else
-	size_t remaining = nearest_max_points;
-	#endif
-
-	auto end = find_if( psfdata.begin(), psfdata.end(),
-		#if (__GNUC__ <= 4) && (__GNUC_MINOR__ <= 4)
-		within_distance_and_amount_limits ( u, v, nearest_max_radius, nearest_max_points )
-		#else
-		[&u, &v, &remaining, &nearest_max_radius] (tuple_type &t) {
-
-			if ( remaining == 0 ) return true;
-			remaining--;
-			const float distance = sqrt(pow((int)get<0>(t)-(int)u,2)+pow((int)get<1>(t)-(int)v,2) );
-			//cout << "\t Remaining: " << remaining << ", Distance: " << distance << endl;
-			return (distance > nearest_max_radius);
-		} 
-		#endif
-	);
-
-	const float total = accumulate( psfdata.begin(), end, 0.,
-		#if (__GNUC__ <= 4) && (__GNUC_MINOR__ <= 4)
-		total_rays()
-		#else
-		[] (const float sum, const tuple_type &t) {
-
-			return sum +get<2>(t);
-		}
-		#endif
-	);
-
-	/*cout << endl;
-	cout << "Data: ";
-	for_each( psfdata.begin(), psfdata.end(), [] (tuple_type &t) {
-
-		cout << get<0>(t) << " " << get<1>(t) << " " << get<2>(t) << ", ";
-	} );
-	cout << endl;
-	cout << "\tMax is " << get<0>(*maxpixel) << " " << get<1>(*maxpixel) << " " << get<2>(*maxpixel) << endl;
-	cout << "Using these values: " << endl;
-	for_each( psfdata.begin(), end, [] (tuple_type &t) {
-
-		cout << get<0>(t) << " " << get<1>(t) << " " << get<2>(t) << ", ";
-	} );
-	cout << endl;*/
-
-	//cout << "For a total of " << total << endl;
-
-	return total;
-}
-
-
 /** Transfers the efficiency map from the file to the grid_slice structure **/
 ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginEfficiencyCorrection::load_efficiency_map ( string filename, grid_slice &slice, const ViewScreenConfiguredNDPlugin::TargetInfo target_info ) {
 
@@ -518,9 +577,14 @@ ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginEfficiencyCorrection
 	floatvector_parameters[string("ROIXCoordinates")] = make_tuple( string("ROIXCoordinates"), vector<float>(), false );
 	floatvector_parameters[string("ROIYCoordinates")] = make_tuple( string("ROIYCoordinates"), vector<float>(), false );
 
-	ifstream mapfile( filename.c_str() );
+	/* Only maps which depend on the beam energy (OTR) carry it */
+	slice.beam_energy = 0.;
+	float_parameter_map_type optional_float_parameters;
+	optional_float_parameters[string("BeamEnergy")] = make_tuple( &slice.beam_energy, false );
 
-	if( mapfile.fail() ) {
+	EfficiencyMapFile mapfile ( filename );
+
+	if( !mapfile.is_open() ) {
 
 		asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s: Unable to open efficiency map; filename=%s.\n", pluginName, __func__, filename.c_str() );
 		return ConfigurationStatusXMLErrorFileNotFound;
@@ -529,13 +593,14 @@ ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginEfficiencyCorrection
 	string parameter_name;
 
 	// load the parameters
-	while ( mapfile >> parameter_name ) {
+	while ( mapfile.read_token ( parameter_name ) ) {
 
 		if ( !read_parameter<integer_parameter_map_type>( mapfile, integer_parameters, parameter_name ) )
 		if ( !read_parameter<float_parameter_map_type>( mapfile, float_parameters, parameter_name ) )
+		if ( !read_parameter<float_parameter_map_type>( mapfile, optional_float_parameters, parameter_name ) )
 		if ( !read_vectorparameter<floatvector_parameter_map_type, float>( mapfile, floatvector_parameters, parameter_name ) ) {
 
-			mapfile.ignore( 2048, '\n' );
+			mapfile.skip_line ();
 			if ( parameter_name == "Data" ) {
 
 				break;
@@ -581,14 +646,14 @@ ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginEfficiencyCorrection
 	}
 
 	// now load the data
-	slice.data.clear();
-	slice.data.resize( roi_height_nsamples, vector<float>(roi_width_nsamples) );
+	slice.data.resize ( roi_height_nsamples, roi_width_nsamples );
 
 	//const size_t nearest_max_points = this->get_efficiency_map_pixel_include_count();
 	//const float nearest_max_radius = this->get_efficiency_map_pixel_include_radius();	
 
 	for ( size_t yi = 0; yi < (size_t)roi_height_nsamples; yi++ ) {
 
+		float *row = slice.data.row ( yi );
 		for ( size_t xi = 0; xi < (size_t)roi_width_nsamples;  xi++ ) {
 
 			//string line;
@@ -601,290 +666,1070 @@ ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginEfficiencyCorrection
 			//size_t u, v;
 			//float e;	
 
-			mapfile >> slice.data[yi][xi];
 			//vector< tuple<size_t, size_t, float> > psfdata;i
 
-			if ( !mapfile ) {
+			if ( !mapfile.read ( row[xi] ) ) {
 
 				asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s:load_efficiency_map(filename=%s): Data format invalid.\n", pluginName, filename.c_str() );
 				return ConfigurationStatusBadParameter;
 			}
 
-			/*if ( slice.data[yi][xi] > 100 ) {
+			/*if ( row[xi] > 100 ) {
 
 				cout << "Point: " << xi << "," << yi << " or " << xcoords[xi] << ", " << ycoords[yi] << endl;
 			}*/
 		}
 	}
 
-	if ( mapfile.is_open() ) {
-
-		mapfile.close ();
-	}
 	return ConfigurationStatusConfigured;
 }
 
 
-/** Loads all of the efficiency maps from directory into a vector of grid_slices **/
-ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginEfficiencyCorrection::load_efficiency_maps ( std::vector<grid_slice> &grid, std::string directory, const ViewScreenConfiguredNDPlugin::TargetInfo target_info ) {
+/** Lists the efficiency map files in directory in sorted order **/
+ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginEfficiencyCorrection::list_efficiency_maps ( const std::string directory, std::vector<std::string> &filenames ) {
 
-	struct dirent **eps = NULL;
-	int n;
+	if ( !::list_efficiency_maps ( directory, filenames ) ) {
 
-	#if (__GNUC__ <= 4) && (__GNUC_MINOR__ <= 4)
-	#else
-	auto findcform = [] (const struct dirent *d) { 
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s(directory=%s): Unable to load efficiency map directory.\n", pluginName, __func__, directory.c_str() );
+		return ConfigurationStatusBadParameter;
+	}
+	return ConfigurationStatusConfigured;
+}
 
-		string entryname(d->d_name);
-		if ( entryname.find("cform") != string::npos ) {
 
-			return 1;
-		}
-		return 0;
-	 };
-	#endif
+bool NDPluginEfficiencyCorrection::read_efficiency_grid_cache ( const std::string directory, const unsigned long long signature, std::vector<grid_slice> &grid ) {
 
-	n = scandir ( directory.c_str(), &eps,
-		#if (__GNUC__ <= 4) && (__GNUC_MINOR__ <= 4)
-		select_cform,
-		#else
-		findcform,
-		#endif
-		alphasort );
+	if ( !::read_efficiency_grid_cache ( directory, signature, grid ) ) return false;
 
-	bool valid = true;
-	if (n >= 0) {
+	asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "%s::%s: Read %lu efficiency maps from %s%s.\n", pluginName, __func__, grid.size(), directory.c_str(), efficiency_grid_cache_filename );
+	return true;
+}
 
-		grid.clear();
-		grid.resize(n);
-		for (int cnt = 0; cnt < n; ++cnt) {
 
-			const string map_file_name = directory + string ( eps[cnt]->d_name );
-			const ConfigurationStatus_t load_map_status = load_efficiency_map ( map_file_name, grid[cnt], target_info );
+void NDPluginEfficiencyCorrection::write_efficiency_grid_cache ( const std::string directory, const unsigned long long signature, const std::vector<grid_slice> &grid ) {
 
-			if ( ConfigurationStatusConfigured != load_map_status ) {
+	if ( 0 == signature ) return;
 
-				asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s(directory=%s): Unable to load efficiency map; map_file_name=%s.\n", pluginName, __func__, directory.c_str(), map_file_name.c_str() );
-				break;
-			}
-		}
-	}
-	else {
+	if ( !::write_efficiency_grid_cache ( directory, signature, grid ) ) {
 
-		asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s(directory=%s): Unable to load efficiency map directory.\n", pluginName, __func__, directory.c_str() );
-		return ConfigurationStatusBadParameter;
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::%s: Unable to write the efficiency map cache in %s; errno=%d.\n", pluginName, __func__, directory.c_str(), errno );
+		return;
 	}
 
-	if ( eps ) {
-
-		free( eps );
-	}
-	return ConfigurationStatusConfigured;
+	asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "%s::%s: Wrote %lu efficiency maps to %s%s.\n", pluginName, __func__, grid.size(), directory.c_str(), efficiency_grid_cache_filename );
 }
 
 
-/** Performs a two dimensional bilinear interpolation of the grid_slice data **/
-float NDPluginEfficiencyCorrection::interpolate_grid_slice ( const grid_slice &slice, const float x, const float y ) {
+/** Loads the grid of a map directory.
+  * The grid comes from the binary cache of the directory when it's up to date; otherwise the map files are
+  * parsed on a pool of threads and the cache is rewritten. Every map must load for the grid to be usable.
+  */
+ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginEfficiencyCorrection::load_efficiency_grid ( const std::string directory, efficiency_grid_type &grid ) {
 
-	/* bilinear interpolation */
-	const float &ys = slice.roi_height_stride;
-	const float &yf = slice.roi_yf;
-	const int ny = -ceil((y-yf)/ys);
-	const float yd = yf - ny*ys - y;	// yd = y2 - y
+	std::vector<std::string> filenames;
+	if ( ConfigurationStatusConfigured != list_efficiency_maps ( directory, filenames ) ) {
 
-	//cout << "\t ys: " << ys << ",\tyf: " << yf << ",\tny: " << ny << ",\tyd: " << yd << ",\ty2: " << yf - ny*ys << ",\ty1: " << yf - (ny+1)*ys << endl;
+		return ConfigurationStatusBadParameter;
+	}
 
-	if ( ny < 0 || ny >= (int)(slice.data.size()-1) ) return 0.;
+	if ( filenames.empty() ) {
 
-	const float &xs = slice.roi_width_stride;
-	const float &xi = slice.roi_xi;
-	const int nx = floor((x-xi)/xs);
-	const float xd = x - xi - nx*xs;	// xd = x - x1
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s(directory=%s): No efficiency maps found.\n", pluginName, __func__, directory.c_str() );
+		return ConfigurationStatusUnconfigured;
+	}
 
-	//cout << "\t xs: " << xs << ",\txi: " << xi << ",\tnx: " << nx << ",\txd: " << xd << ",\tx1: " << xi + nx*xs << ",\tx2: " << xi + (nx+1)*xs << endl;
+	const unsigned long long signature = efficiency_maps_signature ( directory, filenames );
+	if ( read_efficiency_grid_cache ( directory, signature, grid ) ) {
 
-	if ( nx < 0 || nx >= (int)(slice.data[ny].size()-1) ) return 0.;
+		return ConfigurationStatusConfigured;
+	}
 
-	const float fR1 = ((xs-xd)*slice.data[ny+1][nx] + xd*slice.data[ny+1][nx+1])/xs;
-	const float fR2 = ((xs-xd)*slice.data[ny][nx] + xd*slice.data[ny][nx+1])/xs;
-	const float fP = (yd*fR1 + (ys-yd)*fR2)/ys;
+	grid.clear();
+	grid.resize ( filenames.size() );
 
-	//cout << "\tfQ11: " << slice.data[ny+1][nx] << ",\tfQ21: " << slice.data[ny+1][nx+1]
-	//	<< ",\tfQ12: " << slice.data[ny][nx]   << ",\tfQ22: " << slice.data[ny][nx+1] << endl;
-	//cout << "\tfR1: " << fR1 << ",\tfR2: " << fR2 << endl;
-	return fP;
-}
+	std::vector<efficiency_map_job_t> jobs;
+	for ( size_t map_number = 0; map_number < filenames.size(); map_number++ ) {
 
+		jobs.push_back ( efficiency_map_job_t ( directory + filenames[map_number], &grid[map_number], TargetInfo () ) );
+	}
 
-#ifdef USE_OPENCV
-/** Creates the efficiency table using grid data and view screen calibration
- */
-bool NDPluginEfficiencyCorrection::create_efficiency_correction_table ( const vector<grid_slice> &grid, const float iris_diameter, Mat &table ) {
+	epicsTimeStamp start_time;
+	epicsTimeGetCurrent ( &start_time );
 
-	table.create ( ny, nx, CV_32FC1 );
+	load_efficiency_maps ( jobs );
 
-	// pick the two grid slices which bracket the given iris diameter
-	auto lowerbound = grid.rbegin();
-	while ( lowerbound != grid.rend() ) {
+	epicsTimeStamp end_time;
+	epicsTimeGetCurrent ( &end_time );
+	asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "%s::%s(directory=%s): Loaded %lu efficiency maps in %.3f s.\n", pluginName, __func__, directory.c_str(), jobs.size(), epicsTimeDiffInSeconds ( &end_time, &start_time ) );
 
-		if (lowerbound->iris_diameter <= iris_diameter ) { break; }
-		lowerbound++;
-	}
-	auto upperbound = grid.begin();
-	while ( upperbound != grid.end() ) {
+	size_t failed_jobs = 0;
+	for ( auto job = jobs.begin(); job != jobs.end(); job++ ) {
 
-		if (upperbound->iris_diameter >= iris_diameter ) { break; }
-		upperbound++;
+		if ( ConfigurationStatusConfigured != job->status ) failed_jobs++;
 	}
 
-	if ( upperbound == grid.end() ) {
+	if ( 0 < failed_jobs ) {
 
-		cout << "No upper bound found" << endl;
-		return false;
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s(directory=%s): Unable to load %lu of %lu efficiency maps.\n", pluginName, __func__, directory.c_str(), failed_jobs, jobs.size() );
+		return ConfigurationStatusBadParameter;
 	}
-	if ( lowerbound == grid.rend() ) {
 
-		cout << "No lower bound found" << endl;
-		return false;
-	}
+	write_efficiency_grid_cache ( directory, signature, grid );
+	return ConfigurationStatusConfigured;
+}
 
-	const float x0 = lowerbound->iris_diameter;
-	const float x1 = upperbound->iris_diameter;
-	const float s = (x0 == x1)? 1.0: (iris_diameter - x0) / (x1 - x0);
 
-	for ( size_t v = 0; v < ny; v++ ) {
+std::shared_ptr<const NDPluginEfficiencyCorrection::efficiency_grid_type> NDPluginEfficiencyCorrection::request_efficiency_grid ( const efficiency_grid_source_t &source, const bool prefetch ) {
 
-		const float y = yf - (v +0.5)*dy;
-		for ( size_t u = 0; u < nx; u++ ) {
+	const bool requested_before = (0 != this->loaded_grids.count ( source.directory ));
+	loaded_grid_t &entry = this->loaded_grids[source.directory];
 
-			const float x = xi + (u+0.5)*dx;
+	/* A grid is requested when it's first needed, and again when its map files change */
+	if ( !requested_before || (entry.signature != source.signature) ) {
 
-			const float y0 = interpolate_slice( *lowerbound, x, y );
-			const float y1 = interpolate_slice( *upperbound, x, y );
-			const float efficiency = y0 + (y1 - y0)*s;
+		entry = loaded_grid_t ();
+		entry.signature = source.signature;
+		entry.requested = true;
+		entry.prefetch = prefetch;
 
-			const float e0 = interpolate_slice( *lowerbound, 0., 0. );
-			const float e1 = interpolate_slice( *upperbound, 0., 0. );
-			const float norm = e0 + (e1 - e0)*s;
+		if ( !this->efficiency_grid_loader_running ) {
 
-			if ( efficiency == 0. ) {
+			const std::string thread_name = std::string ( this->portName ) + "_gridloader";
 
-				table.at<float>(v, u) = 0.;
+			if ( NULL == epicsThreadCreate ( thread_name.c_str(), epicsThreadPriorityLow, epicsThreadGetStackSize ( epicsThreadStackMedium ), efficiency_grid_loader_thread, this ) ) {
+
+				asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s: Unable to start the efficiency grid loader thread.\n", pluginName, __func__ );
+				entry.requested = false;
+				entry.status = EfficiencyGridUnavailable;
 			}
 			else {
 
-				table.at<float>(v, u) = norm / efficiency;
+				this->efficiency_grid_loader_running = true;
 			}
 		}
 	}
 
-	return true;
-}
-#else
-/** Creates the efficiency table using grid data and view screen calibration
- */
-bool NDPluginEfficiencyCorrection::create_efficiency_correction_table ( const efficiency_correction_table_parameters_t parameters, std::vector<float> &table ) {
-
-	/* Ensure that we have a grid of calibration points which match the target information. */
-	auto grid_iterator = this->efficiency_grids.find ( TargetInfo( parameters.target_material, parameters.target_light_distribution ) );
-	if ( efficiency_grids.end() == grid_iterator ) {
+	if ( !prefetch ) {
 
-		asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s:%s: Aborting; efficiency data unavailable for material=%s, light=%s.\n", pluginName, __func__, parameters.target_material.c_str(), parameters.target_light_distribution.c_str() );
-		return false;
+		entry.prefetch = false;
+		entry.last_used = ++this->loaded_grid_clock;
 	}
 
-	const std::vector<grid_slice> &grid = grid_iterator->second;
+	return entry.grid;
+}
 
-	table.clear ();
-	table.resize ( this->get_output_image_width() * this->get_output_image_height() );
 
-	// pick the two grid slices which bracket the given iris diameter
-	auto lowerbound = grid.rbegin();
-	while ( lowerbound != grid.rend() ) {
+/** Loads the requested grids one at a time, demanded ones first, until none are left.
+  * The maps are read without the port lock; the grid is published under it.
+  */
+void NDPluginEfficiencyCorrection::load_requested_efficiency_grids () {
 
-		if (lowerbound->iris_diameter <= parameters.iris_diameter ) { break; }
-		lowerbound++;
-	}
-	auto upperbound = grid.begin();
-	while ( upperbound != grid.end() ) {
+	this->lock ();
 
-		if (upperbound->iris_diameter >= parameters.iris_diameter ) { break; }
-		upperbound++;
+	while ( true ) {
+
+		auto next = this->loaded_grids.end();
+		for ( auto entry = this->loaded_grids.begin(); entry != this->loaded_grids.end(); entry++ ) {
+
+			if ( !entry->second.requested ) continue;
+			if ( next == this->loaded_grids.end() || (next->second.prefetch && !entry->second.prefetch) ) next = entry;
+		}
+
+		if ( next == this->loaded_grids.end() ) break;
+
+		const std::string directory = next->first;
+		const unsigned long long signature = next->second.signature;
+		next->second.requested = false;
+
+		this->unlock ();
+
+		std::shared_ptr<efficiency_grid_type> grid ( new efficiency_grid_type () );
+		const ConfigurationStatus_t status = this->load_efficiency_grid ( directory, *grid );
+
+		this->lock ();
+
+		/* The grid may have been requested again for changed map files meanwhile */
+		auto entry = this->loaded_grids.find ( directory );
+		if ( entry == this->loaded_grids.end() || entry->second.signature != signature || entry->second.requested ) continue;
+
+		if ( ConfigurationStatusConfigured != status ) {
+
+			asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s: Unable to load the efficiency grid of %s; status=%d.\n", pluginName, __func__, directory.c_str(), status );
+			entry->second.status = EfficiencyGridUnavailable;
+			continue;
+		}
+
+		entry->second.grid = grid;
+		entry->second.status = EfficiencyGridReady;
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "%s::%s: Loaded the efficiency grid of %s.\n", pluginName, __func__, directory.c_str() );
+
+		this->evict_efficiency_grids ();
+	}
+
+	this->efficiency_grid_loader_running = false;
+	this->unlock ();
+}
+
+
+void NDPluginEfficiencyCorrection::request_efficiency_correction_table ( const int addr, const efficiency_correction_table_parameters_t &parameters ) {
+
+	screen_correction_t &screen_correction = this->screen_corrections[addr];
+	if ( screen_correction.table_building && (screen_correction.building_parameters == parameters) ) return;
+
+	/* Only the latest machine state of a screen is worth building; an older request is replaced */
+	screen_correction.requested_parameters = parameters;
+	screen_correction.table_requested = true;
+
+	if ( this->efficiency_table_builder_running ) return;
+
+	const std::string thread_name = std::string ( this->portName ) + "_tablebuilder";
+
+	if ( NULL == epicsThreadCreate ( thread_name.c_str(), epicsThreadPriorityMedium, epicsThreadGetStackSize ( epicsThreadStackMedium ), efficiency_table_builder_thread, this ) ) {
+
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s: Unable to start the efficiency table builder thread.\n", pluginName, __func__ );
+		screen_correction.table_requested = false;
+	}
+	else {
+
+		this->efficiency_table_builder_running = true;
+	}
+}
+
+
+/** Creates the requested tables one at a time until none are left.
+  * The table is created without the port lock from the grid and rendered slices of the screen at the time of the
+  * request; it's kept under the lock unless the screen has moved on to another grid meanwhile.
+  */
+void NDPluginEfficiencyCorrection::build_requested_efficiency_tables () {
+
+	this->lock ();
+
+	while ( true ) {
+
+		int addr = 0;
+		while ( addr < this->get_screen_count() && !this->screen_corrections[addr].table_requested ) addr++;
+		if ( addr == this->get_screen_count() ) break;
+
+		screen_correction_t &screen_correction = this->screen_corrections[addr];
+		const std::shared_ptr<const Configuration> configuration = this->get_configuration ( addr );
+		const std::shared_ptr<const efficiency_grid_type> grid = screen_correction.grid;
+		const efficiency_correction_table_parameters_t parameters = screen_correction.requested_parameters;
+		rendered_slices_type rendered_slices = screen_correction.rendered_slices;
+		const bool half_precision = screen_correction.half_precision;
+
+		screen_correction.table_requested = false;
+		if ( !configuration || !grid ) continue;
+
+		screen_correction.building_parameters = parameters;
+		screen_correction.table_building = true;
+
+		this->unlock ();
+
+		std::shared_ptr<CorrectionTable> table ( new CorrectionTable () );
+		const bool valid_table = this->create_efficiency_correction_table ( *configuration, *grid, parameters, half_precision, rendered_slices, *table );
+
+		this->lock ();
+
+		/* The screen is looked up again; its state may have been reset while the lock was released */
+		screen_correction_t &built_screen_correction = this->screen_corrections[addr];
+		built_screen_correction.table_building = false;
+
+		if ( ! valid_table ) {
+
+			asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s: Couldn't create the efficiency correction table.\n", pluginName, __func__ );
+			continue;
+		}
+
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "%s::%s: Created an efficiency correction table; geometry: %s, light_distribution: %s., iris_diameter: %f\n", pluginName, __func__, configuration->geometry.c_str(), parameters.target_light_distribution.c_str(), parameters.iris_diameter );
+
+		/* Keep the new table for when the machine returns to this state, unless the screen has moved on to another grid or precision */
+		if ( (grid != built_screen_correction.grid) || (half_precision != built_screen_correction.half_precision) ) continue;
+
+		std::list<cached_correction_table_t> &cached_tables = built_screen_correction.efficiency_correction_tables;
+		for ( auto cached = cached_tables.begin(); cached != cached_tables.end(); ) {
+
+			if ( cached->parameters == parameters ) cached = cached_tables.erase ( cached );
+			else cached++;
+		}
+
+		cached_correction_table_t cached_table;
+		cached_table.parameters = parameters;
+		cached_table.table = table;
+		cached_tables.push_front ( cached_table );
+
+		int cache_size = 1;
+		getIntegerParam ( NDPluginEfficiencyCorrectionTableCacheSize, &cache_size );
+		while ( cached_tables.size() > (size_t)((cache_size < 1)? 1: cache_size) ) cached_tables.pop_back ();
+
+		/* Keep the slices which were rendered for the table, so other iris diameters between them are only a blend */
+		for ( size_t slice = 0; slice < built_screen_correction.rendered_slices.size() && slice < rendered_slices.size(); slice++ ) {
+
+			if ( !built_screen_correction.rendered_slices[slice] ) built_screen_correction.rendered_slices[slice] = rendered_slices[slice];
+		}
+
+		setDoubleParam ( addr, NDPluginEfficiencyCorrectionTableMemory, built_screen_correction.memory_usage() / (1024. * 1024.) );
+		callParamCallbacks ( addr );
+	}
+
+	this->efficiency_table_builder_running = false;
+	this->unlock ();
+}
+
+
+size_t NDPluginEfficiencyCorrection::screen_correction_t::memory_usage () const {
+
+	size_t memory_usage = 0;
+
+	for ( auto cached = this->efficiency_correction_tables.begin(); cached != this->efficiency_correction_tables.end(); cached++ ) {
+
+		memory_usage += cached->table->memory_usage();
+	}
+
+	for ( auto rendered = this->rendered_slices.begin(); rendered != this->rendered_slices.end(); rendered++ ) {
+
+		if ( *rendered ) memory_usage += (*rendered)->memory_usage();
+	}
+
+	return memory_usage;
+}
+
+
+void NDPluginEfficiencyCorrection::evict_efficiency_grids () {
+
+	int memory_limit = 0;
+	getIntegerParam ( NDPluginEfficiencyCorrectionGridMemoryLimit, &memory_limit );
+	if ( 0 >= memory_limit ) return;
+
+	/* The grids of the current targets of the screens are in use */
+	std::set<std::string> used_directories;
+	for ( int addr = 0; addr < this->get_screen_count(); addr++ ) {
+
+		const std::shared_ptr<const Configuration> configuration = this->get_configuration ( addr );
+		const std::shared_ptr<const EfficiencyCorrectionTables> &tables = this->screen_corrections[addr].tables;
+
+		int target_number = -1;
+		getIntegerParam ( addr, NDPluginEfficiencyCorrectionCurrentTargetNumber, &target_number );
+		if ( !configuration || !tables || (0 > target_number) || (configuration->targets.size() <= (size_t)target_number) ) continue;
+
+		auto source = tables->efficiency_grid_sources.find ( configuration->get_target_info ( (size_t)target_number ) );
+		if ( tables->efficiency_grid_sources.end() != source ) used_directories.insert ( source->second.directory );
+	}
+
+	while ( true ) {
+
+		size_t memory_usage = 0;
+		auto victim = this->loaded_grids.end();
+
+		for ( auto entry = this->loaded_grids.begin(); entry != this->loaded_grids.end(); entry++ ) {
+
+			if ( !entry->second.grid ) continue;
+
+			for ( auto slice = entry->second.grid->begin(); slice != entry->second.grid->end(); slice++ ) {
+
+				memory_usage += slice->data.memory_usage();
+			}
+
+			if ( 0 != used_directories.count ( entry->first ) ) continue;
+			if ( victim == this->loaded_grids.end() || entry->second.last_used < victim->second.last_used ) victim = entry;
+		}
+
+		if ( (memory_usage <= (size_t)memory_limit * 1024 * 1024) || (victim == this->loaded_grids.end()) ) break;
+
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "%s::%s: Evicting the efficiency grid of %s.\n", pluginName, __func__, victim->first.c_str() );
+		this->loaded_grids.erase ( victim );
+	}
+}
+
+
+/** Loads the efficiency map file of every job, and sets the status of each job **/
+void NDPluginEfficiencyCorrection::load_efficiency_maps ( std::vector<efficiency_map_job_t> &jobs ) {
+
+	efficiency_map_loader_t loader;
+	loader.plugin = this;
+	loader.jobs = &jobs;
+
+	const size_t threads = run_parallel_jobs ( jobs.size(), load_efficiency_map_job, &loader, std::string ( this->portName ) + "_maploader" );
+	asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "%s::%s: Loaded %lu efficiency map files on %lu threads.\n", pluginName, __func__, jobs.size(), threads );
+}
+
+
+void NDPluginEfficiencyCorrection::load_efficiency_map_job ( void *loader, const size_t job_number ) {
+
+	efficiency_map_loader_t &state = *(efficiency_map_loader_t*)loader;
+	efficiency_map_job_t &job = (*state.jobs)[job_number];
+	job.status = state.plugin->load_efficiency_map ( job.filename, *job.slice, job.target_info );
+
+	if ( ConfigurationStatusConfigured != job.status ) {
+
+		asynPrint ( state.plugin->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s: Unable to load efficiency map; map_file_name=%s.\n", pluginName, __func__, job.filename.c_str() );
+	}
+}
+
+
+/** Finds the cell and weight of every column of the output image in a slice; mirrors interpolate_grid_slice **/
+void NDPluginEfficiencyCorrection::interpolate_grid_slice_columns ( const grid_slice &slice, const Configuration &configuration, axis_interpolation_t &columns ) {
+
+	const size_t oimage_width = configuration.get_output_image_width();
+	const float &xs = slice.roi_width_stride;
+	const float &xi = slice.roi_xi;
+	const int samples = (int)slice.data.get_columns();
+
+	/* Points outside the slice interpolate the zero padding */
+	columns.cell.assign ( oimage_width, samples );
+	columns.weight.assign ( oimage_width, 0. );
+
+	for ( size_t u = 0; u < oimage_width; u++ ) {
+
+		double x, y;
+		configuration.oimage_to_beamspace ( u, 0, x, y );
+
+		const float xf = x;
+		const int nx = floor((xf-xi)/xs);
+		if ( nx < 0 || nx >= samples-1 ) continue;
+
+		columns.cell[u] = nx;
+		columns.weight[u] = (xf - xi - nx*xs)/xs;	// xd/xs
+	}
+}
+
+
+/** Finds the cell and weight of every row of the output image in a slice; mirrors interpolate_grid_slice **/
+void NDPluginEfficiencyCorrection::interpolate_grid_slice_rows ( const grid_slice &slice, const Configuration &configuration, axis_interpolation_t &rows ) {
+
+	const size_t oimage_height = configuration.get_output_image_height();
+	const float &ys = slice.roi_height_stride;
+	const float &yf = slice.roi_yf;
+	const int samples = (int)slice.data.get_rows();
+
+	/* Points outside the slice interpolate the zero padding */
+	rows.cell.assign ( oimage_height, samples );
+	rows.weight.assign ( oimage_height, 0. );
+
+	for ( size_t v = 0; v < oimage_height; v++ ) {
+
+		double x, y;
+		configuration.oimage_to_beamspace ( 0, v, x, y );
+
+		const float yv = y;
+		const int ny = -ceil((yv-yf)/ys);
+		if ( ny < 0 || ny >= samples-1 ) continue;
+
+		rows.cell[v] = ny;
+		rows.weight[v] = (yf - ny*ys - yv)/ys;	// yd/ys, the weight of row ny+1
+	}
+}
+
+
+bool NDPluginEfficiencyCorrection::grid_depends_on_beam_energy ( const efficiency_grid_type &grid ) {
+
+	for ( auto slice = grid.begin(); slice != grid.end(); slice++ ) {
+
+		if ( slice->beam_energy != grid.begin()->beam_energy ) return true;
+	}
+	return false;
+}
+
+
+/** The slices of each beam energy are interpolated in iris diameter, and the two energies which bracket the
+  * beam energy are interpolated between; a grid with a single energy is only interpolated in iris diameter.
+  */
+bool NDPluginEfficiencyCorrection::weigh_grid_slices ( const efficiency_grid_type &grid, const efficiency_correction_table_parameters_t &parameters, std::vector< std::pair<size_t,float> > &weights ) {
+
+	weights.clear();
+
+	std::vector<float> energies;
+	for ( auto slice = grid.begin(); slice != grid.end(); slice++ ) {
+
+		energies.push_back ( slice->beam_energy );
+	}
+	std::sort ( energies.begin(), energies.end() );
+	energies.erase ( std::unique ( energies.begin(), energies.end() ), energies.end() );
+
+	if ( energies.empty() ) return false;
+
+	// pick the two beam energies which bracket the given beam energy
+	float energy_lower = energies.front(), energy_upper = energies.front(), t = 0.;
+	if ( 1 < energies.size() ) {
+
+		auto upper = std::lower_bound ( energies.begin(), energies.end(), (float)parameters.beam_energy );
+		if ( upper == energies.end() || (*upper != (float)parameters.beam_energy && upper == energies.begin()) ) {
+
+			asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s(beamenergy=%f): Beam energy is outside the range of interpolation.\n", pluginName, __func__, parameters.beam_energy );
+			return false;
+		}
+
+		energy_upper = *upper;
+		energy_lower = (*upper == (float)parameters.beam_energy)? *upper: *(upper - 1);
+		t = (energy_lower == energy_upper)? 0.: (parameters.beam_energy - energy_lower) / (energy_upper - energy_lower);
+	}
+
+	const float layer_energy[] = { energy_lower, energy_upper };
+	const float layer_weight[] = { 1.f - t, t };
+
+	for ( size_t layer = 0; layer < 2; layer++ ) {
+
+		if ( 0. == layer_weight[layer] || (1 == layer && energy_lower == energy_upper) ) continue;
+
+		// pick the two grid slices of this energy which bracket the given iris diameter
+		size_t lowerbound = grid.size(), upperbound = grid.size();
+		for ( size_t i = 0; i < grid.size(); i++ ) {
+
+			if ( grid[i].beam_energy != layer_energy[layer] ) continue;
+
+			if ( grid[i].iris_diameter <= parameters.iris_diameter && (lowerbound == grid.size() || grid[i].iris_diameter >= grid[lowerbound].iris_diameter) ) lowerbound = i;
+			if ( grid[i].iris_diameter >= parameters.iris_diameter && (upperbound == grid.size() || grid[i].iris_diameter < grid[upperbound].iris_diameter) ) upperbound = i;
+		}
+
+		if ( lowerbound == grid.size() || upperbound == grid.size() ) {
+
+			asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s(irisdiameter=%f): Iris diameter is outside the range of interpolation.\n", pluginName, __func__, parameters.iris_diameter );
+			return false;
+		}
+
+		/* Interpolate the iris diameter */
+		const float d0 = grid[lowerbound].iris_diameter;
+		const float d1 = grid[upperbound].iris_diameter;
+		const float s = (d0 == d1)? 1.0: (parameters.iris_diameter - d0) / (d1 - d0);
+
+		const size_t bracket[] = { lowerbound, upperbound };
+		const float bracket_weight[] = { layer_weight[layer]*(1.f - s), layer_weight[layer]*s };
+
+		for ( size_t i = 0; i < 2; i++ ) {
+
+			if ( 0. == bracket_weight[i] ) continue;
+
+			auto weight = weights.begin();
+			while ( weight != weights.end() && weight->first != bracket[i] ) weight++;
+
+			if ( weight == weights.end() ) weights.push_back ( std::make_pair ( bracket[i], bracket_weight[i] ) );
+			else weight->second += bracket_weight[i];
+		}
+	}
+
+	return !weights.empty();
+}
+
+
+void NDPluginEfficiencyCorrection::render_grid_slice ( const Configuration &configuration, const grid_slice &slice, std::vector<float> &rendered ) {
+
+	const size_t oimage_width = configuration.get_output_image_width();
+	const size_t oimage_height = configuration.get_output_image_height();
+
+	axis_interpolation_t columns, rows;
+	interpolate_grid_slice_columns ( slice, configuration, columns );
+	interpolate_grid_slice_rows ( slice, configuration, rows );
+
+	rendered.resize ( oimage_width * oimage_height );
+	for ( size_t v = 0; v < oimage_height; v++ ) {
+
+		interpolate_grid_slice_row ( slice, columns, rows, v, &rendered[v*oimage_width] );
+	}
+}
+
+
+void NDPluginEfficiencyCorrection::interpolate_grid_slice_row ( const grid_slice &slice, const axis_interpolation_t &columns, const axis_interpolation_t &rows, const size_t v, float *values ) {
+
+	const size_t width = columns.cell.size();
+	const int ny = rows.cell[v];
+
+	if ( ny >= (int)slice.data.get_rows() ) {
+
+		std::fill ( values, values + width, 0.f );
+		return;
+	}
+
+	const float wy = rows.weight[v];
+	const float *row1 = slice.data.row ( ny+1 );
+	const float *row2 = slice.data.row ( ny );
+	const int *cell = &columns.cell[0];
+	const float *weight = &columns.weight[0];
+
+	/* Columns outside the slice point at the zero padding, so every pixel takes the same path */
+	for ( size_t u = 0; u < width; u++ ) {
+
+		const int nx = cell[u];
+		const float wx = weight[u];
+		const float fR1 = row1[nx] + wx*(row1[nx+1] - row1[nx]);
+		const float fR2 = row2[nx] + wx*(row2[nx+1] - row2[nx]);
+		values[u] = fR2 + wy*(fR1 - fR2);
+	}
+}
+
+
+/** Performs a two dimensional bilinear interpolation of the grid_slice data **/
+float NDPluginEfficiencyCorrection::interpolate_grid_slice ( const grid_slice &slice, const float x, const float y ) {
+
+	float value = 0.;
+	interpolate_grid_slice_points ( slice, &x, &y, 1, &value );
+	return value;
+}
+
+
+/** Performs the bilinear interpolation of interpolate_grid_slice at count points.
+  * Points outside the slice are moved to the zero padding cell instead of returning early, so the loop body is the same for every point.
+  */
+void NDPluginEfficiencyCorrection::interpolate_grid_slice_points ( const grid_slice &slice, const float *x, const float *y, const size_t count, float *values ) {
+
+	if ( slice.data.empty() ) {
+
+		std::fill ( values, values + count, 0.f );
+		return;
+	}
+
+	const float &ys = slice.roi_height_stride;
+	const float &yf = slice.roi_yf;
+	const float &xs = slice.roi_width_stride;
+	const float &xi = slice.roi_xi;
+	const int rows = (int)slice.data.get_rows();
+	const int columns = (int)slice.data.get_columns();
+	const size_t row_stride = slice.data.get_row_stride();
+	const float *samples = slice.data.row ( 0 );
+
+	for ( size_t i = 0; i < count; i++ ) {
+
+		int ny = -ceil((y[i]-yf)/ys);
+		float yd = yf - ny*ys - y[i];	// yd = y2 - y
+		int nx = floor((x[i]-xi)/xs);
+		float xd = x[i] - xi - nx*xs;	// xd = x - x1
+
+		const bool inside = (ny >= 0) && (ny < rows-1) && (nx >= 0) && (nx < columns-1);
+		ny = inside? ny: rows;
+		nx = inside? nx: columns;
+		yd = inside? yd: 0.f;
+		xd = inside? xd: 0.f;
+
+		const float *row2 = samples + ny * row_stride;
+		const float *row1 = row2 + row_stride;
+
+		const float fR1 = ((xs-xd)*row1[nx] + xd*row1[nx+1])/xs;
+		const float fR2 = ((xs-xd)*row2[nx] + xd*row2[nx+1])/xs;
+		values[i] = (yd*fR1 + (ys-yd)*fR2)/ys;
+	}
+}
+
+
+#ifdef USE_OPENCV
+/** Creates the efficiency table using grid data and view screen calibration
+ */
+bool NDPluginEfficiencyCorrection::create_efficiency_correction_table ( const vector<grid_slice> &grid, const float iris_diameter, Mat &table ) {
+
+	table.create ( ny, nx, CV_32FC1 );
+
+	// pick the two grid slices which bracket the given iris diameter
+	auto lowerbound = grid.rbegin();
+	while ( lowerbound != grid.rend() ) {
+
+		if (lowerbound->iris_diameter <= iris_diameter ) { break; }
+		lowerbound++;
+	}
+	auto upperbound = grid.begin();
+	while ( upperbound != grid.end() ) {
+
+		if (upperbound->iris_diameter >= iris_diameter ) { break; }
+		upperbound++;
 	}
 
 	if ( upperbound == grid.end() ) {
 
-		asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s:%s(irisdiameter=%f): Iris diameter is outside the range of interpolation.\n", pluginName, __func__, parameters.iris_diameter );
+		cout << "No upper bound found" << endl;
 		return false;
 	}
 	if ( lowerbound == grid.rend() ) {
 
-		asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s(irisdiameter=%f): Iris diameter is outside the range of interpolation.\n", pluginName, __func__, parameters.iris_diameter );
+		cout << "No lower bound found" << endl;
 		return false;
 	}
 
-	/* Interpolate the iris diameter */
-	const float d0 = lowerbound->iris_diameter;
-	const float d1 = upperbound->iris_diameter;
-	const float s = (d0 == d1)? 1.0: (parameters.iris_diameter - d0) / (d1 - d0);
-
-	const size_t oimage_width = this->get_output_image_width();
-	const size_t oimage_height = this->get_output_image_height();
+	const float x0 = lowerbound->iris_diameter;
+	const float x1 = upperbound->iris_diameter;
+	const float s = (x0 == x1)? 1.0: (iris_diameter - x0) / (x1 - x0);
 
-	for ( size_t v = 0; v < oimage_height; v++ ) {
+	for ( size_t v = 0; v < ny; v++ ) {
 
-		for ( size_t u = 0; u < oimage_width; u++ ) {
+		const float y = yf - (v +0.5)*dy;
+		for ( size_t u = 0; u < nx; u++ ) {
 
-			double x, y;
-			this->oimage_to_beamspace ( u, v, x, y );
+			const float x = xi + (u+0.5)*dx;
 
-			const float y0 = interpolate_grid_slice( *lowerbound, x, y );
-			const float y1 = interpolate_grid_slice( *upperbound, x, y );
+			const float y0 = interpolate_slice( *lowerbound, x, y );
+			const float y1 = interpolate_slice( *upperbound, x, y );
 			const float efficiency = y0 + (y1 - y0)*s;
 
-			const float e0 = interpolate_grid_slice( *lowerbound, 0., 0. );
-			const float e1 = interpolate_grid_slice( *upperbound, 0., 0. );
+			const float e0 = interpolate_slice( *lowerbound, 0., 0. );
+			const float e1 = interpolate_slice( *upperbound, 0., 0. );
 			const float norm = e0 + (e1 - e0)*s;
 
-			#ifdef USE_OPENCV
-			table.at<float>(v, u) = (efficiency == 0.)? 0.: norm / efficiency;
-			#else
-			table[v*oimage_width + u] = (efficiency == 0.)? 0.: norm / efficiency;
-			#endif
+			if ( efficiency == 0. ) {
+
+				table.at<float>(v, u) = 0.;
+			}
+			else {
+
+				table.at<float>(v, u) = norm / efficiency;
+			}
 		}
 	}
 
 	return true;
 }
+#else
+static inline float widen_efficiency ( const float efficiency ) {
+
+	return efficiency;
+}
+
+static inline float widen_efficiency ( const epicsUInt16 efficiency ) {
+
+	return ViewScreenConfiguredNDPlugin::CorrectionTable::half_to_float ( efficiency );
+}
+
+/** Adds a weighted rendered slice to the efficiencies, or sets them to it for the first slice */
+template <typename T>
+static void blend_rendered_slice ( const T *slice, const float w, const bool first, float *efficiency, const size_t pixels ) {
+
+	if ( first ) {
+
+		for ( size_t i = 0; i < pixels; i++ ) efficiency[i] = w*widen_efficiency ( slice[i] );
+	}
+	else {
+
+		for ( size_t i = 0; i < pixels; i++ ) efficiency[i] += w*widen_efficiency ( slice[i] );
+	}
+}
+
+/** Creates the efficiency table using grid data and view screen calibration
+ */
+bool NDPluginEfficiencyCorrection::create_efficiency_correction_table ( const Configuration &configuration, const efficiency_grid_type &grid, const efficiency_correction_table_parameters_t parameters, const bool half_precision, rendered_slices_type &rendered_slices, CorrectionTable &table ) {
+
+	/* Ensure that we have a grid of calibration points */
+	if ( grid.empty() ) {
+
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s:%s: Aborting; efficiency data unavailable for material=%s, light=%s.\n", pluginName, __func__, parameters.target_material.c_str(), parameters.target_light_distribution.c_str() );
+		return false;
+	}
+
+	const size_t oimage_width = configuration.get_output_image_width();
+	const size_t oimage_height = configuration.get_output_image_height();
+	const size_t pixels = oimage_width * oimage_height;
+
+	table.values.clear ();
+	table.values.resize ( pixels );
+	table.half_values.clear ();
+	table.max_relative_error = 0.;
+
+	std::vector< std::pair<size_t,float> > weights;
+	if ( !weigh_grid_slices ( grid, parameters, weights ) ) {
+
+		return false;
+	}
+
+	if ( (0 == parameters.target_light_distribution.compare ( "otr" )) && !grid_depends_on_beam_energy ( grid ) ) {
+
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::%s: The efficiency maps of the OTR target have no beam energy; the correction doesn't account for it.\n", pluginName, __func__ );
+	}
+
+	/* The efficiency at the origin normalizes the table */
+	float norm = 0.;
+	for ( auto weight = weights.begin(); weight != weights.end(); weight++ ) {
+
+		norm += weight->second * interpolate_grid_slice ( grid[weight->first], 0., 0. );
+	}
+
+	/* Each slice is rendered at output resolution once; after that, a machine state between rendered slices only needs a blend */
+	if ( rendered_slices.size() != grid.size() ) rendered_slices.assign ( grid.size(), rendered_slices_type::value_type () );
+
+	for ( auto weight = weights.begin(); weight != weights.end(); weight++ ) {
+
+		if ( rendered_slices[weight->first] && rendered_slices[weight->first]->size() == pixels ) continue;
+
+		std::shared_ptr<CorrectionTable> rendered ( new CorrectionTable () );
+		render_grid_slice ( configuration, grid[weight->first], rendered->values );
+		if ( half_precision ) rendered->reduce_precision ();
+		rendered_slices[weight->first] = rendered;
+	}
+
+	float *efficiency = &table.values[0];
+	double slice_error = 0.;
+
+	for ( auto weight = weights.begin(); weight != weights.end(); weight++ ) {
+
+		const CorrectionTable &rendered = *rendered_slices[weight->first];
+		const bool first = (weight == weights.begin());
+
+		if ( rendered.is_half_precision() ) blend_rendered_slice ( &rendered.half_values[0], weight->second, first, efficiency, pixels );
+		else blend_rendered_slice ( &rendered.values[0], weight->second, first, efficiency, pixels );
+
+		slice_error = std::max ( slice_error, rendered.max_relative_error );
+	}
+
+	for ( size_t i = 0; i < pixels; i++ ) {
+
+		efficiency[i] = (efficiency[i] == 0.)? 0.: norm / efficiency[i];
+	}
+
+	/* A blend of efficiencies is as accurate as its least accurate slice; the reciprocal of a value with relative error e
+	 * is off by at most e / (1 - e) */
+	table.max_relative_error = (slice_error < 1.)? slice_error / (1. - slice_error): slice_error;
+	if ( half_precision ) table.reduce_precision ();
+
+	return true;
+}
 #endif
 
 
+/** The efficiency map reader **/
+static inline bool is_map_whitespace ( const char c ) {
+
+	return (' ' == c) || ('\n' == c) || ('\t' == c) || ('\r' == c) || ('\v' == c) || ('\f' == c);
+}
+
+static inline bool is_map_digit ( const char c ) {
+
+	return ('0' <= c) && ('9' >= c);
+}
+
+/** Returns 10^exponent; the powers which a double represents exactly come from a table */
+static double power_of_ten ( const int exponent ) {
+
+	static const double exact_powers[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+	if ( (0 <= exponent) && (exponent < (int)(sizeof(exact_powers)/sizeof(exact_powers[0]))) ) {
+
+		return exact_powers[exponent];
+	}
+	return pow ( 10., exponent );
+}
+
+/** Converts a decimal number in [position,end) which is followed by whitespace or the end of the data.
+  * This accepts what operator>> accepts for the files we write: an optional sign, digits with an optional
+  * decimal point and an optional exponent. On success, position is moved past the number.
+  */
+static bool parse_map_number ( const char *&position, const char *end, double &value ) {
+
+	const char *p = position;
+
+	bool negative = false;
+	if ( (p != end) && (('-' == *p) || ('+' == *p)) ) {
+
+		negative = ('-' == *p);
+		p++;
+	}
+
+	// the first 19 significant digits fit in the mantissa; the rest only change the exponent
+	unsigned long long mantissa = 0;
+	int significant_digits = 0;
+	int exponent = 0;
+	bool has_digits = false;
+
+	for ( ; (p != end) && is_map_digit ( *p ); p++ ) {
+
+		has_digits = true;
+		if ( significant_digits < 19 ) {
+
+			mantissa = 10*mantissa + (*p - '0');
+			if ( 0 != mantissa ) significant_digits++;
+		}
+		else {
+
+			exponent++;
+		}
+	}
+
+	if ( (p != end) && ('.' == *p) ) {
+
+		for ( p++; (p != end) && is_map_digit ( *p ); p++ ) {
+
+			has_digits = true;
+			if ( significant_digits < 19 ) {
+
+				mantissa = 10*mantissa + (*p - '0');
+				if ( 0 != mantissa ) significant_digits++;
+				exponent--;
+			}
+		}
+	}
+
+	if ( !has_digits ) return false;
+
+	if ( (p != end) && (('e' == *p) || ('E' == *p)) ) {
+
+		const char *q = p + 1;
+		bool negative_exponent = false;
+		if ( (q != end) && (('-' == *q) || ('+' == *q)) ) {
+
+			negative_exponent = ('-' == *q);
+			q++;
+		}
+
+		if ( (q != end) && is_map_digit ( *q ) ) {
+
+			int explicit_exponent = 0;
+			for ( ; (q != end) && is_map_digit ( *q ); q++ ) {
+
+				if ( explicit_exponent < 10000 ) explicit_exponent = 10*explicit_exponent + (*q - '0');
+			}
+			exponent += negative_exponent? -explicit_exponent: explicit_exponent;
+			p = q;
+		}
+	}
+
+	if ( (p != end) && !is_map_whitespace ( *p ) ) return false;
+
+	double result = (double)mantissa;
+	if ( 0 > exponent ) {
+
+		result /= power_of_ten ( -exponent );
+	}
+	else if ( 0 < exponent ) {
+
+		result *= power_of_ten ( exponent );
+	}
+
+	value = negative? -result: result;
+	position = p;
+	return true;
+}
+
+
+NDPluginEfficiencyCorrection::EfficiencyMapFile::EfficiencyMapFile ( const std::string filename ):
+	open ( false ),
+	mapping ( MAP_FAILED ),
+	mapping_length ( 0 ),
+	position ( NULL ),
+	end ( NULL ) {
+
+	const int fd = ::open ( filename.c_str(), O_RDONLY );
+	if ( fd < 0 ) return;
+
+	struct stat status;
+	if ( 0 != fstat ( fd, &status ) ) {
+
+		::close ( fd );
+		return;
+	}
+
+	if ( 0 < status.st_size ) {
+
+		this->mapping = mmap ( NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	}
+
+	if ( MAP_FAILED != this->mapping ) {
+
+		this->mapping_length = (size_t)status.st_size;
+		#ifdef MADV_SEQUENTIAL
+		madvise ( this->mapping, this->mapping_length, MADV_SEQUENTIAL );
+		#endif
+		this->position = (const char*)this->mapping;
+		this->end = this->position + this->mapping_length;
+		this->open = true;
+	}
+	else {
+
+		/* Files which can't be mapped (empty ones, or special files) are read into memory */
+		char chunk[65536];
+		ssize_t length;
+		while ( 0 < (length = ::read ( fd, chunk, sizeof(chunk) )) ) {
+
+			this->buffer.insert ( this->buffer.end(), chunk, chunk + length );
+		}
+
+		if ( 0 == length ) {
+
+			this->position = this->buffer.empty()? NULL: &this->buffer[0];
+			this->end = this->position + this->buffer.size();
+			this->open = true;
+		}
+	}
+
+	::close ( fd );
+}
+
+
+NDPluginEfficiencyCorrection::EfficiencyMapFile::~EfficiencyMapFile () {
+
+	if ( MAP_FAILED != this->mapping ) {
+
+		munmap ( this->mapping, this->mapping_length );
+	}
+}
+
+
+bool NDPluginEfficiencyCorrection::EfficiencyMapFile::read_token ( std::string &token ) {
+
+	while ( (this->position != this->end) && is_map_whitespace ( *this->position ) ) this->position++;
+
+	const char *token_begin = this->position;
+	while ( (this->position != this->end) && !is_map_whitespace ( *this->position ) ) this->position++;
+
+	token.assign ( token_begin, this->position );
+	return !token.empty();
+}
+
+
+bool NDPluginEfficiencyCorrection::EfficiencyMapFile::read ( float &value ) {
+
+	const char *p = this->position;
+	while ( (p != this->end) && is_map_whitespace ( *p ) ) p++;
+
+	double number;
+	if ( !parse_map_number ( p, this->end, number ) ) return false;
+
+	value = (float)number;
+	this->position = p;
+	return true;
+}
+
+
+bool NDPluginEfficiencyCorrection::EfficiencyMapFile::read ( int &value ) {
+
+	const char *p = this->position;
+	while ( (p != this->end) && is_map_whitespace ( *p ) ) p++;
+
+	double number;
+	if ( !parse_map_number ( p, this->end, number ) ) return false;
+
+	/* Sample counts are sometimes written with a decimal point */
+	if ( (number != floor ( number )) || (fabs ( number ) > 2147483647.) ) return false;
+
+	value = (int)number;
+	this->position = p;
+	return true;
+}
+
+
+void NDPluginEfficiencyCorrection::EfficiencyMapFile::skip_line () {
+
+	while ( (this->position != this->end) && ('\n' != *this->position) ) this->position++;
+	if ( this->position != this->end ) this->position++;
+}
+
+
 /** These are the helper functions for reading and loading the map **/
 template <typename T>
-bool NDPluginEfficiencyCorrection::read_parameter( ifstream &stream, T &mapread, string &parameter_name ) {
+bool NDPluginEfficiencyCorrection::read_parameter( EfficiencyMapFile &mapfile, T &mapread, string &parameter_name ) {
 
 	if ( mapread.count(parameter_name) == 1) {
 
-		stream >> (*get<0>(mapread[parameter_name]));
-		get<1>(mapread[parameter_name]) = true;
+		get<1>(mapread[parameter_name]) = mapfile.read ( *get<0>(mapread[parameter_name]) );
 		return true;
 	}
 	return false;
 }
 
 template <typename T, typename T_param>
-bool NDPluginEfficiencyCorrection::read_vectorparameter( ifstream &stream, T &mapread, string &parameter_name ) {
+bool NDPluginEfficiencyCorrection::read_vectorparameter( EfficiencyMapFile &mapfile, T &mapread, string &parameter_name ) {
 
 	if ( mapread.count(parameter_name) ) {
 
 		get<2>(mapread[parameter_name]) = true;
 		auto &vec = get<1>(mapread[parameter_name]);
 		T_param value;
-		while ( stream >> value ) {
+		while ( mapfile.read ( value ) ) {
 
 			vec.push_back(value);
 		}
-		stream.clear();
 		return true;
 	}
 	return false;
@@ -2,23 +2,37 @@
 #define NDPluginEfficiencyCorrection_H
 
 #include <epicsTypes.h>
+#include <epicsMutex.h>
+#include <epicsEvent.h>
 #include <asynStandardInterfaces.h>
 #ifdef USE_OPENCV
  #include "opencv2/core/core.hpp"
 #endif
 
-#include <fstream>
 #include <tuple>
 #include <vector>
 #include <string>
+#include <map>
+#include <list>
+#include <memory>
 
 #include "ViewScreenConfiguredNDPlugin.h"
+#include "EfficiencyMaps.h"
 
 /** Map parameter enums to strings that will be used to set up EPICS databases
   */
 #define NDPluginEfficiencyCorrectionCurrentTargetNumberString	"CURRENT_TARGET_NUMBER"
 #define NDPluginEfficiencyCorrectionCurrentIrisDiameterString	"CURRENT_IRIS_DIAMETER"
 #define NDPluginEfficiencyCorrectionCurrentBeamEnergyString		"CURRENT_BEAM_ENERGY"
+#define NDPluginEfficiencyCorrectionGridStatusString			"EFFICIENCY_GRID_STATUS"
+#define NDPluginEfficiencyCorrectionGridPrefetchString			"EFFICIENCY_GRID_PREFETCH"
+#define NDPluginEfficiencyCorrectionGridMemoryLimitString		"EFFICIENCY_GRID_MEMORY_LIMIT"
+#define NDPluginEfficiencyCorrectionIrisToleranceString			"EFFICIENCY_TABLE_IRIS_TOLERANCE"
+#define NDPluginEfficiencyCorrectionEnergyToleranceString		"EFFICIENCY_TABLE_ENERGY_TOLERANCE"
+#define NDPluginEfficiencyCorrectionTableCacheSizeString		"EFFICIENCY_TABLE_CACHE_SIZE"
+#define NDPluginEfficiencyCorrectionTablePrecisionString		"EFFICIENCY_TABLE_PRECISION"
+#define NDPluginEfficiencyCorrectionTableErrorString			"EFFICIENCY_TABLE_ERROR"
+#define NDPluginEfficiencyCorrectionTableMemoryString			"EFFICIENCY_TABLE_MEMORY"
 
 /** Perform a magnification correction on NDArrays.   */
 class NDPluginEfficiencyCorrection : public ViewScreenConfiguredNDPlugin {
@@ -26,32 +40,55 @@ public:
     NDPluginEfficiencyCorrection(const char *portName, int queueSize, int blockingCallbacks,
                  const char *NDArrayPort, int NDArrayAddr,
                  int maxBuffers, size_t maxMemory,
-                 int priority, int stackSize);
+                 int priority, int stackSize, int maxScreens);
     /* These methods override the virtual methods in the base class */
     void processCallbacks(NDArray *pArray);
 
     /* These methods are unique to this class */
 
+	/** Loads the efficiency grids which have been requested; run by the grid loader thread */
+	void load_requested_efficiency_grids ();
+
+	/** Creates the efficiency correction tables which the screens are waiting for; run by the table builder thread */
+	void build_requested_efficiency_tables ();
+
+	/** ViewScreenConfiguredNDPlugin::get_output_correction */
+	std::shared_ptr<const CorrectionTable> get_output_correction ( const int addr, const size_t pixels, bool &stale_table );
+
 protected:
 
 	#define FIRST_NDPluginEfficiencyCorrection_PARAM NDPluginEfficiencyCorrectionCurrentTargetNumber
 	int NDPluginEfficiencyCorrectionCurrentTargetNumber;
 	int NDPluginEfficiencyCorrectionCurrentIrisDiameter;
 	int NDPluginEfficiencyCorrectionCurrentBeamEnergy;
-	#define LAST_NDPluginEfficiencyCorrection_PARAM NDPluginEfficiencyCorrectionCurrentBeamEnergy
+	int NDPluginEfficiencyCorrectionGridStatus;
+	int NDPluginEfficiencyCorrectionGridPrefetch;
+	int NDPluginEfficiencyCorrectionGridMemoryLimit;
+	int NDPluginEfficiencyCorrectionIrisTolerance;
+	int NDPluginEfficiencyCorrectionEnergyTolerance;
+	int NDPluginEfficiencyCorrectionTableCacheSize;
+	int NDPluginEfficiencyCorrectionTablePrecision;
+	int NDPluginEfficiencyCorrectionTableError;
+	int NDPluginEfficiencyCorrectionTableMemory;
+	#define LAST_NDPluginEfficiencyCorrection_PARAM NDPluginEfficiencyCorrectionTableMemory
 
-private:
+	/** The state of the efficiency grid of the current target of a screen */
+	typedef enum {
+		EfficiencyGridReady = 0,
+		EfficiencyGridLoading = 1,
+		EfficiencyGridUnavailable = 2
+	} EfficiencyGridStatus_t;
 
-	typedef std::vector<std::vector<float>> grid_type;
+	/** How the correction tables and rendered slices of the screens are stored */
+	typedef enum {
+		EfficiencyTableFloat32 = 0,
+		EfficiencyTableFloat16 = 1
+	} EfficiencyTablePrecision_t;
 
-	struct grid_slice {
-		grid_type data;
-		float iris_diameter;
-		float roi_width_stride; // the positive distance between two x-coordinates
-		float roi_height_stride; // positive positive distance between two y-coordinates
-		float roi_xi; // the x-value of the left-most row
-		float roi_yf; // the y-value of the upper-most row
-	};
+private:
+
+	typedef efficiency_map_samples grid_type;
+	typedef efficiency_map_slice grid_slice;
 
 	struct efficiency_correction_table_parameters_t {
 
@@ -72,41 +109,218 @@ private:
 		};
 	};
 
+	typedef std::vector<grid_slice> efficiency_grid_type;
+
+	/** The efficiency of each slice of a grid at the resolution of the output image; NULL until a slice is needed */
+	typedef std::vector< std::shared_ptr<const CorrectionTable> > rendered_slices_type;
+
+	/** Where the grid of a target comes from */
+	struct efficiency_grid_source_t {
+
+		std::string directory;
+		unsigned long long signature;	// identifies the names, sizes and modification times of the map files; 0 if unknown
+
+		efficiency_grid_source_t (): directory ( "" ), signature ( 0 ) {};
+	};
+
+	/** The map directories of the targets of a configuration; the grids themselves are loaded by the plugin when a target is first used */
+	class EfficiencyCorrectionTables: public ConfigurationTables {
+
+		public:
+			std::map<TargetInfo,efficiency_grid_source_t> efficiency_grid_sources;
+			size_t memory_usage () const { return 0; };
+	};
+
+	/** An efficiency grid which has been requested from the grid loader thread */
+	struct loaded_grid_t {
+
+		unsigned long long signature;	// the signature of the map files the grid was requested for
+		std::shared_ptr<const efficiency_grid_type> grid;	// NULL until loaded
+		EfficiencyGridStatus_t status;
+		bool requested;		// waiting for the loader thread
+		bool prefetch;		// only requested as the neighbour of a target in use
+		size_t last_used;
+
+		loaded_grid_t (): signature ( 0 ), status ( EfficiencyGridLoading ), requested ( false ), prefetch ( false ), last_used ( 0 ) {};
+	};
+
+	/** Everything needed to correct a frame; taken under the lock and used without it */
+	struct correction_snapshot_t {
+
+		std::shared_ptr<const CorrectionTable> efficiency_correction_table;
+		bool stale_table;	// the table is the one of a previous machine state, applied while the current one is built
+		bool pass_through;	// the frame is passed on uncorrected while the grid or the first table of its target is prepared
+
+		correction_snapshot_t (): stale_table ( false ), pass_through ( false ) {};
+	};
+
+	/** A correction table created for a machine state */
+	struct cached_correction_table_t {
+
+		efficiency_correction_table_parameters_t parameters;
+		std::shared_ptr<const CorrectionTable> table;
+	};
+
+	/** The correction state of one screen */
+	struct screen_correction_t {
+
+		std::shared_ptr<const EfficiencyCorrectionTables> tables;
+		std::shared_ptr<const efficiency_grid_type> grid;	// the grid of the current target
+		std::list<cached_correction_table_t> efficiency_correction_tables;	// created from the grid; the most recently used first
+		rendered_slices_type rendered_slices;
+
+		efficiency_correction_table_parameters_t requested_parameters;	// the machine state whose table the builder thread should create next
+		efficiency_correction_table_parameters_t building_parameters;	// the machine state whose table is being created
+		bool table_requested;
+		bool table_building;
+		bool half_precision;	// the precision of the tables and rendered slices
+
+		screen_correction_t (): table_requested ( false ), table_building ( false ), half_precision ( false ) {};
+
+		/** The bytes held by the correction tables and rendered slices */
+		size_t memory_usage () const;
+	};
+
+	/** An efficiency map file, memory-mapped and read in place.
+	 *  Numbers are converted without the C library or iostreams, so the conversion doesn't depend on the locale.
+	 */
+	class EfficiencyMapFile {
+
+		public:
+			EfficiencyMapFile ( const std::string filename );
+			~EfficiencyMapFile ();
+			bool is_open () const { return open; };
+
+			/** Reads the next whitespace-delimited token */
+			bool read_token ( std::string &token );
+			/** Read the next number; on failure, nothing is consumed */
+			bool read ( float &value );
+			bool read ( int &value );
+			/** Skips the rest of the current line */
+			void skip_line ();
+
+		private:
+			EfficiencyMapFile ( const EfficiencyMapFile& );
+			EfficiencyMapFile& operator= ( const EfficiencyMapFile& );
+
+			bool open;
+			void *mapping;
+			size_t mapping_length;
+			std::vector<char> buffer;	// holds the contents if the file can't be mapped
+			const char *position, *end;
+	};
+
+	/** An efficiency map file to be loaded into its slot of a target's grid */
+	struct efficiency_map_job_t {
+
+		std::string filename;
+		grid_slice *slice;
+		TargetInfo target_info;
+		ConfigurationStatus_t status;
+
+		efficiency_map_job_t ( const std::string filename, grid_slice *slice, const TargetInfo target_info ): filename ( filename ), slice ( slice ), target_info ( target_info ), status ( ConfigurationStatusUnconfigured ) {};
+	};
+
+	/** The efficiency map files loaded by a pool of threads */
+	struct efficiency_map_loader_t {
+
+		NDPluginEfficiencyCorrection *plugin;
+		std::vector<efficiency_map_job_t> *jobs;
+	};
+
 	/** The following functions are for loading and reading the efficiency maps **/
-	template <typename T> bool read_parameter ( std::ifstream &stream, T &mapread, std::string &parameter_name );
-	template <typename T, typename T_param> bool read_vectorparameter ( std::ifstream &stream, T &mapread, std::string &parameter_name );
+	template <typename T> bool read_parameter ( EfficiencyMapFile &mapfile, T &mapread, std::string &parameter_name );
+	template <typename T, typename T_param> bool read_vectorparameter ( EfficiencyMapFile &mapfile, T &mapread, std::string &parameter_name );
 	template <typename T> bool check_parameters ( T &mapcheck );
 	template< typename T> bool check_vector_parameters ( T &mapcheck );
 
-	/** Calculates the number of rays which were emitted by the foil and collected within a specific distance of the brightest pixel on the ccd **/
-	float count_collected_rays ( std::vector <std::tuple<size_t, size_t, float> > &psfdata, const size_t nearest_max_points, const float nearest_max_radius );
-
 	/** Transfers the efficiency map from the file to the grid_slice structure **/
 	ConfigurationStatus_t load_efficiency_map ( std::string filename, grid_slice &slice, const ViewScreenConfiguredNDPlugin::TargetInfo );
 
-	/** Loads all of the efficiency maps from directory into the grid **/
-	ConfigurationStatus_t load_efficiency_maps ( std::vector<grid_slice> &grid, std::string directory, const ViewScreenConfiguredNDPlugin::TargetInfo );
+	/** Lists the efficiency map files in directory in sorted order **/
+	ConfigurationStatus_t list_efficiency_maps ( const std::string directory, std::vector<std::string> &filenames );
+
+	/** Fills the grid from the binary cache in directory, if there is one with a matching signature **/
+	bool read_efficiency_grid_cache ( const std::string directory, const unsigned long long signature, std::vector<grid_slice> &grid );
+
+	/** Writes the grid to the binary cache in directory; failing to write it only costs the next load its speed **/
+	void write_efficiency_grid_cache ( const std::string directory, const unsigned long long signature, const std::vector<grid_slice> &grid );
+
+	/** Loads the grid of a map directory from its cache or its map files, and refreshes the cache; called without the port lock **/
+	ConfigurationStatus_t load_efficiency_grid ( const std::string directory, efficiency_grid_type &grid );
+
+	/** Returns the grid of a source if it's loaded, and otherwise asks the grid loader thread for it; called from a locked state **/
+	std::shared_ptr<const efficiency_grid_type> request_efficiency_grid ( const efficiency_grid_source_t &source, const bool prefetch );
+
+	/** Drops the least recently used grids which no screen is using until the rest fit in the memory limit; called from a locked state **/
+	void evict_efficiency_grids ();
+
+	/** Asks the table builder thread for the table of a screen's machine state, unless it's already being created; called from a locked state **/
+	void request_efficiency_correction_table ( const int addr, const efficiency_correction_table_parameters_t &parameters );
+
+	/** Loads the efficiency map file of every job on a bounded pool of threads and sets the status of each job **/
+	void load_efficiency_maps ( std::vector<efficiency_map_job_t> &jobs );
+	static void load_efficiency_map_job ( void *loader, const size_t job );
 
 	/** Performs a two dimensional bilinear interpolation of the grid_slice data
 	 */
 	float interpolate_grid_slice ( const grid_slice &slice, const float x, const float y );
 
+	/** Interpolates a slice at count beamspace points; the loop has no branches, so it can be vectorized */
+	void interpolate_grid_slice_points ( const grid_slice &slice, const float *x, const float *y, const size_t count, float *values );
+
+	/** The grid cells and weights which the bilinear interpolation of a slice uses along one axis of the output image;
+	 *  beamspace x only depends on the column and y only on the row, so these are computed once per table
+	 */
+	struct axis_interpolation_t {
+
+		std::vector<int> cell;		// the lower sample of the cell; the padding past the end of the slice for points outside it
+		std::vector<float> weight;	// the weight of the following sample
+	};
+
+	void interpolate_grid_slice_columns ( const grid_slice &slice, const Configuration &configuration, axis_interpolation_t &columns );
+	void interpolate_grid_slice_rows ( const grid_slice &slice, const Configuration &configuration, axis_interpolation_t &rows );
+
+	/** Interpolates one row of the output image from a slice */
+	void interpolate_grid_slice_row ( const grid_slice &slice, const axis_interpolation_t &columns, const axis_interpolation_t &rows, const size_t v, float *values );
+
 	/** Creates the efficiency table using grid data and view screen calibration
 	 */
 	#ifdef USE_OPENCV
 	bool create_efficiency_correction_table ( const std::vector<grid_slice> &grid, cv::Mat &table );
 	#else
-	bool create_efficiency_correction_table ( const efficiency_correction_table_parameters_t parameters, std::vector<float> &table );
+	bool create_efficiency_correction_table ( const Configuration &configuration, const efficiency_grid_type &grid, const efficiency_correction_table_parameters_t parameters, const bool half_precision, rendered_slices_type &rendered_slices, CorrectionTable &table );
+
+	/** Returns whether the maps of a grid carry more than one beam energy */
+	bool grid_depends_on_beam_energy ( const efficiency_grid_type &grid );
+
+	/** Finds the slices which bracket the iris diameter and beam energy, and their bilinear weights */
+	bool weigh_grid_slices ( const efficiency_grid_type &grid, const efficiency_correction_table_parameters_t &parameters, std::vector< std::pair<size_t,float> > &weights );
+
+	/** Interpolates a slice at every pixel of the output image */
+	void render_grid_slice ( const Configuration &configuration, const grid_slice &slice, std::vector<float> &rendered );
 	#endif
 
+	/** ViewScreenConfiguredNDPlugin::prepare_configuration_tables
+	 *	This function finds the efficiency map directories of the targets of a configuration
+	 */
+	virtual ConfigurationStatus_t prepare_configuration_tables ( const Configuration &configuration, std::shared_ptr<const ConfigurationTables> &tables );
+
+	/** The efficiency map signatures are recomputed when the maps change on disk */
+	virtual bool depends_on_efficiency_maps () const { return true; };
+
 	/** ViewScreenConfiguredNDPlugin::configuration_change_callback
 	 *	This function is called when the configuration changes
 	 */
-	virtual ConfigurationStatus_t configuration_change_callback ();
+	virtual ConfigurationStatus_t configuration_change_callback ( const int addr );
+
+	/** Report the compatibility of the input array and the correction table of its screen, and take a snapshot of the state needed to correct it
+	 */
+	bool preprocess_check ( NDArray *pArray, const int addr, correction_snapshot_t &snapshot );
 
-	/** Report the compatibility of the input array and correction table
+	/** Take a snapshot of the efficiency correction table of a screen's current machine state, for arrays of the given number of pixels
 	 */
-	bool preprocess_check ( NDArray *pArray );
+	bool select_efficiency_correction_table ( const int addr, const size_t pixels, correction_snapshot_t &snapshot );
 
 	/** Carry out the calibration procedure
 	*/
@@ -116,11 +330,16 @@ private:
 	std::map<std::pair<std::string,TargetInfo>,cv::Mat> efficiency_correction_tables;
 	cv::Mat current_efficiency_correction_table;
 	#else
-	std::map<TargetInfo,std::vector<grid_slice>> efficiency_grids;
-	std::vector<float> efficiency_correction_table;
-	efficiency_correction_table_parameters_t efficiency_correction_table_parameters;
+	// one per screen
+	std::vector<screen_correction_t> screen_corrections;
 	#endif
 
+	// the grids requested by the screens, keyed by map directory
+	std::map<std::string,loaded_grid_t> loaded_grids;
+	size_t loaded_grid_clock;		// advanced whenever a grid is used
+	bool efficiency_grid_loader_running;
+	bool efficiency_table_builder_running;
+
 	//std::vector <grid_slice> grid;
 
 	/** Calibration parameters **/
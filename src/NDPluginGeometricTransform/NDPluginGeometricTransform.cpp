@@ -33,10 +33,10 @@ static const char* pluginName = "NDPluginGeometricTransform";
 /** Constructor **/
 NDPluginGeometricTransform::NDPluginGeometricTransform(const char *portName, int queueSize, int blockingCallbacks,
                          const char *NDArrayPort, int NDArrayAddr, int maxBuffers, size_t maxMemory,
-                         int priority, int stackSize):
+                         int priority, int stackSize, int maxScreens):
 	/* Invoke the base class constructor */
 	ViewScreenConfiguredNDPlugin (
-		portName, queueSize, blockingCallbacks, NDArrayPort, NDArrayAddr, 1,
+		portName, queueSize, blockingCallbacks, NDArrayPort, NDArrayAddr, (maxScreens < 1)? 1: maxScreens,
 		NUM_GEOMTRANSFORM_PARAMS, maxBuffers, maxMemory,
 		asynGenericPointerMask,
 		asynGenericPointerMask, ASYN_CANBLOCK, 1, priority, stackSize ) {
@@ -47,6 +47,17 @@ NDPluginGeometricTransform::NDPluginGeometricTransform(const char *portName, int
  	/* Set the plugin type string */
 	setStringParam(NDPluginDriverPluginType, "NDPluginGeometricTransform");
 
+	createParam ( NDPluginGeometricTransformFoldMagnificationPortString, asynParamOctet, &this->NDPluginGeometricTransformFoldMagnificationPort );
+	createParam ( NDPluginGeometricTransformFoldEfficiencyPortString, asynParamOctet, &this->NDPluginGeometricTransformFoldEfficiencyPort );
+
+	/* Nothing is folded into the transformation until the ports of the corrections are named; they apply to all screens */
+	setStringParam ( this->NDPluginGeometricTransformFoldMagnificationPort, "" );
+	setStringParam ( this->NDPluginGeometricTransformFoldEfficiencyPort, "" );
+
+	/* There is no geometric correction table until a configuration is loaded */
+	this->tables.assign ( this->get_screen_count(), std::shared_ptr<const GeometricCorrectionTables> ( new GeometricCorrectionTables () ) );
+	this->folded_tables.assign ( this->get_screen_count(), folded_table_t () );
+
 	/* Try to connect to the array port */
     status = connectToArrayPort();
 }
@@ -64,21 +75,21 @@ struct sort_indices {
 /** NDPluginGeometricTransform::produce_corner_offsets
  * This function produces an array of offsets which can be added to a point in output image-space and produce a counter-clockwise convex quadrilateral in input image-space. If the offsets are not sorted correctly, then they could produce a concave quadrilateral which will cause undefined behaviour during the calibration process.
  */
-std::array< std::tuple<double,double>,4 > NDPluginGeometricTransform::produce_corner_offsets() {
+std::array< std::tuple<double,double>,4 > NDPluginGeometricTransform::produce_corner_offsets ( const Configuration &configuration ) {
 
 	std::array< std::tuple<double,double>,4 > offsets = {{ make_tuple(0.5,0.5), make_tuple(0.5,-0.5), make_tuple(-0.5,0.5), make_tuple(-0.5,-0.5) }};
 
 	#if (__GNUC__ <= 4) && (__GNUC_MINOR__ <= 4)
 	for( size_t i = 0; i < offsets.size(); i++ ) {
-		this->oimage_to_beamspace( get<0>(offsets[i])+(this->get_output_image_width()-1.)/2., get<1>(offsets[i])+(this->get_output_image_height()-1.)/2., get<0>(offsets[i]), get<1>(offsets[i]) );
-		this->beamspace_to_iimage( get<0>(offsets[i]), get<1>(offsets[i]), get<0>(offsets[i]), get<1>(offsets[i]) );
+		configuration.oimage_to_beamspace( get<0>(offsets[i])+(configuration.get_output_image_width()-1.)/2., get<1>(offsets[i])+(configuration.get_output_image_height()-1.)/2., get<0>(offsets[i]), get<1>(offsets[i]) );
+		configuration.beamspace_to_iimage( get<0>(offsets[i]), get<1>(offsets[i]), get<0>(offsets[i]), get<1>(offsets[i]) );
 	}
 	#else
 	std::transform( offsets.begin(), offsets.end(), offsets.begin(),
-		[this] (const std::tuple<float,float> &pt) {
+		[&configuration] (const std::tuple<float,float> &pt) {
 			std::tuple<double,double> new_point;
-			this->oimage_to_beamspace( get<0>(pt)+(this->get_output_image_width()-1.)/2., get<1>(pt)+(this->get_output_image_height()-1.)/2., get<0>(new_point), get<1>(new_point) );
-			this->beamspace_to_iimage( get<0>(new_point), get<1>(new_point), get<0>(new_point), get<1>(new_point) );
+			configuration.oimage_to_beamspace( get<0>(pt)+(configuration.get_output_image_width()-1.)/2., get<1>(pt)+(configuration.get_output_image_height()-1.)/2., get<0>(new_point), get<1>(new_point) );
+			configuration.beamspace_to_iimage( get<0>(new_point), get<1>(new_point), get<0>(new_point), get<1>(new_point) );
 			return new_point;
 		}
 	);
@@ -150,20 +161,18 @@ double NDPluginGeometricTransform::calculate_gpc_polygon_area(gpc_polygon &polyg
 }
 
 
-/** ViewScreenConfiguredNDPlugin::configuration_change_callback
- *	This function is called when the configuration changes
+/** ViewScreenConfiguredNDPlugin::prepare_configuration_tables
+ *	This function builds the geometric correction table for a configuration. It is called without the port lock.
  */
-ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginGeometricTransform::configuration_change_callback() {
-
-	/* This function should be called from a locked state */
+ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginGeometricTransform::prepare_configuration_tables ( const Configuration &configuration, std::shared_ptr<const ConfigurationTables> &tables ) {
 
 	asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "NDPluginMagnificationCorrection::Calibrate: Beginning calibration.\n" );
 
-	const size_t output_image_width = this->get_output_image_width();
-	const size_t output_image_height = this->get_output_image_height();
+	const size_t output_image_width = configuration.get_output_image_width();
+	const size_t output_image_height = configuration.get_output_image_height();
 
-	const size_t input_image_width = this->get_input_image_width();
-	const size_t input_image_height = this->get_input_image_height();
+	const size_t input_image_width = configuration.get_input_image_width();
+	const size_t input_image_height = configuration.get_input_image_height();
 
 
 	if ( 0 == output_image_width || 0 == output_image_height ) {
@@ -171,8 +180,10 @@ ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginGeometricTransform::
 		return ConfigurationStatusBadParameter;
 	}
 
-	this->geometric_correction_table.clear();
-	this->geometric_correction_table.reserve(output_image_width*output_image_height);
+	std::shared_ptr<GeometricCorrectionTables> new_tables ( new GeometricCorrectionTables () );
+	geometric_correction_table_type &geometric_correction_table = new_tables->geometric_correction_table;
+
+	geometric_correction_table.reserve(output_image_width*output_image_height);
 	
 	gpc_polygon subject, clip, result;
 	
@@ -197,7 +208,7 @@ ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginGeometricTransform::
 	//const double pixel_height = output_image_height / (endy - starty);
 
 	/* these are the offsets which are added to the pixel centroid in output image space to produce a quadrilateral */
-	std::array< std::tuple<double,double>,4 > output_corner_offsets = this->produce_corner_offsets();
+	std::array< std::tuple<double,double>,4 > output_corner_offsets = this->produce_corner_offsets ( configuration );
 
 	// map the output pixels onto the input image
 	for ( size_t vc = 0; vc < output_image_height; vc++ ) {
@@ -206,12 +217,12 @@ ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginGeometricTransform::
 
 			for ( size_t i = 0; i < output_corner_offsets.size(); i++ ) {
 
-				this->oimage_to_beamspace(
+				configuration.oimage_to_beamspace(
 					uc+get<0>(output_corner_offsets[i]),
 					vc+get<1>(output_corner_offsets[i]),
 					clip_vertices[i].x,
 					clip_vertices[i].y);
-				this->beamspace_to_iimage(
+				configuration.beamspace_to_iimage(
 					clip_vertices[i].x,
 					clip_vertices[i].y,
 					clip_vertices[i].x,
@@ -231,17 +242,17 @@ ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginGeometricTransform::
 			double tx, ty;
 
 			// transform the input pixel to output image coordinates
-			this->iimage_to_beamspace ( uc - 0.5, vc - 0.5, tx, ty );
-			this->beamspace_to_oimage ( tx, ty, p1u, p1v );
+			configuration.iimage_to_beamspace ( uc - 0.5, vc - 0.5, tx, ty );
+			configuration.beamspace_to_oimage ( tx, ty, p1u, p1v );
 
-			this->iimage_to_beamspace ( uc - 0.5, vc + 0.5, tx, ty );
-			this->beamspace_to_oimage ( tx, ty, p2u, p2v );
+			configuration.iimage_to_beamspace ( uc - 0.5, vc + 0.5, tx, ty );
+			configuration.beamspace_to_oimage ( tx, ty, p2u, p2v );
 
-			this->iimage_to_beamspace ( uc + 0.5, vc + 0.5, tx, ty );
-			this->beamspace_to_oimage ( tx, ty, p3u, p3v );
+			configuration.iimage_to_beamspace ( uc + 0.5, vc + 0.5, tx, ty );
+			configuration.beamspace_to_oimage ( tx, ty, p3u, p3v );
 
-			this->iimage_to_beamspace ( uc + 0.5, vc - 0.5, tx, ty );
-			this->beamspace_to_oimage ( tx, ty, p4u, p4v );
+			configuration.iimage_to_beamspace ( uc + 0.5, vc - 0.5, tx, ty );
+			configuration.beamspace_to_oimage ( tx, ty, p4u, p4v );
 			*/
 
 			// the corners _should_ be sorted in a counter-clockwise order with clip_vertices[0] at the -x,+y position
@@ -269,7 +280,7 @@ ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginGeometricTransform::
 
 			if ( imagespace_area <= 0. ) {
 
-				this->geometric_correction_table.push_back(entries);
+				geometric_correction_table.push_back(entries);
 				continue;
 			}
 
@@ -325,7 +336,7 @@ ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginGeometricTransform::
 				}
 			}
 
-			this->geometric_correction_table.push_back(entries);
+			geometric_correction_table.push_back(entries);
 		}
 	}
 
@@ -347,20 +358,77 @@ ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginGeometricTransform::
 	}
 	*/
 
+	tables = new_tables;
+	return ConfigurationStatusConfigured;
+}
+
+
+/** ViewScreenConfiguredNDPlugin::configuration_change_callback
+ *	This function is called when the configuration changes
+ */
+ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginGeometricTransform::configuration_change_callback ( const int addr ) {
+
+	/* This function should be called from a locked state */
+
+	std::shared_ptr<const GeometricCorrectionTables> new_tables = std::static_pointer_cast<const GeometricCorrectionTables> ( this->get_configuration_tables ( addr ) );
+
+	if ( !new_tables ) {
+
+		return ConfigurationStatusBadParameter;
+	}
+
+	this->tables[addr] = new_tables;
+	this->folded_tables[addr] = folded_table_t ();
 	return ConfigurationStatusConfigured;
 }
 
 
+std::shared_ptr<const ViewScreenConfiguredNDPlugin::CorrectionTable> NDPluginGeometricTransform::get_folded_correction ( const std::string port_name, const int addr, const size_t pixels, bool &stale_table ) {
+
+	stale_table = false;
+	if ( port_name.empty() ) return std::shared_ptr<const CorrectionTable> ();
+
+	/* The plugin serves the same screens at the same addresses */
+	ViewScreenConfiguredNDPlugin *plugin = ViewScreenConfiguredNDPlugin::find_plugin ( port_name );
+	if ( (NULL == plugin) || (this == plugin) ) {
+
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::%s: There is no correction plugin with port %s to fold into the transformation.\n", pluginName, __func__, port_name.c_str() );
+		return std::shared_ptr<const CorrectionTable> ();
+	}
+
+	return plugin->get_output_correction ( addr, pixels, stale_table );
+}
+
+
+void NDPluginGeometricTransform::fold_correction_factors ( const geometric_correction_table_type &geometric_correction_table, const CorrectionTable *magnification, const CorrectionTable *efficiency, geometric_correction_table_type &folded_table ) {
+
+	folded_table = geometric_correction_table;
+
+	for ( size_t pixel = 0; pixel < folded_table.size(); pixel++ ) {
+
+		float factor = 1.;
+		if ( NULL != magnification ) factor *= magnification->get ( pixel );
+		if ( NULL != efficiency ) factor *= efficiency->get ( pixel );
+
+		for ( auto entry = folded_table[pixel].begin(); entry != folded_table[pixel].end(); entry++ ) {
+
+			get<1>(*entry) *= factor;
+		}
+	}
+}
+
+
 /** Report the compatibility of the input array and correction table
   * \param[in] pArray  Pointer to the NDArray to check
+  * \param[in] addr  The screen which the array belongs to
   * @return true if the correction may be applied; false otherwise.
   */
-bool NDPluginGeometricTransform::preprocess_check ( NDArray *pArray ) {
+bool NDPluginGeometricTransform::preprocess_check ( NDArray *pArray, const int addr ) {
 
 	/* This function should be called while locked */
 
 	/* Check the configuration status */
-	if ( false == this->is_configured() ) {
+	if ( false == this->is_configured ( addr ) ) {
 
 		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::preprocess_check: View screen configuration not loaded.\n", pluginName );
 		// The plugin is uncalibrated; there is no point in performing further checks.
@@ -371,10 +439,11 @@ bool NDPluginGeometricTransform::preprocess_check ( NDArray *pArray ) {
 	NDArrayInfo_t ndarray_info;
 	pArray->getInfo ( &ndarray_info );
 
+	const std::shared_ptr<const Configuration> configuration = this->get_configuration ( addr );
 	bool perform_correction = true;
 
 	/* Validate the correction table */
-	if ( 0 == geometric_correction_table.size() ) {
+	if ( 0 == this->tables[addr]->geometric_correction_table.size() ) {
 
 		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::preprocess_check: The geometric correction table dimensions are invalid.\n", pluginName );
 		perform_correction = false;
@@ -396,9 +465,9 @@ bool NDPluginGeometricTransform::preprocess_check ( NDArray *pArray ) {
 
 	/* Confirm that the dimensions of the input array and correction table are identical */
 	// for now, we are only using 2-dimensional arrays so the Size() method is sufficient
-	if ( (ndarray_info.xSize != this->get_input_image_width()) || (ndarray_info.ySize != this->get_input_image_height()) ) {
+	if ( (ndarray_info.xSize != configuration->get_input_image_width()) || (ndarray_info.ySize != configuration->get_input_image_height()) ) {
 
-		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::preprocess_check: Input image dimensions (%lu,%lu) do not match configuration input image dimensions (%lux%lu).\n", ndarray_info.xSize, ndarray_info.ySize, this->get_input_image_width(), this->get_input_image_height() );
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::preprocess_check: Input image dimensions (%lu,%lu) do not match configuration input image dimensions (%lux%lu).\n", ndarray_info.xSize, ndarray_info.ySize, configuration->get_input_image_width(), configuration->get_input_image_height() );
 		perform_correction = false;
 	}
 
@@ -409,14 +478,15 @@ bool NDPluginGeometricTransform::preprocess_check ( NDArray *pArray ) {
 /** Performs a geometric transformation to produce the output image
  * \param[in] pArrayIn the input array
  * param[out] pArrayOut the output array (already allocated)
+ * \param[in] geometric_correction_table the table of the configuration which was active when the array arrived
 */
 template <typename epicsType>
-asynStatus NDPluginGeometricTransform::transform_array ( NDArray *pArrayIn, NDArray &pArrayOut ) {
+asynStatus NDPluginGeometricTransform::transform_array ( NDArray *pArrayIn, NDArray &pArrayOut, const geometric_correction_table_type &geometric_correction_table ) {
 
 	float *pDataOut = (float*)pArrayOut.pData;
 	epicsType *pDataIn = (epicsType*)pArrayIn->pData;
 
-	for ( auto pixels = this->geometric_correction_table.cbegin(); pixels != this->geometric_correction_table.cend(); pixels++, pDataOut++ ) {
+	for ( auto pixels = geometric_correction_table.cbegin(); pixels != geometric_correction_table.cend(); pixels++, pDataOut++ ) {
 
 		float &value = *pDataOut;
 		value = 0.;
@@ -459,17 +529,75 @@ void NDPluginGeometricTransform::processCallbacks(NDArray *pArray) {
 	/* Call the base class method */
 	NDPluginDriver::processCallbacks ( pArray );
 
-	const bool perform_correction = this->preprocess_check ( pArray );
+	const int addr = this->get_screen_address ( pArray );
+	if ( 0 > addr ) {
+
+		callParamCallbacks();
+		return;
+	}
+
+	const bool perform_correction = this->preprocess_check ( pArray, addr );
+
+	/* Take a reference to the active table; the transformation is performed without the lock and a reload may replace it meanwhile */
+	const std::shared_ptr<const GeometricCorrectionTables> tables = this->tables[addr];
+	const geometric_correction_table_type *geometric_correction_table = &tables->geometric_correction_table;
+
+	char port_name[128] = "";
+	getStringParam ( NDPluginGeometricTransformFoldMagnificationPort, sizeof(port_name), port_name );
+	const std::string magnification_port = port_name;
+	getStringParam ( NDPluginGeometricTransformFoldEfficiencyPort, sizeof(port_name), port_name );
+	const std::string efficiency_port = port_name;
+	folded_table_t folded = this->folded_tables[addr];
+	bool folded_changed = false;
+
+	/* Whether each named correction was left out of the frame for want of a table, and whether the efficiency one is stale */
+	bool magnification_missing = false, efficiency_missing = false, efficiency_stale = false;
+
+	const std::shared_ptr<const Configuration> configuration = this->get_configuration ( addr );
+	const int ndims = 2;
+	size_t dims[ndims];
+	dims[0] = configuration->get_output_image_width();
+	dims[1] = configuration->get_output_image_height();
 
 	/* This will hold the converted array */
 	NDArray *pArrayOut = NULL;
 
+	/* The transformation only uses the input array and the table; release the lock so that parameter reads and writes are not held up */
+	this->unlock();
+
+	if ( perform_correction && (!magnification_port.empty() || !efficiency_port.empty()) ) {
+
+		/* The corrections are taken from their plugins without this plugin's lock, since they take their own */
+		const size_t pixels = dims[0] * dims[1];
+		bool magnification_stale = false;
+		const std::shared_ptr<const CorrectionTable> magnification = this->get_folded_correction ( magnification_port, addr, pixels, magnification_stale );
+		const std::shared_ptr<const CorrectionTable> efficiency = this->get_folded_correction ( efficiency_port, addr, pixels, efficiency_stale );
+
+		magnification_missing = !magnification_port.empty() && !magnification;
+		efficiency_missing = !efficiency_port.empty() && !efficiency;
+
+		/* The weights are only folded again when the geometry or one of the corrections has changed since the last frame */
+		if ( !magnification && !efficiency ) {
+
+			folded = folded_table_t ();
+		}
+		else if ( (folded.tables != tables) || (folded.magnification != magnification) || (folded.efficiency != efficiency) || !folded.geometric_correction_table ) {
+
+			std::shared_ptr<geometric_correction_table_type> folded_table ( new geometric_correction_table_type () );
+			this->fold_correction_factors ( tables->geometric_correction_table, magnification.get(), efficiency.get(), *folded_table );
+
+			folded.tables = tables;
+			folded.magnification = magnification;
+			folded.efficiency = efficiency;
+			folded.geometric_correction_table = folded_table;
+			folded_changed = true;
+		}
+
+		if ( folded.geometric_correction_table ) geometric_correction_table = folded.geometric_correction_table.get();
+	}
+
 	if ( perform_correction ) {
 
-		const int ndims = 2;
-		size_t dims[ndims];
-		dims[0] = this->get_output_image_width();
-		dims[1] = this->get_output_image_height();
 		const size_t dataSize = 0;	// let alloc compute the required size
 
 		pArrayOut = this->pNDArrayPool->alloc ( ndims, dims, NDFloat32, dataSize, NULL );
@@ -489,28 +617,28 @@ void NDPluginGeometricTransform::processCallbacks(NDArray *pArray) {
 
 			switch ( pArray->dataType ) {
 				case NDInt8:
-					transformation_status = this->transform_array<epicsInt8>( pArray, *pArrayOut );
+					transformation_status = this->transform_array<epicsInt8>( pArray, *pArrayOut, *geometric_correction_table );
 					break;
 				case NDUInt8:
-					transformation_status = this->transform_array<epicsUInt8>( pArray, *pArrayOut );
+					transformation_status = this->transform_array<epicsUInt8>( pArray, *pArrayOut, *geometric_correction_table );
 					break;
 				case NDInt16:
-					transformation_status = this->transform_array<epicsInt16>( pArray, *pArrayOut );
+					transformation_status = this->transform_array<epicsInt16>( pArray, *pArrayOut, *geometric_correction_table );
 					break;
 				case NDUInt16:
-					transformation_status = this->transform_array<epicsUInt16>( pArray, *pArrayOut );
+					transformation_status = this->transform_array<epicsUInt16>( pArray, *pArrayOut, *geometric_correction_table );
 					break;
 				case NDInt32:
-					transformation_status = this->transform_array<epicsInt32>( pArray, *pArrayOut );
+					transformation_status = this->transform_array<epicsInt32>( pArray, *pArrayOut, *geometric_correction_table );
 					break;
 				case NDUInt32:
-					transformation_status = this->transform_array<epicsUInt32>( pArray, *pArrayOut );
+					transformation_status = this->transform_array<epicsUInt32>( pArray, *pArrayOut, *geometric_correction_table );
 					break;
 				case NDFloat32:
-					transformation_status = this->transform_array<epicsFloat32>( pArray, *pArrayOut );
+					transformation_status = this->transform_array<epicsFloat32>( pArray, *pArrayOut, *geometric_correction_table );
 					break;
 			    case NDFloat64:
-					transformation_status = this->transform_array<epicsFloat64>( pArray, *pArrayOut );
+					transformation_status = this->transform_array<epicsFloat64>( pArray, *pArrayOut, *geometric_correction_table );
 					break;
 				default:
 					asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, "%s:%s: ERROR: unknown data type=%d\n", pluginName, "processCallbacks", pArray->dataType);
@@ -522,24 +650,52 @@ void NDPluginGeometricTransform::processCallbacks(NDArray *pArray) {
 		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "NDPluginMagnificationCorrection::processCallbacks: Preprocessing check failed; magnification corrections will not be applied to the input image.\n" );
 	}
 
-	
+	this->lock();
+
+	/* Keep the folded table for the next frame, unless the configuration changed meanwhile */
+	if ( folded_changed && (tables == this->tables[addr]) ) {
+
+		this->folded_tables[addr] = folded;
+	}
+
 	if ( NULL != pArrayOut ) {
 
 		// Add the configuration parameters to the NDArray
 		this->getAttributes( pArrayOut->pAttributeList );
 
+		/* The folded corrections are marked as their plugins would mark them, since those plugins no longer see the frames */
+		if ( !efficiency_port.empty() ) {
+
+			if ( efficiency_missing ) {
+
+				epicsInt32 not_applied = 1;
+				pArrayOut->pAttributeList->add ( "EfficiencyCorrectionNotApplied", "No efficiency table was ready to fold into the transformation", NDAttrInt32, (void*)&not_applied );
+			}
+			else {
+
+				epicsInt32 stale_table = efficiency_stale? 1: 0;
+				pArrayOut->pAttributeList->add ( "EfficiencyTableStale", "Corrected with the efficiency table of a previous machine state", NDAttrInt32, (void*)&stale_table );
+			}
+		}
+
+		if ( magnification_missing ) {
+
+			epicsInt32 not_applied = 1;
+			pArrayOut->pAttributeList->add ( "MagnificationCorrectionNotApplied", "No magnification table was ready to fold into the transformation", NDAttrInt32, (void*)&not_applied );
+		}
+
 		this->unlock();
-		doCallbacksGenericPointer ( pArrayOut, NDArrayData, 0 );
+		doCallbacksGenericPointer ( pArrayOut, NDArrayData, addr );
 		this->lock();
 
-		/* Release the last array */
-		if ( this->pArrays[0] ) {
+		/* Release the last array of this screen */
+		if ( this->pArrays[addr] ) {
 
-			this->pArrays[0]->release ();
-			this->pArrays[0] = NULL;
+			this->pArrays[addr]->release ();
+			this->pArrays[addr] = NULL;
 		}
 
-		this->pArrays[0] = pArrayOut;
+		this->pArrays[addr] = pArrayOut;
 	}
 	else {
 
@@ -558,11 +714,11 @@ void NDPluginGeometricTransform::processCallbacks(NDArray *pArray) {
 extern "C" int NDGeometricTransformConfigure(const char *portName, int queueSize, int blockingCallbacks,
                                  const char *NDArrayPort, int NDArrayAddr,
                                  int maxBuffers, size_t maxMemory,
-                                 int priority, int stackSize)
+                                 int priority, int stackSize, int maxScreens)
 {
     NDPluginGeometricTransform *pPlugin =
     new NDPluginGeometricTransform(portName, queueSize, blockingCallbacks, NDArrayPort, NDArrayAddr,
-                    maxBuffers, maxMemory, priority, stackSize);
+                    maxBuffers, maxMemory, priority, stackSize, maxScreens);
     pPlugin = NULL;  /* This is just to eliminate compiler warning about unused variables/objects */
     return(asynSuccess);
 }
@@ -577,6 +733,7 @@ static const iocshArg initArg5 = { "maxBuffers",iocshArgInt};
 static const iocshArg initArg6 = { "maxMemory",iocshArgInt};
 static const iocshArg initArg7 = { "priority",iocshArgInt};
 static const iocshArg initArg8 = { "stackSize",iocshArgInt};
+static const iocshArg initArg9 = { "maxScreens",iocshArgInt};
 static const iocshArg * const initArgs[] = {&initArg0,
                                             &initArg1,
                                             &initArg2,
@@ -585,13 +742,14 @@ static const iocshArg * const initArgs[] = {&initArg0,
                                             &initArg5,
                                             &initArg6,
                                             &initArg7,
-                                            &initArg8};
-static const iocshFuncDef initFuncDef = {"NDGeometricTransformConfigure",9,initArgs};
+                                            &initArg8,
+                                            &initArg9};
+static const iocshFuncDef initFuncDef = {"NDGeometricTransformConfigure",10,initArgs};
 static void initCallFunc(const iocshArgBuf *args)
 {
     NDGeometricTransformConfigure(args[0].sval, args[1].ival, args[2].ival,
                    args[3].sval, args[4].ival, args[5].ival,
-                   args[6].ival, args[7].ival, args[8].ival);
+                   args[6].ival, args[7].ival, args[8].ival, args[9].ival);
 }
 
 extern "C" void NDGeometricTransformRegister(void)
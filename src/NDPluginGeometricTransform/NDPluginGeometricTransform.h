@@ -6,6 +6,7 @@
 #include <vector>
 #include <array>
 #include <tuple>
+#include <memory>
 
 // GPC
 extern "C" {
@@ -16,6 +17,8 @@ extern "C" {
 
 /** Map parameter enums to strings that will be used to set up EPICS databases
   */
+#define NDPluginGeometricTransformFoldMagnificationPortString	"FOLD_MAGNIFICATION_PORT"
+#define NDPluginGeometricTransformFoldEfficiencyPortString		"FOLD_EFFICIENCY_PORT"
 
 /** Perform a geometric correction on NDArrays.   */
 class NDPluginGeometricTransform : public ViewScreenConfiguredNDPlugin {
@@ -23,48 +26,87 @@ public:
     NDPluginGeometricTransform(const char *portName, int queueSize, int blockingCallbacks,
                  const char *NDArrayPort, int NDArrayAddr,
                  int maxBuffers, size_t maxMemory,
-                 int priority, int stackSize);
+                 int priority, int stackSize, int maxScreens);
     /* These methods override the virtual methods in the base class */
     void processCallbacks(NDArray *pArray);
 
     /* These methods are unique to this class */
 
 protected:
-    #define FIRST_GEOMTRANSFORM_PARAM NDPluginGeometricTransformNextOrder
-    #define LAST_GEOMTRANSFORM_PARAM NDPluginGeometricTransformCalibrate
+    #define FIRST_GEOMTRANSFORM_PARAM NDPluginGeometricTransformFoldMagnificationPort
+	int NDPluginGeometricTransformFoldMagnificationPort;
+	int NDPluginGeometricTransformFoldEfficiencyPort;
+    #define LAST_GEOMTRANSFORM_PARAM NDPluginGeometricTransformFoldEfficiencyPort
 
 private:
 
+	typedef std::vector< std::array< std::tuple<unsigned int, float>, 8 > > geometric_correction_table_type;
+
+	/** The geometric correction table derived from a configuration */
+	class GeometricCorrectionTables: public ConfigurationTables {
+
+		public:
+			geometric_correction_table_type geometric_correction_table;
+			size_t memory_usage () const { return geometric_correction_table.size() * sizeof(geometric_correction_table_type::value_type); };
+	};
+
+	/** The geometric correction table of a screen with the factors of the magnification and efficiency corrections
+	 *  folded into its weights, so that one pass produces the corrected image; folded again when any of them changes
+	 */
+	struct folded_table_t {
+
+		std::shared_ptr<const GeometricCorrectionTables> tables;	// the tables whose weights were folded
+		std::shared_ptr<const CorrectionTable> magnification;
+		std::shared_ptr<const CorrectionTable> efficiency;
+		std::shared_ptr<const geometric_correction_table_type> geometric_correction_table;	// NULL until folded
+	};
+
+	/** ViewScreenConfiguredNDPlugin::prepare_configuration_tables
+	 *	This function builds the geometric correction table for a configuration
+	 */
+	virtual ConfigurationStatus_t prepare_configuration_tables ( const Configuration &configuration, std::shared_ptr<const ConfigurationTables> &tables );
+
 	/** ViewScreenConfiguredNDPlugin::configuration_change_callback
 	 *	This function is called when the configuration changes
 	 */
-	virtual ConfigurationStatus_t configuration_change_callback();
+	virtual ConfigurationStatus_t configuration_change_callback ( const int addr );
 
-	/** Report the compatibility of the input array and correction table
+	/** Report the compatibility of the input array and the correction table of its screen
 	 */
-	bool preprocess_check ( NDArray *pArray );
+	bool preprocess_check ( NDArray *pArray, const int addr );
 
 	/** NDPluginGeometricTransform::calculate_gpc_polygon_area
  	* This function calculates the area contained within the first contour of a gpc_polygon
 	 */
 	double calculate_gpc_polygon_area(gpc_polygon &polygon);
 
+	/** Returns the output correction of the plugin at port_name for a screen, or NULL if there is none to fold, and whether it's
+	 *  the stale one of a previous state; called without the port lock
+	 */
+	std::shared_ptr<const CorrectionTable> get_folded_correction ( const std::string port_name, const int addr, const size_t pixels, bool &stale_table );
+
+	/** Multiplies the weights of every output pixel by its factor in each correction which isn't NULL
+	 */
+	static void fold_correction_factors ( const geometric_correction_table_type &geometric_correction_table, const CorrectionTable *magnification, const CorrectionTable *efficiency, geometric_correction_table_type &folded_table );
+
 	/** Produces the offsets which create a convex polynomial in input image-space
 	 */
-	std::array< std::tuple<double,double>,4 > produce_corner_offsets();
+	std::array< std::tuple<double,double>,4 > produce_corner_offsets ( const Configuration &configuration );
 	
 	/** Performs a geometric transformation to produce the output image
 	 * \param[in] pArrayIn the input array
 	*/
-	template <typename epicsType> asynStatus transform_array ( NDArray *pArrayIn, NDArray &pArrayOut );
+	template <typename epicsType> asynStatus transform_array ( NDArray *pArrayIn, NDArray &pArrayOut, const geometric_correction_table_type &geometric_correction_table );
+
+	// the geometric correction table of the active configuration of each screen
+	std::vector< std::shared_ptr<const GeometricCorrectionTables> > tables;
 
-	// the geometric correction table
-	std::vector< std::array< std::tuple<unsigned int, float>, 8 > > geometric_correction_table;
+	// the tables of each screen with the corrections folded in, when FOLD_MAGNIFICATION_PORT or FOLD_EFFICIENCY_PORT is set
+	std::vector<folded_table_t> folded_tables;
 
 	// the total area of the input image in beam coordinates
 	double _total_input_area;
 };
-/*#define NUM_GEOMTRANSFORM_PARAMS (&LAST_GEOMTRANSFORM_PARAM - &FIRST_GEOMTRANSFORM_PARAM + 1)*/
-#define NUM_GEOMTRANSFORM_PARAMS 0
+#define NUM_GEOMTRANSFORM_PARAMS (&LAST_GEOMTRANSFORM_PARAM - &FIRST_GEOMTRANSFORM_PARAM + 1)
 
 #endif
@@ -8,83 +8,286 @@
 //#include <sstream>
 //#include <algorithm>
 
+#include <epicsThread.h>
+
 #include "NDPluginMagnificationCorrection.h"
 
 using namespace std;
 
 static const char* pluginName = "NDPluginMagnificationCorrection";
 
-NDPluginMagnificationCorrection::NDPluginMagnificationCorrection ( const char *portName, int queueSize, int blockingCallbacks, const char *NDArrayPort, int NDArrayAddr, int maxBuffers, size_t maxMemory, int priority, int stackSize ):
+static void magnification_table_rebuilder_thread ( void *drvPvt ) {
+
+	NDPluginMagnificationCorrection *plugin = (NDPluginMagnificationCorrection*)drvPvt;
+	plugin->rebuild_magnification_correction_tables ();
+}
+
+NDPluginMagnificationCorrection::NDPluginMagnificationCorrection ( const char *portName, int queueSize, int blockingCallbacks, const char *NDArrayPort, int NDArrayAddr, int maxBuffers, size_t maxMemory, int priority, int stackSize, int maxScreens ):
 	ViewScreenConfiguredNDPlugin (
-		portName, queueSize, blockingCallbacks, NDArrayPort, NDArrayAddr, 1,
+		portName, queueSize, blockingCallbacks, NDArrayPort, NDArrayAddr, (maxScreens < 1)? 1: maxScreens,
 		NUM_NDPluginMagnificationCorrection_PARAMS, maxBuffers, maxMemory,
 		asynInt32ArrayMask | asynGenericPointerMask,
-		asynInt32ArrayMask | asynGenericPointerMask, ASYN_CANBLOCK, 1, priority, stackSize ) {
+		asynInt32ArrayMask | asynGenericPointerMask, ASYN_CANBLOCK, 1, priority, stackSize ),
+	table_rebuilder_running ( false ) {
 
 
-	/* Create an empty magnification correction table */
-	#ifdef USE_OPENCV
-	this->magnification_correction_table.create ( 0, 0, cv::CV_32FC1 );
-	#else
-	this->magnification_correction_table.clear ( );
-	#endif
+	createParam ( NDPluginMagnificationCorrectionTableMethodString, asynParamInt32, &this->NDPluginMagnificationCorrectionTableMethod );
+	createParam ( NDPluginMagnificationCorrectionTableQuadratureString, asynParamInt32, &this->NDPluginMagnificationCorrectionTableQuadrature );
+
+	/* The table settings apply to all screens */
+	setIntegerParam ( this->NDPluginMagnificationCorrectionTableMethod, this->table_settings.method );
+	setIntegerParam ( this->NDPluginMagnificationCorrectionTableQuadrature, (int)this->table_settings.quadrature_points );
+
+	/* There is no magnification correction table until a configuration is loaded */
+	this->tables.assign ( this->get_screen_count(), std::shared_ptr<const MagnificationCorrectionTables> ( new MagnificationCorrectionTables () ) );
+	this->table_rebuild_requested.assign ( this->get_screen_count(), false );
 
 	/* Try to connect to the NDArray port */
 	this->connectToArrayPort();
 }
 
 
-ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginMagnificationCorrection::configuration_change_callback ( ) {
-
-	/* This function should be called from a locked state */
+/** Builds the magnification correction table for a configuration.
+  * This function is called without the port lock; it only uses the configuration passed to it.
+  */
+ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginMagnificationCorrection::prepare_configuration_tables ( const Configuration &configuration, std::shared_ptr<const ConfigurationTables> &tables ) {
 
 	asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "NDPluginMagnificationCorrection::Calibrate: Beginning calibration.\n" );
 
-	const size_t image_width = this->get_output_image_width();
-	const size_t image_height = this->get_output_image_height();
+	const size_t image_width = configuration.get_output_image_width();
+	const size_t image_height = configuration.get_output_image_height();
 
 	if ( 0 == image_width || 0 == image_height ) {
 
 		return ConfigurationStatusBadParameter;
 	}
 
+	std::shared_ptr<MagnificationCorrectionTables> new_tables ( new MagnificationCorrectionTables () );
+
+	this->table_settings_lock.lock ();
+	new_tables->settings = this->table_settings;
+	this->table_settings_lock.unlock ();
 
 	#ifdef USE_OPENCV
-	this->magnification_correction_table.create ( image_height, image_width, CV_32FC1 );
+	new_tables->magnification_correction_table.create ( image_height, image_width, CV_32FC1 );
 	#else
-	this->magnification_correction_table.resize ( image_height * image_width );
+	new_tables->magnification_correction_table.values.resize ( image_height * image_width );
 	#endif
 
-	const float normalization_area = this->ccd_area_covered_by_output_pixel ( (image_width-1) / 2., (image_height-1) / 2. );
+	float normalization_area = 0.;
+	std::vector<double> areas;
+
+	if ( MagnificationTableJacobian == new_tables->settings.method ) {
+
+		normalization_area = configuration.ccd_area_from_jacobian ( (image_width-1) / 2., (image_height-1) / 2., new_tables->settings.quadrature_points );
+		configuration.ccd_areas_from_jacobian ( new_tables->settings.quadrature_points, areas );
+	}
+	else {
+
+		/* Neighbouring pixels share their corners, so the corners are mapped once for the whole table */
+		normalization_area = configuration.ccd_area_covered_by_output_pixel ( (image_width-1) / 2., (image_height-1) / 2. );
+		configuration.ccd_areas_covered_by_output_pixels ( areas );
+	}
 
 	for ( size_t v = 0; v < image_height; v++ ) {
 
 		for ( size_t u = 0; u < image_width; u++ ) {
 
-			const double area = this->ccd_area_covered_by_output_pixel ( u, v );
+			const double area = areas[v*image_width + u];
 
 			#ifdef USE_OPENCV
-			this->magnification_correction_table.at<float>( v, u ) = (float)(area / normalization_area);
+			new_tables->magnification_correction_table.at<float>( v, u ) = (float)(area / normalization_area);
 			#else
-			this->magnification_correction_table.at ( v*image_width + u ) = (float)(area / normalization_area);
+			new_tables->magnification_correction_table.values.at ( v*image_width + u ) = (float)(area / normalization_area);
 			#endif
 		}
 	}
 
+	tables = new_tables;
+	return ConfigurationStatusConfigured;
+}
+
+
+ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginMagnificationCorrection::configuration_change_callback ( const int addr ) {
+
+	/* This function should be called from a locked state */
+
+	std::shared_ptr<const MagnificationCorrectionTables> new_tables = std::static_pointer_cast<const MagnificationCorrectionTables> ( this->get_configuration_tables ( addr ) );
+
+	if ( !new_tables ) {
+
+		return ConfigurationStatusBadParameter;
+	}
+
+	/* Tables prepared in advance may predate a change of the settings; they still fit the configuration, so frames
+	 * are corrected with them until the rebuilder thread has replaced them */
+	this->tables[addr] = new_tables;
+	if ( new_tables->settings != this->table_settings ) this->request_magnification_table_rebuild ( addr );
+
 	return ConfigurationStatusConfigured;
 }
 
 
+#ifndef USE_OPENCV
+/** Returns the magnification correction table of a screen's active configuration. Takes the port lock.
+  */
+std::shared_ptr<const ViewScreenConfiguredNDPlugin::CorrectionTable> NDPluginMagnificationCorrection::get_output_correction ( const int addr, const size_t pixels, bool &stale_table ) {
+
+	stale_table = false;
+
+	std::shared_ptr<const CorrectionTable> table;
+	if ( (0 > addr) || (this->get_screen_count() <= addr) ) return table;
+
+	this->lock ();
+
+	const std::shared_ptr<const MagnificationCorrectionTables> tables = this->tables[addr];
+	if ( this->is_configured ( addr ) && (pixels == tables->magnification_correction_table.size()) ) {
+
+		/* Shares the ownership of the tables it belongs to */
+		table = std::shared_ptr<const CorrectionTable> ( tables, &tables->magnification_correction_table );
+
+		/* Built with the previous settings, and applied while the table with the current ones is rebuilt */
+		stale_table = (tables->settings != this->table_settings);
+	}
+
+	this->unlock ();
+
+	return table;
+}
+#endif
+
+
+void NDPluginMagnificationCorrection::request_magnification_table_rebuild ( const int addr ) {
+
+	this->table_rebuild_requested[addr] = true;
+
+	if ( this->table_rebuilder_running ) return;
+
+	const std::string thread_name = std::string ( this->portName ) + "_tablerebuilder";
+
+	if ( NULL == epicsThreadCreate ( thread_name.c_str(), epicsThreadPriorityMedium, epicsThreadGetStackSize ( epicsThreadStackMedium ), magnification_table_rebuilder_thread, this ) ) {
+
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s: Unable to start the magnification table rebuilder thread.\n", pluginName, __func__ );
+		this->table_rebuild_requested[addr] = false;
+	}
+	else {
+
+		this->table_rebuilder_running = true;
+	}
+}
+
+
+/** Rebuilds the requested tables one at a time until none are left.
+  * The table is built without the port lock from the active configuration of the screen at the time of the request, and
+  * frames keep the previous table meanwhile; it's dropped if the screen changed configuration or the settings changed again.
+  */
+void NDPluginMagnificationCorrection::rebuild_magnification_correction_tables () {
+
+	this->lock ();
+
+	while ( true ) {
+
+		int addr = 0;
+		while ( addr < this->get_screen_count() && !this->table_rebuild_requested[addr] ) addr++;
+		if ( addr == this->get_screen_count() ) break;
+
+		this->table_rebuild_requested[addr] = false;
+		if ( !this->is_configured ( addr ) ) continue;
+
+		const std::shared_ptr<const Configuration> configuration = this->get_configuration ( addr );
+		std::shared_ptr<const ConfigurationTables> new_tables;
+
+		this->unlock ();
+		const ConfigurationStatus_t status = this->prepare_configuration_tables ( *configuration, new_tables );
+		this->lock ();
+
+		if ( ConfigurationStatusConfigured != status ) {
+
+			asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s: Unable to rebuild the magnification correction table of screen %d; status=%d.\n", pluginName, __func__, addr, status );
+			continue;
+		}
+
+		/* A change of the settings meanwhile has requested another rebuild */
+		const std::shared_ptr<const MagnificationCorrectionTables> rebuilt_tables = std::static_pointer_cast<const MagnificationCorrectionTables> ( new_tables );
+		if ( (configuration != this->get_configuration ( addr )) || (rebuilt_tables->settings != this->table_settings) ) continue;
+
+		this->tables[addr] = rebuilt_tables;
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "%s::%s: Rebuilt the magnification correction table of screen %d.\n", pluginName, __func__, addr );
+	}
+
+	this->table_rebuilder_running = false;
+	this->unlock ();
+}
+
+
+/** Called when asyn clients call pasynInt32->write().
+  * Changing the method or the quadrature of the magnification correction table rebuilds the tables of all screens in the
+  * background; frames are corrected with the previous tables until then.
+  * \param[in] pasynUser pasynUser structure that encodes the reason and address.
+  * \param[in] value Value to write. */
+asynStatus NDPluginMagnificationCorrection::writeInt32 ( asynUser *pasynUser, epicsInt32 value ) {
+
+	const int function = pasynUser->reason;
+	static const char *functionName = "writeInt32";
+
+	if ( (function != NDPluginMagnificationCorrectionTableMethod) && (function != NDPluginMagnificationCorrectionTableQuadrature) ) {
+
+		return ViewScreenConfiguredNDPlugin::writeInt32 ( pasynUser, value );
+	}
+
+	magnification_table_settings_t settings = this->table_settings;
+
+	if ( function == NDPluginMagnificationCorrectionTableMethod ) {
+
+		if ( (MagnificationTableCorners != value) && (MagnificationTableJacobian != value) ) {
+
+			epicsSnprintf ( pasynUser->errorMessage, pasynUser->errorMessageSize, "%s:%s: unknown magnification table method %d", pluginName, functionName, value );
+			return asynError;
+		}
+		settings.method = (MagnificationTableMethod_t)value;
+	}
+	else {
+
+		if ( (1 > value) || ((epicsInt32)Configuration::max_quadrature_points < value) ) {
+
+			epicsSnprintf ( pasynUser->errorMessage, pasynUser->errorMessageSize, "%s:%s: the quadrature must have 1 to %d points", pluginName, functionName, (int)Configuration::max_quadrature_points );
+			return asynError;
+		}
+		settings.quadrature_points = (size_t)value;
+	}
+
+	setIntegerParam ( function, value );
+
+	if ( settings != this->table_settings ) {
+
+		this->table_settings_lock.lock ();
+		this->table_settings = settings;
+		this->table_settings_lock.unlock ();
+
+		for ( int addr = 0; addr < this->get_screen_count(); addr++ ) {
+
+			if ( this->is_configured ( addr ) ) this->request_magnification_table_rebuild ( addr );
+		}
+	}
+
+	callParamCallbacks ();
+
+	asynPrint ( pasynUser, ASYN_TRACEIO_DRIVER, "%s:%s: function=%d, value=%d\n", pluginName, functionName, function, value );
+	return asynSuccess;
+}
+
+
 /** Report the compatibility of the input array and correction table
   * \param[in] pArray  Pointer to the NDArray to check
+  * \param[in] addr  The screen which the array belongs to
   * @return true if the correction may be applied; false otherwise.
   */
-bool NDPluginMagnificationCorrection::preprocess_check ( NDArray *pArray ) {
+bool NDPluginMagnificationCorrection::preprocess_check ( NDArray *pArray, const int addr ) {
 
 	/* This function should be called while locked */
 
 	/* Check the configuration status */
-	if ( false == this->is_configured() ) {
+	if ( false == this->is_configured ( addr ) ) {
 
 		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "NDPluginMagnificationCorrection::preprocess_check: View screen configuration not loaded.\n" );
 		// The plugin is uncalibrated; there is no point in performing further checks.
@@ -97,9 +300,9 @@ bool NDPluginMagnificationCorrection::preprocess_check ( NDArray *pArray ) {
 
 	bool perform_correction = true;
 	#ifdef USE_OPENCV
-	const Size table_size = this->magnification_correction_table.size();
+	const Size table_size = this->tables[addr]->magnification_correction_table.size();
 	#else
-	const size_t table_size = this->magnification_correction_table.size();
+	const size_t table_size = this->tables[addr]->magnification_correction_table.size();
 	#endif
 
 	/* Validate the correction table */
@@ -164,12 +367,29 @@ void NDPluginMagnificationCorrection::processCallbacks ( NDArray *pArray ) {
 	/* Call the base class method */
 	NDPluginDriver::processCallbacks ( pArray );
 
-	const bool perform_correction = this->preprocess_check ( pArray );
+	const int addr = this->get_screen_address ( pArray );
+	if ( 0 > addr ) {
+
+		callParamCallbacks();
+		return;
+	}
+
+	const bool perform_correction = this->preprocess_check ( pArray, addr );
+
+	/* Take a reference to the active tables; the correction is performed without the lock and a reload may replace them meanwhile */
+	const std::shared_ptr<const MagnificationCorrectionTables> tables = this->tables[addr];
+
+	int in_place = 0;
+	getIntegerParam ( ViewScreenConfiguredNDPluginCorrectInPlace, &in_place );
 
 	NDArray *pArrayOut = NULL;
 
+	/* The correction only uses the input array and the tables; release the lock so that parameter reads and writes are not held up */
+	this->unlock();
+
 	if ( perform_correction ) {
 
+		#ifdef USE_OPENCV
 		/* Perform the processing with a floating point data type to reduce the accumulation of rounding errors within processing stages */
 		if ( NDFloat32 != pArray->dataType ) {
 
@@ -199,33 +419,36 @@ void NDPluginMagnificationCorrection::processCallbacks ( NDArray *pArray ) {
 			NDArrayInfo_t ndarray_info;
 			const int status = pArrayOut->getInfo ( &ndarray_info );
 
-			#ifdef USE_OPENCV
 			Mat opencv_array ( ndarray_info.ySize, ndarray_info.xSize, CV_32FC1, pArrayOut->pData, sizeof(float) );
-			opencv_array = opencv_array.mul ( this->magnification_correction_table );
-			#else
-			float *pixel = (float*)pArrayOut->pData;
-			for ( auto correction_factor = this->magnification_correction_table.cbegin(); correction_factor != this->magnification_correction_table.cend(); correction_factor++, pixel++ ) {
+			opencv_array = opencv_array.mul ( tables->magnification_correction_table );
+		}
+		#else
+		/* Convert to a floating point data type and apply the correction in a single pass over the input, rather than converting into the output and reading it back */
+		pArrayOut = this->correct_array ( pArray, &tables->magnification_correction_table, 0 != in_place );
 
-				(*pixel) *= *correction_factor;
-			}
-			#endif
+		if ( NULL == pArrayOut ) {
+
+			asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::processCallbacks: Unable to correct the input array.\n", pluginName );
 		}
+		#endif
 	}
 	else {
 
 		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "NDPluginMagnificationCorrection::processCallbacks: Preprocessing check failed; magnification corrections will not be applied to the input image.\n" );
 	}
 
+	this->lock();
+
 	if ( NULL != pArrayOut ) {
 
-		/* Release the last array */
-		if ( NULL != this->pArrays[0] ) {
+		/* Release the last array of this screen */
+		if ( NULL != this->pArrays[addr] ) {
 
-			this->pArrays[0]->release ();
+			this->pArrays[addr]->release ();
 		}
-		this->pArrays[0] = pArrayOut;
+		this->pArrays[addr] = pArrayOut;
 		this->unlock();
-		doCallbacksGenericPointer ( pArrayOut, NDArrayData, 0 );
+		doCallbacksGenericPointer ( pArrayOut, NDArrayData, addr );
 		this->lock();
 	}
 	else {
@@ -2,6 +2,7 @@
 #define NDPluginMagnificationCorrection_H
 
 #include <epicsTypes.h>
+#include <epicsMutex.h>
 #include <asynStandardInterfaces.h>
 #ifdef USE_OPENCV
  #include "opencv2/core/core.hpp"
@@ -13,45 +14,109 @@
 
 #include "ViewScreenConfiguredNDPlugin.h"
 
+/** Map parameter enums to strings that will be used to set up EPICS databases
+  */
+#define NDPluginMagnificationCorrectionTableMethodString		"MAGNIFICATION_TABLE_METHOD"
+#define NDPluginMagnificationCorrectionTableQuadratureString	"MAGNIFICATION_TABLE_QUADRATURE"
+
 /** Perform a magnification correction on NDArrays.   */
 class NDPluginMagnificationCorrection : public ViewScreenConfiguredNDPlugin {
 public:
     NDPluginMagnificationCorrection(const char *portName, int queueSize, int blockingCallbacks,
                  const char *NDArrayPort, int NDArrayAddr,
                  int maxBuffers, size_t maxMemory,
-                 int priority, int stackSize);
+                 int priority, int stackSize, int maxScreens);
     /* These methods override the virtual methods in the base class */
     void processCallbacks(NDArray *pArray);
+	asynStatus writeInt32 ( asynUser *pasynUser, epicsInt32 value );
+
+	#ifndef USE_OPENCV
+	/** ViewScreenConfiguredNDPlugin::get_output_correction */
+	std::shared_ptr<const CorrectionTable> get_output_correction ( const int addr, const size_t pixels, bool &stale_table );
+	#endif
 
     /* These methods are unique to this class */
 
+	/** Rebuilds the tables which the screens are waiting for; run by the table rebuilder thread */
+	void rebuild_magnification_correction_tables ();
+
 protected:
 
+	#define FIRST_NDPluginMagnificationCorrection_PARAM NDPluginMagnificationCorrectionTableMethod
+	int NDPluginMagnificationCorrectionTableMethod;
+	int NDPluginMagnificationCorrectionTableQuadrature;
+	#define LAST_NDPluginMagnificationCorrection_PARAM NDPluginMagnificationCorrectionTableQuadrature
+
+	/** How the ccd area covered by each output pixel is found */
+	typedef enum {
+		MagnificationTableCorners = 0,		// the quadrilateral spanned by the mapped corners of the pixel
+		MagnificationTableJacobian = 1		// the determinant of the Jacobian of the mapping, integrated over the pixel
+	} MagnificationTableMethod_t;
+
 private:
 
+	/** The settings with which a magnification correction table is built */
+	struct magnification_table_settings_t {
+
+		MagnificationTableMethod_t method;
+		size_t quadrature_points;	// per axis, for MagnificationTableJacobian
+
+		magnification_table_settings_t (): method ( MagnificationTableCorners ), quadrature_points ( 1 ) {};
+		bool operator!= ( const magnification_table_settings_t &rhs ) const {
+
+			return (method != rhs.method) || (quadrature_points != rhs.quadrature_points);
+		};
+	};
+
+	/** The magnification correction table derived from a configuration */
+	class MagnificationCorrectionTables: public ConfigurationTables {
+
+		public:
+			magnification_table_settings_t settings;
+			#ifdef USE_OPENCV
+			cv::Mat magnification_correction_table;
+			size_t memory_usage () const { return magnification_correction_table.total() * magnification_correction_table.elemSize(); };
+			#else
+			CorrectionTable magnification_correction_table;
+			size_t memory_usage () const { return magnification_correction_table.memory_usage(); };
+			#endif
+	};
+
+	/** ViewScreenConfiguredNDPlugin::prepare_configuration_tables
+	 *	This function builds the magnification correction table for a configuration
+	 */
+	virtual ConfigurationStatus_t prepare_configuration_tables ( const Configuration &configuration, std::shared_ptr<const ConfigurationTables> &tables );
+
+	/** Asks the table rebuilder thread to rebuild the table of the screen at addr with the current settings; called from a locked state */
+	void request_magnification_table_rebuild ( const int addr );
+
 	/** ViewScreenConfiguredNDPlugin::configuration_change_callback
 	 *	This function is called when the configuration changes
 	 */
-	virtual ConfigurationStatus_t configuration_change_callback ();
+	virtual ConfigurationStatus_t configuration_change_callback ( const int addr );
 
-	/** Report the compatibility of the input array and correction table
+	/** Report the compatibility of the input array and the correction table of its screen
 	 */
-	bool preprocess_check ( NDArray *pArray );
+	bool preprocess_check ( NDArray *pArray, const int addr );
 
 	/** Carry out the calibration procedure
 	*/
 	asynStatus calibrate ();
 
-	#ifdef USE_OPENCV
-	cv::Mat magnification_correction_table;
-	#else
-	std::vector<float> magnification_correction_table;
-	#endif
-	
+	// the tables prepared for the active configuration of each screen
+	std::vector< std::shared_ptr<const MagnificationCorrectionTables> > tables;
+
+	// the settings for new tables; written under both the port lock and table_settings_lock, since tables are
+	// also prepared without the port lock
+	magnification_table_settings_t table_settings;
+	epicsMutex table_settings_lock;
+
+	// the screens whose tables are to be rebuilt, and whether the rebuilder thread runs; both under the port lock
+	std::vector<bool> table_rebuild_requested;
+	bool table_rebuilder_running;
 
 	/** Calibration parameters **/
 };
-/*#define NUM_NDPluginMagnificationCorrection_PARAMS (&LAST_NDPluginMagnificationCorrection_PARAM - &FIRST_NDPluginMagnificationCorrection_PARAM + 1)*/
-#define NUM_NDPluginMagnificationCorrection_PARAMS 0
+#define NUM_NDPluginMagnificationCorrection_PARAMS (&LAST_NDPluginMagnificationCorrection_PARAM - &FIRST_NDPluginMagnificationCorrection_PARAM + 1)
 
 #endif // NDPluginMagnificationCorrection
@@ -8,9 +8,9 @@ using namespace std;
 
 static const char* pluginName = "NDPluginViewScreenConfiguration";
 
-NDPluginViewScreenConfiguration::NDPluginViewScreenConfiguration ( const char *portName, int queueSize, int blockingCallbacks, const char *NDArrayPort, int NDArrayAddr, int maxBuffers, size_t maxMemory, int priority, int stackSize ):
+NDPluginViewScreenConfiguration::NDPluginViewScreenConfiguration ( const char *portName, int queueSize, int blockingCallbacks, const char *NDArrayPort, int NDArrayAddr, int maxBuffers, size_t maxMemory, int priority, int stackSize, int maxScreens ):
 	ViewScreenConfiguredNDPlugin (
-		portName, queueSize, blockingCallbacks, NDArrayPort, NDArrayAddr, 1,
+		portName, queueSize, blockingCallbacks, NDArrayPort, NDArrayAddr, (maxScreens < 1)? 1: maxScreens,
 		NUM_NDPluginViewScreenConfiguration_PARAMS, maxBuffers, maxMemory,
 		asynGenericPointerMask,
 		asynGenericPointerMask, 0, 1, priority, stackSize ) {
@@ -43,87 +43,92 @@ NDPluginViewScreenConfiguration::NDPluginViewScreenConfiguration ( const char *p
 	createParam ( NDPluginViewScreenConfigurationOutputImageWidthString, asynParamInt32, &NDPluginViewScreenConfigurationOutputImageWidth );
 	createParam ( NDPluginViewScreenConfigurationOutputImageHeightString, asynParamInt32, &NDPluginViewScreenConfigurationOutputImageHeight );
 
-	/* Put these in the constructor for now because they are hard-coded into the ViewScreenConfiguredNDPlugin class */
-	setStringParam ( NDPluginViewScreenConfigurationTarget0Material, "" );
-	setStringParam ( NDPluginViewScreenConfigurationTarget1Material, "" );
-	setStringParam ( NDPluginViewScreenConfigurationTarget2Material, "" );
+	/* Put these in the constructor for now because they are hard-coded into the ViewScreenConfiguredNDPlugin class; each screen has its own set */
+	for ( int addr = 0; addr < this->get_screen_count(); addr++ ) {
 
-	setStringParam ( NDPluginViewScreenConfigurationTarget0LightDistribution, "" );
-	setStringParam ( NDPluginViewScreenConfigurationTarget1LightDistribution, "" );
-	setStringParam ( NDPluginViewScreenConfigurationTarget2LightDistribution, "" );
+		setStringParam ( addr, NDPluginViewScreenConfigurationTarget0Material, "" );
+		setStringParam ( addr, NDPluginViewScreenConfigurationTarget1Material, "" );
+		setStringParam ( addr, NDPluginViewScreenConfigurationTarget2Material, "" );
 
-	setStringParam ( NDPluginViewScreenConfigurationTarget0EfficiencyMapDirectory, "" );
-	setStringParam ( NDPluginViewScreenConfigurationTarget1EfficiencyMapDirectory, "" );
-	setStringParam ( NDPluginViewScreenConfigurationTarget2EfficiencyMapDirectory, "" );
-	setIntegerParam ( NDPluginViewScreenConfigurationTarget0EfficiencyMapDirectoryExists, false );
-	setIntegerParam ( NDPluginViewScreenConfigurationTarget1EfficiencyMapDirectoryExists, false );
-	setIntegerParam ( NDPluginViewScreenConfigurationTarget2EfficiencyMapDirectoryExists, false );
-	setStringParam ( NDPluginViewScreenConfigurationConfigurationFileDirectory, this->get_configuration_directory().c_str() );
+		setStringParam ( addr, NDPluginViewScreenConfigurationTarget0LightDistribution, "" );
+		setStringParam ( addr, NDPluginViewScreenConfigurationTarget1LightDistribution, "" );
+		setStringParam ( addr, NDPluginViewScreenConfigurationTarget2LightDistribution, "" );
+
+		setStringParam ( addr, NDPluginViewScreenConfigurationTarget0EfficiencyMapDirectory, "" );
+		setStringParam ( addr, NDPluginViewScreenConfigurationTarget1EfficiencyMapDirectory, "" );
+		setStringParam ( addr, NDPluginViewScreenConfigurationTarget2EfficiencyMapDirectory, "" );
+		setIntegerParam ( addr, NDPluginViewScreenConfigurationTarget0EfficiencyMapDirectoryExists, false );
+		setIntegerParam ( addr, NDPluginViewScreenConfigurationTarget1EfficiencyMapDirectoryExists, false );
+		setIntegerParam ( addr, NDPluginViewScreenConfigurationTarget2EfficiencyMapDirectoryExists, false );
+		setStringParam ( addr, NDPluginViewScreenConfigurationConfigurationFileDirectory, this->get_configuration_directory().c_str() );
+	}
 
 	/* Try to connect to the NDArray port */
 	this->connectToArrayPort();
 }
 
 
-ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginViewScreenConfiguration::configuration_change_callback ( ) {
+ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginViewScreenConfiguration::configuration_change_callback ( const int addr ) {
 
 	/* This function should be called from a locked state */
 
 	asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "%s:configuration_change_callback: Beginning calibration.\n", pluginName );
 
-	setStringParam ( NDPluginViewScreenConfigurationTarget0Material, this->get_target_info(0).material.c_str() );
-	setStringParam ( NDPluginViewScreenConfigurationTarget1Material, this->get_target_info(1).material.c_str() );
-	setStringParam ( NDPluginViewScreenConfigurationTarget2Material, this->get_target_info(2).material.c_str() );
+	const std::shared_ptr<const Configuration> configuration = this->get_configuration ( addr );
 
-	setStringParam ( NDPluginViewScreenConfigurationTarget0LightDistribution, this->get_target_info(0).light_distribution.c_str() );
-	setStringParam ( NDPluginViewScreenConfigurationTarget1LightDistribution, this->get_target_info(1).light_distribution.c_str() );
-	setStringParam ( NDPluginViewScreenConfigurationTarget2LightDistribution, this->get_target_info(2).light_distribution.c_str() );
+	setStringParam ( addr, NDPluginViewScreenConfigurationTarget0Material, configuration->get_target_info(0).material.c_str() );
+	setStringParam ( addr, NDPluginViewScreenConfigurationTarget1Material, configuration->get_target_info(1).material.c_str() );
+	setStringParam ( addr, NDPluginViewScreenConfigurationTarget2Material, configuration->get_target_info(2).material.c_str() );
 
-	setStringParam ( NDPluginViewScreenConfigurationTarget0EfficiencyMapDirectory, this->get_efficiency_map_directory(0).c_str() );
-	setStringParam ( NDPluginViewScreenConfigurationTarget1EfficiencyMapDirectory, this->get_efficiency_map_directory(1).c_str() );
-	setStringParam ( NDPluginViewScreenConfigurationTarget2EfficiencyMapDirectory, this->get_efficiency_map_directory(2).c_str() );
+	setStringParam ( addr, NDPluginViewScreenConfigurationTarget0LightDistribution, configuration->get_target_info(0).light_distribution.c_str() );
+	setStringParam ( addr, NDPluginViewScreenConfigurationTarget1LightDistribution, configuration->get_target_info(1).light_distribution.c_str() );
+	setStringParam ( addr, NDPluginViewScreenConfigurationTarget2LightDistribution, configuration->get_target_info(2).light_distribution.c_str() );
+
+	setStringParam ( addr, NDPluginViewScreenConfigurationTarget0EfficiencyMapDirectory, configuration->get_efficiency_map_directory(0).c_str() );
+	setStringParam ( addr, NDPluginViewScreenConfigurationTarget1EfficiencyMapDirectory, configuration->get_efficiency_map_directory(1).c_str() );
+	setStringParam ( addr, NDPluginViewScreenConfigurationTarget2EfficiencyMapDirectory, configuration->get_efficiency_map_directory(2).c_str() );
 
 	// check whether the directories exist
 	struct stat buffer;
 
-	if ( (0 == stat ( this->get_efficiency_map_directory(0).c_str(), &buffer )) && (S_ISDIR ( buffer.st_mode )) ) {
+	if ( (0 == stat ( configuration->get_efficiency_map_directory(0).c_str(), &buffer )) && (S_ISDIR ( buffer.st_mode )) ) {
 
-		setIntegerParam ( NDPluginViewScreenConfigurationTarget0EfficiencyMapDirectoryExists, true );
+		setIntegerParam ( addr, NDPluginViewScreenConfigurationTarget0EfficiencyMapDirectoryExists, true );
 	}
 	else {
 
-		setIntegerParam ( NDPluginViewScreenConfigurationTarget0EfficiencyMapDirectoryExists, false );
+		setIntegerParam ( addr, NDPluginViewScreenConfigurationTarget0EfficiencyMapDirectoryExists, false );
 	}
-	if ( (0 == stat ( this->get_efficiency_map_directory(1).c_str(), &buffer )) && (S_ISDIR ( buffer.st_mode )) ) {
+	if ( (0 == stat ( configuration->get_efficiency_map_directory(1).c_str(), &buffer )) && (S_ISDIR ( buffer.st_mode )) ) {
 
-		setIntegerParam ( NDPluginViewScreenConfigurationTarget1EfficiencyMapDirectoryExists, true );
+		setIntegerParam ( addr, NDPluginViewScreenConfigurationTarget1EfficiencyMapDirectoryExists, true );
 	}
 	else {
 
-		setIntegerParam ( NDPluginViewScreenConfigurationTarget1EfficiencyMapDirectoryExists, false );
+		setIntegerParam ( addr, NDPluginViewScreenConfigurationTarget1EfficiencyMapDirectoryExists, false );
 	}
-	if ( (0 == stat ( this->get_efficiency_map_directory(2).c_str(), &buffer )) && (S_ISDIR ( buffer.st_mode )) ) {
+	if ( (0 == stat ( configuration->get_efficiency_map_directory(2).c_str(), &buffer )) && (S_ISDIR ( buffer.st_mode )) ) {
 
-		setIntegerParam ( NDPluginViewScreenConfigurationTarget2EfficiencyMapDirectoryExists, true );
+		setIntegerParam ( addr, NDPluginViewScreenConfigurationTarget2EfficiencyMapDirectoryExists, true );
 	}
 	else {
 
-		setIntegerParam ( NDPluginViewScreenConfigurationTarget2EfficiencyMapDirectoryExists, false );
+		setIntegerParam ( addr, NDPluginViewScreenConfigurationTarget2EfficiencyMapDirectoryExists, false );
 	}
 
-	setStringParam ( NDPluginViewScreenConfigurationConfigurationFileDirectory, this->get_configuration_directory().c_str() );
+	setStringParam ( addr, NDPluginViewScreenConfigurationConfigurationFileDirectory, this->get_configuration_directory().c_str() );
 
-	setDoubleParam ( NDPluginViewScreenConfigurationBeamspaceStartX, this->get_xi() );
-	setDoubleParam ( NDPluginViewScreenConfigurationBeamspaceEndX, this->get_xf() );
-	setDoubleParam ( NDPluginViewScreenConfigurationBeamspaceStartY, this->get_yi() );
-	setDoubleParam ( NDPluginViewScreenConfigurationBeamspaceEndY, this->get_yf() );
+	setDoubleParam ( addr, NDPluginViewScreenConfigurationBeamspaceStartX, configuration->xi );
+	setDoubleParam ( addr, NDPluginViewScreenConfigurationBeamspaceEndX, configuration->xf );
+	setDoubleParam ( addr, NDPluginViewScreenConfigurationBeamspaceStartY, configuration->yi );
+	setDoubleParam ( addr, NDPluginViewScreenConfigurationBeamspaceEndY, configuration->yf );
 
-	setIntegerParam ( NDPluginViewScreenConfigurationInputImageWidth, this->get_input_image_width() );
-	setIntegerParam ( NDPluginViewScreenConfigurationInputImageHeight, this->get_input_image_height() );
-	setIntegerParam ( NDPluginViewScreenConfigurationOutputImageWidth, this->get_output_image_width() );
-	setIntegerParam ( NDPluginViewScreenConfigurationOutputImageHeight, this->get_output_image_height() );
+	setIntegerParam ( addr, NDPluginViewScreenConfigurationInputImageWidth, configuration->get_input_image_width() );
+	setIntegerParam ( addr, NDPluginViewScreenConfigurationInputImageHeight, configuration->get_input_image_height() );
+	setIntegerParam ( addr, NDPluginViewScreenConfigurationOutputImageWidth, configuration->get_output_image_width() );
+	setIntegerParam ( addr, NDPluginViewScreenConfigurationOutputImageHeight, configuration->get_output_image_height() );
 
-	this->callParamCallbacks ();
+	this->callParamCallbacks ( addr );
 
 	return ConfigurationStatusConfigured;
 }
@@ -131,14 +136,15 @@ ViewScreenConfiguredNDPlugin::ConfigurationStatus_t NDPluginViewScreenConfigurat
 
 /** Report the compatibility of the input array and correction table
   * \param[in] pArray  Pointer to the NDArray to check
+  * \param[in] addr  The screen which the array belongs to
   * @return true if the correction may be applied; false otherwise.
   */
-bool NDPluginViewScreenConfiguration::preprocess_check ( NDArray *pArray ) {
+bool NDPluginViewScreenConfiguration::preprocess_check ( NDArray *pArray, const int addr ) {
 
 	/* This function should be called while locked */
 
 	/* Check the configuration status */
-	if ( false == this->is_configured() ) {
+	if ( false == this->is_configured ( addr ) ) {
 
 		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s:preprocess_check: View screen configuration not loaded.\n", pluginName );
 		// The plugin is uncalibrated; there is no point in performing further checks.
@@ -149,6 +155,7 @@ bool NDPluginViewScreenConfiguration::preprocess_check ( NDArray *pArray ) {
 	NDArrayInfo_t ndarray_info;
 	pArray->getInfo ( &ndarray_info );
 
+	const std::shared_ptr<const Configuration> configuration = this->get_configuration ( addr );
 	bool perform_correction = true;
 
 	/* We will only operate on two dimensional arrays */
@@ -160,9 +167,9 @@ bool NDPluginViewScreenConfiguration::preprocess_check ( NDArray *pArray ) {
 
 	/* Confirm that the dimensions of the input array and correction table are identical */
 	// for now, we are only using 2-dimensional arrays so the Size() method is sufficient
-	if ( this->get_input_image_width() != ndarray_info.xSize || this->get_input_image_height() != ndarray_info.ySize ) {
+	if ( configuration->get_input_image_width() != ndarray_info.xSize || configuration->get_input_image_height() != ndarray_info.ySize ) {
 
-		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::preprocess_check: Correction table dimensions (%lux%lu) do not match image dimensions (%lux%lu).\n", pluginName, this->get_input_image_width(), this->get_input_image_height(), ndarray_info.xSize, ndarray_info.ySize );
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::preprocess_check: Correction table dimensions (%lux%lu) do not match image dimensions (%lux%lu).\n", pluginName, configuration->get_input_image_width(), configuration->get_input_image_height(), ndarray_info.xSize, ndarray_info.ySize );
 		perform_correction = false;
 	}
 
@@ -183,14 +190,23 @@ void NDPluginViewScreenConfiguration::processCallbacks ( NDArray *pArray ) {
 	/* Call the base class method */
 	NDPluginDriver::processCallbacks ( pArray );
 
-	const bool perform_correction = this->preprocess_check ( pArray );
+	const int addr = this->get_screen_address ( pArray );
+	if ( 0 > addr ) {
+
+		callParamCallbacks();
+		return;
+	}
+
+	const bool perform_correction = this->preprocess_check ( pArray, addr );
 
 	NDArray *pArrayOut = NULL;
 
 	if ( perform_correction ) {
 
-		// Make a copy of the input array, with the data
+		// Make a copy of the input array, with the data; the copy doesn't need the lock
+		this->unlock();
 		pArrayOut = this->pNDArrayPool->copy ( pArray, pArrayOut, true );
+		this->lock();
 
 		if ( NULL == pArrayOut ) {
 
@@ -210,15 +226,15 @@ void NDPluginViewScreenConfiguration::processCallbacks ( NDArray *pArray ) {
 	if ( NULL != pArrayOut ) {
 
 		this->unlock();
-		doCallbacksGenericPointer ( pArrayOut, NDArrayData, 0 );
+		doCallbacksGenericPointer ( pArrayOut, NDArrayData, addr );
 		this->lock();
 
-		/* Release the last array */
-		if ( NULL != this->pArrays[0] ) {
+		/* Release the last array of this screen */
+		if ( NULL != this->pArrays[addr] ) {
 
-			this->pArrays[0]->release ();
+			this->pArrays[addr]->release ();
 		}
-		this->pArrays[0] = pArrayOut;
+		this->pArrays[addr] = pArrayOut;
 	}
 	else {
 
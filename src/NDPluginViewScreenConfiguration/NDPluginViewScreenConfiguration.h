@@ -54,7 +54,7 @@ public:
     NDPluginViewScreenConfiguration(const char *portName, int queueSize, int blockingCallbacks,
                  const char *NDArrayPort, int NDArrayAddr,
                  int maxBuffers, size_t maxMemory,
-                 int priority, int stackSize);
+                 int priority, int stackSize, int maxScreens);
     /* These methods override the virtual methods in the base class */
     void processCallbacks(NDArray *pArray);
 
@@ -100,11 +100,11 @@ private:
 	/** ViewScreenConfiguredNDPlugin::configuration_change_callback
 	 *	This function is called when the configuration changes
 	 */
-	virtual ConfigurationStatus_t configuration_change_callback ();
+	virtual ConfigurationStatus_t configuration_change_callback ( const int addr );
 
 	/** Report the compatibility of the input array and correction table
 	 */
-	bool preprocess_check ( NDArray *pArray );
+	bool preprocess_check ( NDArray *pArray, const int addr );
 };
 #define NUM_NDPluginViewScreenConfiguration_PARAMS (&LAST_NDPluginViewScreenConfiguration_PARAM - &FIRST_NDPluginViewScreenConfiguration_PARAM + 1)
 
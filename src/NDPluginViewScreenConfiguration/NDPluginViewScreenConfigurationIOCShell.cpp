@@ -10,10 +10,10 @@ extern "C" int NDViewScreenConfigurationConfigure (
 	const char *portName, int queueSize, int blockingCallbacks,
 	const char *NDArrayPort, int NDArrayAddr,
 	int maxBuffers, size_t maxMemory,
-	int priority, int stackSize ) {
+	int priority, int stackSize, int maxScreens ) {
 
     new NDPluginViewScreenConfiguration ( portName, queueSize, blockingCallbacks, NDArrayPort, NDArrayAddr,
-                        maxBuffers, maxMemory, priority, stackSize);
+                        maxBuffers, maxMemory, priority, stackSize, maxScreens);
 
     return ( asynSuccess );
 }
@@ -28,6 +28,7 @@ static const iocshArg initArg5 = { "maxBuffers",iocshArgInt};
 static const iocshArg initArg6 = { "maxMemory",iocshArgInt};
 static const iocshArg initArg7 = { "priority",iocshArgInt};
 static const iocshArg initArg8 = { "stackSize",iocshArgInt};
+static const iocshArg initArg9 = { "maxScreens",iocshArgInt};
 static const iocshArg * const initArgs[] = {&initArg0,
                                             &initArg1,
                                             &initArg2,
@@ -36,13 +37,14 @@ static const iocshArg * const initArgs[] = {&initArg0,
                                             &initArg5,
                                             &initArg6,
                                             &initArg7,
-                                            &initArg8};
+                                            &initArg8,
+                                            &initArg9};
 
-static const iocshFuncDef initFuncDef = { "NDViewScreenConfigurationConfigure", 9, initArgs };
+static const iocshFuncDef initFuncDef = { "NDViewScreenConfigurationConfigure", 10, initArgs };
 
 static void initCallFunc ( const iocshArgBuf *args )
 {
-    NDViewScreenConfigurationConfigure(args[0].sval, args[1].ival, args[2].ival, args[3].sval, args[4].ival, args[5].ival, args[6].ival, args[7].ival, args[8].ival);
+    NDViewScreenConfigurationConfigure(args[0].sval, args[1].ival, args[2].ival, args[3].sval, args[4].ival, args[5].ival, args[6].ival, args[7].ival, args[8].ival, args[9].ival);
 }
 
 
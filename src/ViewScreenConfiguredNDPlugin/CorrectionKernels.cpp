@@ -0,0 +1,273 @@
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <epicsThread.h>
+
+#include "ViewScreenConfiguredNDPlugin.h"
+#include "CorrectionKernels.h"
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <xmmintrin.h>
+#define CORRECTION_KERNELS_SSE
+/* The intrinsics of instruction sets which aren't enabled on the command line can only be used by target functions from gcc 4.9 */
+#if (__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9))
+#include <immintrin.h>
+#define CORRECTION_KERNELS_AVX
+#endif
+#endif
+
+/* Streamed outputs are aligned to this before the vector loops, since non-temporal stores need aligned addresses (bytes) */
+static const size_t output_alignment = 32;
+
+/* Frames which aren't floats, and half-precision tables, are widened a block at a time into buffers which stay in the L1 cache
+ * while they are streamed; larger blocks are slower, since the buffers then alias the output in the store buffer (pixels) */
+static const size_t block_size = 256;
+
+/* The last-level cache size assumed when the system doesn't report it (bytes) */
+static const size_t default_last_level_cache_size = 8 * 1024 * 1024;
+
+/** Multiplies count inputs by their factors, or copies them when factors is NULL, and streams the products to output, which
+ *  is aligned to output_alignment. The input and the factors need no alignment, and output may be input.
+ */
+typedef void (*stream_kernel_t) ( const float *input, const float *factors, float *output, const size_t count );
+
+static void stream_generic ( const float *input, const float *factors, float *output, const size_t count ) {
+
+	if ( NULL == factors ) {
+
+		if ( output != input ) std::copy ( input, input + count, output );
+	}
+	else {
+
+		for ( size_t i = 0; i < count; i++ ) output[i] = input[i] * factors[i];
+	}
+}
+
+
+#ifdef CORRECTION_KERNELS_SSE
+/** The loop of the SSE kernel, unrolled by four vectors */
+template <bool scaled>
+static inline void stream_sse_loop ( const float *input, const float *factors, float *output, const size_t count ) {
+
+	const size_t width = 4;
+	size_t i = 0;
+
+	for ( ; i + 4 * width <= count; i += 4 * width ) {
+
+		__m128 a = _mm_loadu_ps ( input + i );
+		__m128 b = _mm_loadu_ps ( input + i + width );
+		__m128 c = _mm_loadu_ps ( input + i + 2 * width );
+		__m128 d = _mm_loadu_ps ( input + i + 3 * width );
+
+		if ( scaled ) {
+
+			a = _mm_mul_ps ( a, _mm_loadu_ps ( factors + i ) );
+			b = _mm_mul_ps ( b, _mm_loadu_ps ( factors + i + width ) );
+			c = _mm_mul_ps ( c, _mm_loadu_ps ( factors + i + 2 * width ) );
+			d = _mm_mul_ps ( d, _mm_loadu_ps ( factors + i + 3 * width ) );
+		}
+
+		_mm_stream_ps ( output + i, a );
+		_mm_stream_ps ( output + i + width, b );
+		_mm_stream_ps ( output + i + 2 * width, c );
+		_mm_stream_ps ( output + i + 3 * width, d );
+	}
+
+	for ( ; i < count; i++ ) output[i] = scaled? input[i] * factors[i]: input[i];
+}
+
+static void stream_sse ( const float *input, const float *factors, float *output, const size_t count ) {
+
+	if ( NULL != factors ) stream_sse_loop<true> ( input, factors, output, count );
+	else if ( output != input ) stream_sse_loop<false> ( input, factors, output, count );
+}
+#endif
+
+
+#ifdef CORRECTION_KERNELS_AVX
+/** The loop of the AVX kernel, unrolled by four vectors */
+template <bool scaled>
+__attribute__((target("avx"))) static inline void stream_avx_loop ( const float *input, const float *factors, float *output, const size_t count ) {
+
+	const size_t width = 8;
+	size_t i = 0;
+
+	for ( ; i + 4 * width <= count; i += 4 * width ) {
+
+		__m256 a = _mm256_loadu_ps ( input + i );
+		__m256 b = _mm256_loadu_ps ( input + i + width );
+		__m256 c = _mm256_loadu_ps ( input + i + 2 * width );
+		__m256 d = _mm256_loadu_ps ( input + i + 3 * width );
+
+		if ( scaled ) {
+
+			a = _mm256_mul_ps ( a, _mm256_loadu_ps ( factors + i ) );
+			b = _mm256_mul_ps ( b, _mm256_loadu_ps ( factors + i + width ) );
+			c = _mm256_mul_ps ( c, _mm256_loadu_ps ( factors + i + 2 * width ) );
+			d = _mm256_mul_ps ( d, _mm256_loadu_ps ( factors + i + 3 * width ) );
+		}
+
+		_mm256_stream_ps ( output + i, a );
+		_mm256_stream_ps ( output + i + width, b );
+		_mm256_stream_ps ( output + i + 2 * width, c );
+		_mm256_stream_ps ( output + i + 3 * width, d );
+	}
+
+	for ( ; i < count; i++ ) output[i] = scaled? input[i] * factors[i]: input[i];
+}
+
+__attribute__((target("avx"))) static void stream_avx ( const float *input, const float *factors, float *output, const size_t count ) {
+
+	if ( NULL != factors ) stream_avx_loop<true> ( input, factors, output, count );
+	else if ( output != input ) stream_avx_loop<false> ( input, factors, output, count );
+
+	/* Avoid the penalty of mixing the upper halves of the registers with SSE code */
+	_mm256_zeroupper ();
+}
+
+/** Whether the cpu has AVX and the operating system saves the AVX registers */
+static bool cpu_has_avx () {
+
+	unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+	if ( !__get_cpuid ( 1, &eax, &ebx, &ecx, &edx ) ) return false;
+	if ( !(ecx & bit_AVX) || !(ecx & bit_OSXSAVE) ) return false;
+
+	/* xgetbv, spelled out for assemblers which don't know it */
+	unsigned int xcr0 = 0, xcr0_high = 0;
+	__asm__ __volatile__ ( ".byte 0x0f, 0x01, 0xd0" : "=a" (xcr0), "=d" (xcr0_high) : "c" (0) );
+	return 0x6 == (xcr0 & 0x6);
+}
+#endif
+
+
+/* The kernel chosen for this cpu, and the output size from which it is used */
+static epicsThreadOnceId kernel_once = EPICS_THREAD_ONCE_INIT;
+static stream_kernel_t stream_kernel = stream_generic;
+static const char *kernel_name = "generic";
+static size_t streaming_threshold = default_last_level_cache_size;
+
+static void select_kernel ( void * ) {
+
+	#ifdef CORRECTION_KERNELS_SSE
+	stream_kernel = stream_sse;
+	kernel_name = "sse";
+	#endif
+
+	#ifdef CORRECTION_KERNELS_AVX
+	if ( cpu_has_avx () ) {
+
+		stream_kernel = stream_avx;
+		kernel_name = "avx";
+	}
+	#endif
+
+	/* Streaming an output which fits in the cache would only slow down the plugin which reads it next */
+	#ifdef _SC_LEVEL3_CACHE_SIZE
+	const long last_level_cache_size = std::max ( sysconf ( _SC_LEVEL3_CACHE_SIZE ), sysconf ( _SC_LEVEL2_CACHE_SIZE ) );
+	if ( 0 < last_level_cache_size ) streaming_threshold = (size_t)last_level_cache_size;
+	#endif
+}
+
+static inline void initialize_kernels () {
+
+	epicsThreadOnce ( &kernel_once, select_kernel, NULL );
+}
+
+
+const char *correction_kernel_name () {
+
+	initialize_kernels ();
+	return kernel_name;
+}
+
+
+size_t correction_streaming_threshold () {
+
+	initialize_kernels ();
+	return streaming_threshold;
+}
+
+
+/** Converts and corrects pixels in one pass, for outputs which stay in the cache; the compiler vectorizes the loops */
+template <typename epicsType>
+static void correct_cached_pixels ( const epicsType *input, const float *factors, const epicsUInt16 *half_factors, float *output, const size_t count ) {
+
+	if ( NULL != half_factors ) {
+
+		for ( size_t i = 0; i < count; i++ ) output[i] = (float)input[i] * ViewScreenConfiguredNDPlugin::CorrectionTable::half_to_float ( half_factors[i] );
+	}
+	else if ( NULL != factors ) {
+
+		for ( size_t i = 0; i < count; i++ ) output[i] = (float)input[i] * factors[i];
+	}
+	else {
+
+		for ( size_t i = 0; i < count; i++ ) output[i] = (float)input[i];
+	}
+}
+
+
+/** Widens a block of a frame to floats; float frames are used as they are */
+template <typename epicsType>
+static inline const float *block_as_floats ( const epicsType *input, float *buffer, const size_t count ) {
+
+	for ( size_t i = 0; i < count; i++ ) buffer[i] = (float)input[i];
+	return buffer;
+}
+
+static inline const float *block_as_floats ( const epicsFloat32 *input, float *, const size_t ) {
+
+	return input;
+}
+
+
+template <typename epicsType>
+void correct_pixels ( const epicsType *input, const float *factors, const epicsUInt16 *half_factors, float *output, const size_t count ) {
+
+	initialize_kernels ();
+
+	if ( count * sizeof(float) <= streaming_threshold ) {
+
+		correct_cached_pixels<epicsType> ( input, factors, half_factors, output, count );
+		return;
+	}
+
+	/* The pixels before the first aligned output */
+	const size_t misalignment = (uintptr_t)output % output_alignment;
+	const size_t head = std::min ( count, misalignment? (output_alignment - misalignment) / sizeof(float): 0 );
+	correct_cached_pixels<epicsType> ( input, factors, half_factors, output, head );
+
+	/* The blocks are multiples of the alignment, so every block's output stays aligned */
+	float input_buffer[block_size], factor_buffer[block_size];
+
+	for ( size_t i = head; i < count; i += block_size ) {
+
+		const size_t n = std::min ( block_size, count - i );
+
+		const float *block_factors = (NULL == factors)? NULL: factors + i;
+		if ( NULL != half_factors ) {
+
+			for ( size_t j = 0; j < n; j++ ) factor_buffer[j] = ViewScreenConfiguredNDPlugin::CorrectionTable::half_to_float ( half_factors[i+j] );
+			block_factors = factor_buffer;
+		}
+
+		stream_kernel ( block_as_floats ( input + i, input_buffer, n ), block_factors, output + i, n );
+	}
+
+	#ifdef CORRECTION_KERNELS_SSE
+	/* Order the non-temporal stores before the output is handed to another thread */
+	_mm_sfence ();
+	#endif
+}
+template void correct_pixels<epicsInt8> ( const epicsInt8 *input, const float *factors, const epicsUInt16 *half_factors, float *output, const size_t count );
+template void correct_pixels<epicsUInt8> ( const epicsUInt8 *input, const float *factors, const epicsUInt16 *half_factors, float *output, const size_t count );
+template void correct_pixels<epicsInt16> ( const epicsInt16 *input, const float *factors, const epicsUInt16 *half_factors, float *output, const size_t count );
+template void correct_pixels<epicsUInt16> ( const epicsUInt16 *input, const float *factors, const epicsUInt16 *half_factors, float *output, const size_t count );
+template void correct_pixels<epicsInt32> ( const epicsInt32 *input, const float *factors, const epicsUInt16 *half_factors, float *output, const size_t count );
+template void correct_pixels<epicsUInt32> ( const epicsUInt32 *input, const float *factors, const epicsUInt16 *half_factors, float *output, const size_t count );
+template void correct_pixels<epicsFloat32> ( const epicsFloat32 *input, const float *factors, const epicsUInt16 *half_factors, float *output, const size_t count );
+template void correct_pixels<epicsFloat64> ( const epicsFloat64 *input, const float *factors, const epicsUInt16 *half_factors, float *output, const size_t count );
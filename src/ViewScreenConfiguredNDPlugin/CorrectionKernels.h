@@ -0,0 +1,27 @@
+#ifndef CorrectionKernels_H
+#define CorrectionKernels_H
+
+#include <stddef.h>
+
+#include <epicsTypes.h>
+
+/** The kernels which apply a per-pixel correction table to a frame: output[i] = input[i] * factor[i].
+ *  Outputs which fit in the last-level cache are converted and corrected in one vectorized pass and stay cached for the
+ *  next plugin. Larger outputs are written with non-temporal stores by the widest vector unit of the cpu, which is chosen
+ *  when the kernels are first used, so that they go straight to memory instead of evicting the correction table, which
+ *  is read again by the next frame.
+ */
+
+/** Converts and corrects count pixels; factors or half_factors hold the correction, or neither does for a plain conversion.
+ *  The output may be the input when epicsType is epicsFloat32, for correcting in place.
+ */
+template <typename epicsType>
+void correct_pixels ( const epicsType *input, const float *factors, const epicsUInt16 *half_factors, float *output, const size_t count );
+
+/** The name of the instruction set which the kernels use on this cpu ("avx", "sse" or "generic") */
+const char *correction_kernel_name ();
+
+/** The size in bytes of an output above which the kernels stream it past the caches */
+size_t correction_streaming_threshold ();
+
+#endif // CorrectionKernels_H
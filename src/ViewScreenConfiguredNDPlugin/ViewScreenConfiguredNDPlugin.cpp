@@ -1,48 +1,64 @@
 
 #include <array>
 #include <tuple>
+#include <set>
 #include <sstream>
 #include <iostream>
 #include <algorithm>
 #include <cmath>
+#include <cerrno>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
 
 #include <gsl/gsl_poly.h>
 
+#include <epicsThread.h>
+
 #include "ViewScreenConfiguredNDPlugin.h"
+#include "CorrectionKernels.h"
 
 static const char* pluginName = "ViewScreenConfiguredNDPlugin";
 
+/* The configuration watcher waits until the watched files have been quiet for this long (seconds) before reloading,
+ * so that a directory of efficiency maps which is being copied into place is picked up as a whole. */
+static const double configuration_reload_settle_time = 2.0;
+
 using namespace std;
 using namespace tinyxml2;
 
 // Static configuration variables
 std::string ViewScreenConfiguredNDPlugin::directory_configuration_files ( "/var/viewscreen/configuration/" );
 std::map<std::pair<std::string,std::string>, std::string> ViewScreenConfiguredNDPlugin::efficiency_map_directories;
+std::map<std::string, ViewScreenConfiguredNDPlugin*> ViewScreenConfiguredNDPlugin::plugins;
 
 #if (__GNUC__ <= 4) && (__GNUC_MINOR__ <= 4)
 class to_beamspace {
 	private:
 		const double &u, &v;
-		const ViewScreenConfiguredNDPlugin &vsplugin;
+		const ViewScreenConfiguredNDPlugin::Configuration &configuration;
 	public:
-		to_beamspace(const double &u, const double &v, const ViewScreenConfiguredNDPlugin &vsplugin): u(u), v(v), vsplugin(vsplugin) {};
+		to_beamspace(const double &u, const double &v, const ViewScreenConfiguredNDPlugin::Configuration &configuration): u(u), v(v), configuration(configuration) {};
 		tuple<double,double> operator () (tuple<double,double> &uvpoint) {
 
 			double x, y;
-			vsplugin.oimage_to_beamspace ( u + get<0>(uvpoint), v + get<1>(uvpoint), x, y );
+			configuration.oimage_to_beamspace ( u + get<0>(uvpoint), v + get<1>(uvpoint), x, y );
 			return make_tuple ( x, y );
 		}
 };
 
 class to_imagespace {
 	private:
-		const ViewScreenConfiguredNDPlugin &vsplugin;
+		const ViewScreenConfiguredNDPlugin::Configuration &configuration;
 	public:
-		to_imagespace(const ViewScreenConfiguredNDPlugin &vsplugin): vsplugin(vsplugin) {};
+		to_imagespace(const ViewScreenConfiguredNDPlugin::Configuration &configuration): configuration(configuration) {};
 		tuple<double,double> operator () (tuple<double,double> &xypoint) {
 
 			double pu, pv;
-			vsplugin.beamspace_to_iimage ( get<0>(xypoint), get<1>(xypoint), pu, pv );
+			configuration.beamspace_to_iimage ( get<0>(xypoint), get<1>(xypoint), pu, pv );
 			return make_tuple ( pu, pv );
 		}
 };
@@ -62,25 +78,79 @@ class by_clockwise_angle_about {
 #endif
 
 
+static void configuration_watcher_thread ( void *drvPvt ) {
+
+	ViewScreenConfiguredNDPlugin *plugin = (ViewScreenConfiguredNDPlugin*)drvPvt;
+	plugin->watch_configuration_files ();
+}
+
+
+static void configuration_preloader_thread ( void *drvPvt ) {
+
+	ViewScreenConfiguredNDPlugin *plugin = (ViewScreenConfiguredNDPlugin*)drvPvt;
+	plugin->preload_configurations ();
+}
+
+
 ViewScreenConfiguredNDPlugin::ViewScreenConfiguredNDPlugin ( const char *portName, int queueSize, int blockingCallbacks, const char *NDArrayPort, int NDArrayAddr, int maxAddr, int numParams, int maxBuffers, size_t maxMemory, int interfaceMask, int interruptMask, int asynFlags, int autoConnect, int priority, int stackSize ):
-	NDPluginDriver ( portName, queueSize, blockingCallbacks, NDArrayPort, NDArrayAddr, maxAddr, numParams + NUM_ViewScreenConfiguredNDPlugin_PARAMS, maxBuffers, maxMemory, interfaceMask, interruptMask, asynFlags, autoConnect, priority, stackSize ),
-	order ( -1 ),
-	x_orientation ( 0 ),
-	y_orientation ( 0 ) {
+	NDPluginDriver ( portName, queueSize, blockingCallbacks, NDArrayPort, NDArrayAddr, maxAddr, numParams + NUM_ViewScreenConfiguredNDPlugin_PARAMS, maxBuffers, maxMemory, interfaceMask | asynFloat64ArrayMask, interruptMask | asynFloat64ArrayMask, asynFlags, autoConnect, priority, stackSize ),
+	screens ( maxAddr ),
+	configuration_watcher_started ( false ),
+	preloaded_configuration_memory_limit ( 0 ),
+	preloaded_configuration_clock ( 0 ),
+	configuration_preloader_running ( false ) {
 
 	createParam ( ViewScreenConfiguredNDPluginConfigurationStatusString, asynParamInt32, &ViewScreenConfiguredNDPluginConfigurationStatus );
 	createParam ( ViewScreenConfiguredNDPluginConfigurationFileString, asynParamOctet, &ViewScreenConfiguredNDPluginConfigurationFile );
+	createParam ( ViewScreenConfiguredNDPluginConfigurationAutoReloadString, asynParamInt32, &ViewScreenConfiguredNDPluginConfigurationAutoReload );
+	createParam ( ViewScreenConfiguredNDPluginConfigurationSelectString, asynParamInt32, &ViewScreenConfiguredNDPluginConfigurationSelect );
+	createParam ( ViewScreenConfiguredNDPluginConfigurationPreloadedString, asynParamInt32, &ViewScreenConfiguredNDPluginConfigurationPreloaded );
+	createParam ( ViewScreenConfiguredNDPluginConversionDirectionString, asynParamInt32, &ViewScreenConfiguredNDPluginConversionDirection );
+	createParam ( ViewScreenConfiguredNDPluginConversionInputString, asynParamFloat64Array, &ViewScreenConfiguredNDPluginConversionInput );
+	createParam ( ViewScreenConfiguredNDPluginConversionOutputString, asynParamFloat64Array, &ViewScreenConfiguredNDPluginConversionOutput );
+	createParam ( ViewScreenConfiguredNDPluginScreenAttributeString, asynParamOctet, &ViewScreenConfiguredNDPluginScreenAttribute );
+	createParam ( ViewScreenConfiguredNDPluginCorrectInPlaceString, asynParamInt32, &ViewScreenConfiguredNDPluginCorrectInPlace );
 
 	setStringParam  ( NDPluginDriverPluginType, "ViewScreenConfiguredNDPlugin" );
-	setIntegerParam ( ViewScreenConfiguredNDPluginConfigurationStatus, ConfigurationStatusUnconfigured );
-	setStringParam  ( ViewScreenConfiguredNDPluginConfigurationFile, "" );
+	setStringParam  ( ViewScreenConfiguredNDPluginScreenAttribute, "" );
+	setIntegerParam ( ViewScreenConfiguredNDPluginCorrectInPlace, 0 );
 
-	callParamCallbacks ();
+	/* Each screen is configured independently */
+	for ( int addr = 0; addr < this->get_screen_count(); addr++ ) {
+
+		setIntegerParam ( addr, ViewScreenConfiguredNDPluginConfigurationStatus, ConfigurationStatusUnconfigured );
+		setStringParam  ( addr, ViewScreenConfiguredNDPluginConfigurationFile, "" );
+		setIntegerParam ( addr, ViewScreenConfiguredNDPluginConfigurationAutoReload, 1 );
+		setIntegerParam ( addr, ViewScreenConfiguredNDPluginConfigurationSelect, -1 );
+		setIntegerParam ( addr, ViewScreenConfiguredNDPluginConfigurationPreloaded, 0 );
+		setIntegerParam ( addr, ViewScreenConfiguredNDPluginConversionDirection, ConversionIImageToBeamspace );
+
+		callParamCallbacks ( addr );
+	}
+
+	plugins[std::string ( portName )] = this;
+
+	asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "%s: Correction kernels use %s, streaming outputs larger than %lu bytes.\n", pluginName, correction_kernel_name (), correction_streaming_threshold () );
 }
 
 
+ViewScreenConfiguredNDPlugin::Configuration::Configuration ():
+	version ( 0 ),
+	geometry ( "" ),
+	orientation ( "" ),
+	order ( -1 ),
+	nx ( 0 ),
+	ny ( 0 ),
+	xi ( 0. ),
+	xf ( 0. ),
+	yi ( 0. ),
+	yf ( 0. ),
+	x_orientation ( 0 ),
+	y_orientation ( 0 ) {
+}
+
 
-std::string ViewScreenConfiguredNDPlugin::get_efficiency_map_directory ( const size_t target_number ) const {
+std::string ViewScreenConfiguredNDPlugin::Configuration::get_efficiency_map_directory ( const size_t target_number ) const {
 
 	if ( target_number >= targets.size() ) return std::string ( "" );
 
@@ -92,7 +162,7 @@ std::string ViewScreenConfiguredNDPlugin::get_efficiency_map_directory ( const s
 }
 
 
-ViewScreenConfiguredNDPlugin::TargetInfo ViewScreenConfiguredNDPlugin::get_target_info ( const size_t target_number ) const {
+ViewScreenConfiguredNDPlugin::TargetInfo ViewScreenConfiguredNDPlugin::Configuration::get_target_info ( const size_t target_number ) const {
 
 	if ( target_number >= targets.size() ) {
 
@@ -102,20 +172,579 @@ ViewScreenConfiguredNDPlugin::TargetInfo ViewScreenConfiguredNDPlugin::get_targe
 	return this->targets.at ( target_number );
 }
 
-ViewScreenConfiguredNDPlugin::ConfigurationStatus_t ViewScreenConfiguredNDPlugin::load_configuration ( ) {
 
-	asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "%s::load_configuration: Begin.\n", pluginName );
+ViewScreenConfiguredNDPlugin *ViewScreenConfiguredNDPlugin::find_plugin ( const std::string port_name ) {
+
+	auto plugin = plugins.find ( port_name );
+	return (plugins.end() == plugin)? NULL: plugin->second;
+}
+
+
+/** The default implementation for plugins which only need the configuration itself */
+ViewScreenConfiguredNDPlugin::ConfigurationStatus_t ViewScreenConfiguredNDPlugin::prepare_configuration_tables ( const Configuration &, std::shared_ptr<const ConfigurationTables> &tables ) {
+
+	tables.reset ();
+	return ConfigurationStatusConfigured;
+}
+
+
+/** Parses a configuration file and prepares the tables which the subclass derives from it.
+  * This is called without the port lock; nothing here may modify the active configuration.
+  * \param[in] filename The name of the configuration file, relative to the configuration directory.
+  * \param[out] configuration The parsed configuration.
+  * \param[out] tables The tables prepared by the subclass.
+  */
+ViewScreenConfiguredNDPlugin::ConfigurationStatus_t ViewScreenConfiguredNDPlugin::prepare_configuration ( const std::string filename, std::shared_ptr<const Configuration> &configuration, std::shared_ptr<const ConfigurationTables> &tables ) {
+
+	std::shared_ptr<Configuration> new_configuration ( new Configuration () );
+
+	const ConfigurationStatus_t load_status = this->load_configuration ( this->get_configuration_directory() + filename, *new_configuration );
+	if ( ConfigurationStatusConfigured != load_status ) {
+
+		return load_status;
+	}
+
+	const ConfigurationStatus_t tables_status = this->prepare_configuration_tables ( *new_configuration, tables );
+	if ( ConfigurationStatusConfigured != tables_status ) {
+
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s: Unable to prepare the tables for configuration %s; status=%d.\n", pluginName, __func__, filename.c_str(), tables_status );
+		return tables_status;
+	}
+
+	configuration = new_configuration;
+	return ConfigurationStatusConfigured;
+}
+
+
+/** Makes a prepared configuration the active one on a screen and notifies the subclass.
+  * This function should be called from a locked state; frames are processed under the same lock, so the
+  * change always takes effect between frames.
+  * \param[in] addr The screen.
+  */
+ViewScreenConfiguredNDPlugin::ConfigurationStatus_t ViewScreenConfiguredNDPlugin::activate_configuration ( const int addr, std::shared_ptr<const Configuration> configuration, std::shared_ptr<const ConfigurationTables> tables ) {
+
+	this->screens[addr].configuration = configuration;
+	this->screens[addr].tables = tables;
+
+	return this->configuration_change_callback ( addr );
+}
+
+
+/** Prepares a configuration file and makes it the active one.
+  * This function should be called from a locked state; the lock is released while the file is parsed and the tables
+  * are built, and frames keep being processed with the active configuration meanwhile.
+  * \param[in] pasynUser The asynUser for tracing.
+  * \param[in] addr The screen.
+  * \param[in] filename The name of the configuration file, relative to the configuration directory.
+  */
+ViewScreenConfiguredNDPlugin::ConfigurationStatus_t ViewScreenConfiguredNDPlugin::load_and_activate_configuration ( asynUser *pasynUser, const int addr, const std::string filename ) {
+
+	setIntegerParam ( addr, ViewScreenConfiguredNDPluginConfigurationStatus, ConfigurationStatusConfiguring );
+	this->callParamCallbacks ( addr );
+
+	const size_t generation = ++this->screens[addr].configuration_generation;
+
+	std::shared_ptr<const Configuration> new_configuration;
+	std::shared_ptr<const ConfigurationTables> new_tables;
+
+	this->unlock();
+	const ConfigurationStatus_t configuration_status = this->prepare_configuration ( filename, new_configuration, new_tables );
+	this->lock();
+
+	if ( generation != this->screens[addr].configuration_generation ) {
+
+		asynPrint ( pasynUser, ASYN_TRACE_FLOW, "%s::%s: Configuration %s superseded while loading on screen %d.\n", pluginName, __func__, filename.c_str(), addr );
+		return configuration_status;
+	}
+
+	if ( ConfigurationStatusConfigured != configuration_status ) {
+
+		asynPrint ( pasynUser, ASYN_TRACE_ERROR, "%s::%s: Unable to load configuration on screen %d: status=%d.\n", pluginName, __func__, addr, configuration_status );
+		setIntegerParam ( addr, ViewScreenConfiguredNDPluginConfigurationStatus, configuration_status );
+		return configuration_status;
+	}
+
+	const ConfigurationStatus_t callback_status = this->activate_configuration ( addr, new_configuration, new_tables );
+	if ( ConfigurationStatusConfigured != callback_status ) {
+
+		asynPrint ( pasynUser, ASYN_TRACE_ERROR, "%s::%s: Configuration change callback returned with an error code.\n", pluginName, __func__ );
+	}
+	setIntegerParam ( addr, ViewScreenConfiguredNDPluginConfigurationStatus, callback_status );
+
+	/* Keep the freshly prepared tables if the file is one of the preloaded configurations */
+	this->store_preloaded_configuration ( filename, new_configuration, new_tables );
+
+	/* From now on, changes to the configuration files are picked up automatically */
+	this->start_configuration_watcher ();
+
+	return callback_status;
+}
+
+
+/** Replaces the list of preloaded configurations and starts preparing them in the background.
+  * \param[in] filenames The configuration files, relative to the configuration directory; they are selected by their index in this list.
+  * \param[in] memory_limit The number of bytes which the prepared tables may occupy; 0 for no limit.
+  */
+void ViewScreenConfiguredNDPlugin::set_preloaded_configurations ( const std::vector<std::string> filenames, const size_t memory_limit ) {
+
+	this->lock ();
+
+	this->preloaded_configurations.clear ();
+	for ( auto filename = filenames.begin(); filename != filenames.end(); filename++ ) {
+
+		this->preloaded_configurations.push_back ( PreloadedConfiguration ( *filename ) );
+	}
+	this->preloaded_configuration_memory_limit = memory_limit;
+
+	/* The active configurations may already be among them */
+	for ( int addr = 0; addr < this->get_screen_count(); addr++ ) {
+
+		if ( !this->is_configured ( addr ) ) continue;
+
+		char filename[128] = "";
+		this->getStringParam ( addr, ViewScreenConfiguredNDPluginConfigurationFile, sizeof(filename), filename );
+		this->store_preloaded_configuration ( std::string ( filename ), this->screens[addr].configuration, this->screens[addr].tables );
+	}
+
+	this->update_preloaded_configuration_count ();
+	this->call_screen_param_callbacks ();
+
+	if ( !this->configuration_preloader_running ) {
+
+		const std::string thread_name = std::string ( this->portName ) + "_preload";
+
+		if ( NULL == epicsThreadCreate ( thread_name.c_str(), epicsThreadPriorityLow, epicsThreadGetStackSize ( epicsThreadStackMedium ), configuration_preloader_thread, this ) ) {
+
+			asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s: Unable to start the configuration preloader thread; configurations will be prepared when they are selected.\n", pluginName, __func__ );
+		}
+		else {
+
+			this->configuration_preloader_running = true;
+		}
+	}
+
+	this->unlock ();
+}
+
+
+/** Prepares each preloaded configuration which hasn't been prepared yet, until the memory limit is reached.
+  * The files are parsed and the tables are built without the port lock.
+  */
+void ViewScreenConfiguredNDPlugin::preload_configurations () {
+
+	this->lock ();
+
+	while ( true ) {
+
+		/* Find the next configuration which hasn't been attempted */
+		auto entry = this->preloaded_configurations.begin();
+		while ( entry != this->preloaded_configurations.end() && ConfigurationStatusUnconfigured != entry->status ) entry++;
+
+		if ( entry == this->preloaded_configurations.end() ) break;
+
+		const std::string filename = entry->filename;
+		entry->status = ConfigurationStatusConfiguring;
+
+		this->unlock ();
+
+		std::shared_ptr<const Configuration> new_configuration;
+		std::shared_ptr<const ConfigurationTables> new_tables;
+		const ConfigurationStatus_t status = this->prepare_configuration ( filename, new_configuration, new_tables );
+
+		this->lock ();
+
+		/* The list may have been replaced meanwhile */
+		for ( entry = this->preloaded_configurations.begin(); entry != this->preloaded_configurations.end(); entry++ ) {
+
+			if ( entry->filename == filename && ConfigurationStatusConfiguring == entry->status ) break;
+		}
+		if ( entry == this->preloaded_configurations.end() ) continue;
+
+		entry->status = status;
+
+		if ( ConfigurationStatusConfigured != status ) {
+
+			asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s: Unable to preload configuration %s; status=%d.\n", pluginName, __func__, filename.c_str(), status );
+			continue;
+		}
+
+		const size_t required = new_tables? new_tables->memory_usage(): 0;
+		if ( (0 != this->preloaded_configuration_memory_limit) && (this->get_preloaded_configuration_memory_usage() + required > this->preloaded_configuration_memory_limit) ) {
+
+			asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::%s: The preloaded configuration memory limit has been reached; the remaining configurations will be prepared when they are selected.\n", pluginName, __func__ );
+			break;
+		}
+
+		this->store_preloaded_configuration ( filename, new_configuration, new_tables );
+
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "%s::%s: Preloaded configuration %s.\n", pluginName, __func__, filename.c_str() );
+		this->call_screen_param_callbacks ();
+	}
+
+	this->configuration_preloader_running = false;
+	this->unlock ();
+}
+
+
+void ViewScreenConfiguredNDPlugin::store_preloaded_configuration ( const std::string filename, std::shared_ptr<const Configuration> configuration, std::shared_ptr<const ConfigurationTables> tables ) {
+
+	auto stored = this->preloaded_configurations.begin();
+	while ( stored != this->preloaded_configurations.end() && stored->filename != filename ) stored++;
+
+	if ( stored == this->preloaded_configurations.end() ) return;
+
+	stored->configuration = configuration;
+	stored->tables = tables;
+	stored->status = ConfigurationStatusConfigured;
+	stored->last_used = ++this->preloaded_configuration_clock;
+
+	/* Evict the least recently used configurations until the rest fit; active configurations are never evicted */
+	while ( (0 != this->preloaded_configuration_memory_limit) && (this->get_preloaded_configuration_memory_usage() > this->preloaded_configuration_memory_limit) ) {
+
+		auto victim = this->preloaded_configurations.end();
+		for ( auto entry = this->preloaded_configurations.begin(); entry != this->preloaded_configurations.end(); entry++ ) {
+
+			if ( !entry->configuration || entry == stored || this->is_active_configuration ( entry->configuration ) ) continue;
+			if ( victim == this->preloaded_configurations.end() || entry->last_used < victim->last_used ) victim = entry;
+		}
+
+		if ( victim == this->preloaded_configurations.end() ) break;
+
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "%s::%s: Evicting preloaded configuration %s.\n", pluginName, __func__, victim->filename.c_str() );
+		victim->configuration.reset ();
+		victim->tables.reset ();
+	}
+
+	this->update_preloaded_configuration_count ();
+}
+
+
+void ViewScreenConfiguredNDPlugin::discard_preloaded_configurations ( const std::set<std::string> filenames, const bool all ) {
+
+	for ( auto entry = this->preloaded_configurations.begin(); entry != this->preloaded_configurations.end(); entry++ ) {
+
+		if ( !entry->configuration || this->is_active_configuration ( entry->configuration ) ) continue;
+		if ( !all && 0 == filenames.count ( entry->filename ) ) continue;
+
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "%s::%s: Discarding stale preloaded configuration %s.\n", pluginName, __func__, entry->filename.c_str() );
+		entry->configuration.reset ();
+		entry->tables.reset ();
+	}
+
+	this->update_preloaded_configuration_count ();
+}
+
+
+bool ViewScreenConfiguredNDPlugin::is_active_configuration ( const std::shared_ptr<const Configuration> &configuration ) const {
+
+	for ( auto screen = this->screens.begin(); screen != this->screens.end(); screen++ ) {
+
+		if ( screen->configuration == configuration ) return true;
+	}
+
+	return false;
+}
+
+
+size_t ViewScreenConfiguredNDPlugin::get_preloaded_configuration_memory_usage () const {
+
+	size_t memory_usage = 0;
+	for ( auto entry = this->preloaded_configurations.begin(); entry != this->preloaded_configurations.end(); entry++ ) {
+
+		if ( entry->tables ) memory_usage += entry->tables->memory_usage ();
+	}
+
+	return memory_usage;
+}
+
+
+void ViewScreenConfiguredNDPlugin::update_preloaded_configuration_count () {
+
+	int count = 0;
+	for ( auto entry = this->preloaded_configurations.begin(); entry != this->preloaded_configurations.end(); entry++ ) {
+
+		if ( entry->configuration ) count++;
+	}
+
+	/* The preloaded configurations are shared by all screens */
+	for ( int addr = 0; addr < this->get_screen_count(); addr++ ) {
+
+		setIntegerParam ( addr, ViewScreenConfiguredNDPluginConfigurationPreloaded, count );
+	}
+}
+
+
+void ViewScreenConfiguredNDPlugin::call_screen_param_callbacks () {
+
+	for ( int addr = 0; addr < this->get_screen_count(); addr++ ) {
+
+		this->callParamCallbacks ( addr );
+	}
+}
+
+
+/** Starts the thread which reloads the configuration when its files change on disk.
+  * This function should be called from a locked state.
+  */
+void ViewScreenConfiguredNDPlugin::start_configuration_watcher () {
+
+	#ifdef __linux__
+	if ( this->configuration_watcher_started ) return;
+
+	const std::string thread_name = std::string ( this->portName ) + "_watch";
+
+	if ( NULL == epicsThreadCreate ( thread_name.c_str(), epicsThreadPriorityLow, epicsThreadGetStackSize ( epicsThreadStackMedium ), configuration_watcher_thread, this ) ) {
+
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s: Unable to start the configuration watcher thread; configuration files will not be reloaded automatically.\n", pluginName, __func__ );
+		return;
+	}
+
+	this->configuration_watcher_started = true;
+	#endif
+}
+
+
+/** Watches the configuration file and efficiency map directories with inotify.
+  * When the configuration file of a screen, or an efficiency map used by it, changes, the configuration is parsed and
+  * its tables are prepared in this thread; the result then replaces the active configuration between two frames.
+  * Screens which use the same file share the reloaded configuration.
+  */
+void ViewScreenConfiguredNDPlugin::watch_configuration_files () {
+
+	#ifdef __linux__
+	const int fd = inotify_init1 ( IN_NONBLOCK | IN_CLOEXEC );
+
+	if ( fd < 0 ) {
+
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s: Unable to initialize inotify; errno=%d.\n", pluginName, __func__, errno );
+		return;
+	}
 
-	char filename[128];
+	const size_t screen_count = this->screens.size();
 
-	const asynStatus status = getStringParam ( ViewScreenConfiguredNDPluginConfigurationFile, 128, filename );
+	std::map<std::string,int> watches;	// directory -> watch descriptor (-1 if the directory couldn't be watched)
+	std::vector<bool> reload_pending ( screen_count, false );
 
-	if ( asynSuccess != status ) {
+	// changes which make preloaded configurations stale
+	std::set<std::string> changed_configuration_files;
+	bool efficiency_maps_changed = false;
 
-		return ConfigurationStatusAsynError;
+	while ( true ) {
+
+		/* Find the files which the active configurations depend on */
+		std::vector<std::string> filenames ( screen_count );
+		std::vector<bool> watched ( screen_count, false );
+		std::vector<size_t> generations ( screen_count, 0 );
+		std::vector< std::set<std::string> > screen_efficiency_map_directories ( screen_count );
+
+		this->lock ();
+
+		const bool watch_efficiency_maps = this->depends_on_efficiency_maps ();
+
+		for ( size_t addr = 0; addr < screen_count; addr++ ) {
+
+			int auto_reload = 0;
+			this->getIntegerParam ( (int)addr, ViewScreenConfiguredNDPluginConfigurationAutoReload, &auto_reload );
+
+			char filename[128] = "";
+			this->getStringParam ( (int)addr, ViewScreenConfiguredNDPluginConfigurationFile, sizeof(filename), filename );
+
+			filenames[addr] = filename;
+			watched[addr] = auto_reload && this->is_configured ( (int)addr );
+			generations[addr] = this->screens[addr].configuration_generation;
+
+			if ( !watched[addr] || !watch_efficiency_maps ) continue;
+
+			const std::shared_ptr<const Configuration> active_configuration = this->screens[addr].configuration;
+			for ( size_t target_number = 0; target_number < active_configuration->targets.size(); target_number++ ) {
+
+				const std::string directory = active_configuration->get_efficiency_map_directory ( target_number );
+				if ( 0 == directory.compare ( "" ) ) continue;
+
+				screen_efficiency_map_directories[addr].insert ( directory );
+			}
+		}
+
+		this->unlock ();
+
+		const std::string configuration_directory = this->get_configuration_directory ();
+		std::set<std::string> efficiency_map_directories;
+		std::set<std::string> directories;
+
+		for ( size_t addr = 0; addr < screen_count; addr++ ) {
+
+			if ( !watched[addr] ) continue;
+
+			directories.insert ( configuration_directory );
+			efficiency_map_directories.insert ( screen_efficiency_map_directories[addr].begin(), screen_efficiency_map_directories[addr].end() );
+			directories.insert ( screen_efficiency_map_directories[addr].begin(), screen_efficiency_map_directories[addr].end() );
+		}
+
+		/* Bring the inotify watch list up to date */
+		for ( auto watch = watches.begin(); watch != watches.end(); ) {
+
+			if ( 0 == directories.count ( watch->first ) ) {
+
+				if ( 0 <= watch->second ) inotify_rm_watch ( fd, watch->second );
+				watches.erase ( watch++ );
+			}
+			else {
+
+				watch++;
+			}
+		}
+
+		for ( auto directory = directories.begin(); directory != directories.end(); directory++ ) {
+
+			if ( 0 != watches.count ( *directory ) ) continue;
+
+			const int wd = inotify_add_watch ( fd, directory->c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE );
+			if ( wd < 0 ) {
+
+				asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::%s: Unable to watch directory %s; errno=%d.\n", pluginName, __func__, directory->c_str(), errno );
+			}
+			watches[*directory] = wd;
+		}
+
+		/* Wait for changes */
+		struct pollfd descriptor;
+		descriptor.fd = fd;
+		descriptor.events = POLLIN;
+		descriptor.revents = 0;
+
+		const int ready = poll ( &descriptor, 1, (int)(1000.*configuration_reload_settle_time) );
+
+		if ( ready < 0 ) {
+
+			if ( EINTR != errno ) epicsThreadSleep ( configuration_reload_settle_time );
+			continue;
+		}
+
+		if ( ready > 0 ) {
+
+			char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+			ssize_t length;
+
+			while ( 0 < (length = read ( fd, buffer, sizeof(buffer) )) ) {
+
+				for ( char *position = buffer; position < buffer + length; ) {
+
+					const struct inotify_event *event = (const struct inotify_event*)position;
+					position += sizeof(struct inotify_event) + event->len;
+
+					if ( 0 == event->len ) continue;
+
+					std::string directory;
+					for ( auto watch = watches.begin(); watch != watches.end(); watch++ ) {
+
+						if ( watch->second == event->wd ) directory = watch->first;
+					}
+
+					const std::string name ( event->name );
+
+					if ( directory == configuration_directory ) {
+
+						changed_configuration_files.insert ( name );
+
+						for ( size_t addr = 0; addr < screen_count; addr++ ) {
+
+							if ( watched[addr] && name == filenames[addr] ) reload_pending[addr] = true;
+						}
+					}
+
+					if ( (0 != efficiency_map_directories.count ( directory )) && (std::string::npos != name.find ( "cform" )) ) {
+
+						efficiency_maps_changed = true;
+
+						for ( size_t addr = 0; addr < screen_count; addr++ ) {
+
+							if ( 0 != screen_efficiency_map_directories[addr].count ( directory ) ) reload_pending[addr] = true;
+						}
+					}
+				}
+			}
+
+			/* Keep waiting until the files have settled */
+			continue;
+		}
+
+		/* Preloaded configurations whose files changed will be prepared again when they are selected */
+		if ( !changed_configuration_files.empty() || efficiency_maps_changed ) {
+
+			this->lock ();
+			this->discard_preloaded_configurations ( changed_configuration_files, efficiency_maps_changed );
+			this->call_screen_param_callbacks ();
+			this->unlock ();
+
+			changed_configuration_files.clear ();
+			efficiency_maps_changed = false;
+		}
+
+		// configurations reloaded in this pass, by file name
+		std::map<std::string, PreloadedConfiguration> reloaded;
+
+		for ( size_t addr = 0; addr < screen_count; addr++ ) {
+
+			if ( !reload_pending[addr] ) continue;
+			reload_pending[addr] = false;
+
+			if ( !watched[addr] ) continue;
+
+			const std::string &filename = filenames[addr];
+
+			if ( 0 == reloaded.count ( filename ) ) {
+
+				asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "%s::%s: Configuration files changed; reloading %s.\n", pluginName, __func__, filename.c_str() );
+
+				PreloadedConfiguration reload ( filename );
+				reload.status = this->prepare_configuration ( filename, reload.configuration, reload.tables );
+				reloaded.insert ( std::make_pair ( filename, reload ) );
+			}
+
+			const PreloadedConfiguration &reload = reloaded.find ( filename )->second;
+
+			this->lock ();
+
+			if ( generations[addr] != this->screens[addr].configuration_generation ) {
+
+				asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "%s::%s: Discarding the reloaded configuration of screen %lu; a new configuration file was selected meanwhile.\n", pluginName, __func__, (unsigned long)addr );
+			}
+			else if ( ConfigurationStatusConfigured != reload.status ) {
+
+				asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s: Unable to reload %s (status=%d); keeping the active configuration of screen %lu.\n", pluginName, __func__, filename.c_str(), reload.status, (unsigned long)addr );
+			}
+			else {
+
+				const ConfigurationStatus_t callback_status = this->activate_configuration ( (int)addr, reload.configuration, reload.tables );
+				if ( ConfigurationStatusConfigured != callback_status ) {
+
+					asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s: Configuration change callback returned with an error code.\n", pluginName, __func__ );
+				}
+				else {
+
+					asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "%s::%s: Reloaded configuration %s on screen %lu.\n", pluginName, __func__, filename.c_str(), (unsigned long)addr );
+				}
+
+				this->store_preloaded_configuration ( filename, reload.configuration, reload.tables );
+
+				this->setIntegerParam ( (int)addr, ViewScreenConfiguredNDPluginConfigurationStatus, callback_status );
+				this->call_screen_param_callbacks ();
+			}
+
+			this->unlock ();
+		}
 	}
+	#endif
+}
 
-	string full_filename = this->get_configuration_directory() + string ( filename );
+/** Parses a configuration file.
+  * This function doesn't use the port lock; it only modifies the configuration passed to it.
+  * \param[in] full_filename The path of the configuration file.
+  * \param[out] configuration The configuration read from the file.
+  */
+ViewScreenConfiguredNDPlugin::ConfigurationStatus_t ViewScreenConfiguredNDPlugin::load_configuration ( const std::string full_filename, Configuration &configuration ) {
+
+	asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "%s::load_configuration: Begin.\n", pluginName );
 
 	asynPrint ( this->pasynUserSelf, ASYN_TRACE_FLOW, "%s::load_configuration: Loading %s.\n", pluginName, full_filename.c_str() );
 
@@ -152,9 +781,9 @@ ViewScreenConfiguredNDPlugin::ConfigurationStatus_t ViewScreenConfiguredNDPlugin
 			return this->xmlerror_to_pluginstatus ( doc.ErrorID() );
 		}
 
-		this->geometry = string ( text );
+		configuration.geometry = string ( text );
 
-		if ( geometry.compare ( "elbt" ) && geometry.compare ( "embt" ) && geometry.compare ( "ehbt" ) ) {
+		if ( configuration.geometry.compare ( "elbt" ) && configuration.geometry.compare ( "embt" ) && configuration.geometry.compare ( "ehbt" ) ) {
 
 			asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s: XML Document Error; Unsupported geometry type: %s.\n", pluginName, __func__, text );
 			return ConfigurationStatusBadParameter;
@@ -170,14 +799,14 @@ ViewScreenConfiguredNDPlugin::ConfigurationStatus_t ViewScreenConfiguredNDPlugin
 			return this->xmlerror_to_pluginstatus ( doc.ErrorID() );
 		}
 
-		XMLError error = element->QueryIntAttribute ( "x", &this->x_orientation );
+		XMLError error = element->QueryIntAttribute ( "x", &configuration.x_orientation );
 		if ( XML_NO_ERROR != error ) {
 
 			asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s: XML Document Error; \"x\" attribute missing from <orientation> element.\n", pluginName, __func__ );
 			return this->xmlerror_to_pluginstatus ( error );
 		}
 
-		error = element->QueryIntAttribute ( "y", &this->y_orientation );
+		error = element->QueryIntAttribute ( "y", &configuration.y_orientation );
 		if ( XML_NO_ERROR != error ) {
 
 			asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s: XML Document Error; \"y\" attribute missing from <orientation> element.\n", pluginName, __func__ );
@@ -220,7 +849,7 @@ ViewScreenConfiguredNDPlugin::ConfigurationStatus_t ViewScreenConfiguredNDPlugin
 				return this->xmlerror_to_pluginstatus ( doc.ErrorID() );
 			}
 
-			this->targets[(size_t)target_number] = TargetInfo ( material, light_distribution );
+			configuration.targets[(size_t)target_number] = TargetInfo ( material, light_distribution );
 
 			element = element->NextSiblingElement ( "target" );
 		}
@@ -237,9 +866,9 @@ ViewScreenConfiguredNDPlugin::ConfigurationStatus_t ViewScreenConfiguredNDPlugin
 
 	/* Integer parameters */
 	vector< tuple<string,int*> > integer_parameters = {
-		make_tuple( string("BeamspaceImageWidth"), &(this->nx)),
-		make_tuple( string("BeamspaceImageHeight"), &(this->ny)),
-		make_tuple( string("MappingOrder"), &(this->order))
+		make_tuple( string("BeamspaceImageWidth"), &(configuration.nx)),
+		make_tuple( string("BeamspaceImageHeight"), &(configuration.ny)),
+		make_tuple( string("MappingOrder"), &(configuration.order))
 	};
 	for ( auto parameter = integer_parameters.begin(); parameter != integer_parameters.end(); parameter++ ) {
 
@@ -257,10 +886,10 @@ ViewScreenConfiguredNDPlugin::ConfigurationStatus_t ViewScreenConfiguredNDPlugin
 
 	/* Floating-point parameters */
 	vector< tuple<string,double*> > double_parameters = { 
-		make_tuple( string("BeamspaceStartX"), &(this->xi)),
-		make_tuple( string("BeamspaceEndX"), &(this->xf)),
-		make_tuple( string("BeamspaceStartY"), &(this->yi)),
-		make_tuple( string("BeamspaceEndY"), &(this->yf))
+		make_tuple( string("BeamspaceStartX"), &(configuration.xi)),
+		make_tuple( string("BeamspaceEndX"), &(configuration.xf)),
+		make_tuple( string("BeamspaceStartY"), &(configuration.yi)),
+		make_tuple( string("BeamspaceEndY"), &(configuration.yf))
 	};
 	for ( auto parameter = double_parameters.begin(); parameter != double_parameters.end(); parameter++ ) {
 
@@ -295,56 +924,195 @@ ViewScreenConfiguredNDPlugin::ConfigurationStatus_t ViewScreenConfiguredNDPlugin
 
 				/* Load the mapping coefficients */
 				vector< tuple<string,vector<double>*> > array_parameters = {
-					make_tuple( string("GUCoefficients"), &this->guc),
-					make_tuple( string("GVCoefficients"), &this->gvc),
-					make_tuple( string("FXCoefficients"), &this->fxc),
-					make_tuple( string("FYCoefficients"), &this->fyc)
+					make_tuple( string("GUCoefficients"), &configuration.guc),
+					make_tuple( string("GVCoefficients"), &configuration.gvc),
+					make_tuple( string("FXCoefficients"), &configuration.fxc),
+					make_tuple( string("FYCoefficients"), &configuration.fyc)
 				};
 				for ( auto parameter = array_parameters.begin(); parameter != array_parameters.end(); parameter++ ) {
 
-					element = calibration_element->FirstChildElement ( get<0>(*parameter).c_str() );
-					if ( NULL == element ) {
+					element = calibration_element->FirstChildElement ( get<0>(*parameter).c_str() );
+					if ( NULL == element ) {
+
+						asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::load_configuration: XML Document Error; couldn't find the GUCoefficients element.\n", pluginName );
+						return this->xmlerror_to_pluginstatus ( doc.ErrorID() );
+					}
+
+					stringstream cs( string( element->GetText() ) );
+					while ( cs.good() ) {
+
+						double coefficient;
+						cs >> coefficient;
+						get<1>(*parameter)->push_back ( coefficient );
+					}
+				}
+			}
+		}
+	}
+
+	/*cout << "Calibration\n-----------" << endl;
+	cout << "nx: " << nx << endl;
+	cout << "ny: " << nx << endl;
+	cout << "order: " << configuration.order << endl;
+	cout << "(xi,xf): (" << xi << "," << xf << ")" << endl;
+	cout << "(yi,yf): (" << yi << "," << yf << ")" << endl;
+
+	cout << "guc: ";
+	for_each ( guc.begin(), guc.end(), [](float f){cout << f << ", ";} );
+	cout << endl;
+
+	cout << "gvc: ";
+	for_each ( gvc.begin(), gvc.end(), [](float f){cout << f << ", ";} );
+	cout << endl;
+
+	cout << "fxc: ";
+	for_each ( fxc.begin(), fxc.end(), [](float f){cout << f << ", ";} );
+	cout << endl;
+
+	cout << "fyc: ";
+	for_each ( fyc.begin(), fyc.end(), [](float f){cout << f << ", ";} );
+	cout << endl;*/
+
+	return ConfigurationStatusConfigured;
+}
+
+
+/** Called when asyn clients call pasynInt32->write().
+  * Selecting a preloaded configuration swaps it in between two frames; if it had to be evicted, it is prepared again first.
+  * For other parameters it calls NDPluginDriver::writeInt32 to see if that method understands the parameter.
+  * \param[in] pasynUser pasynUser structure that encodes the reason and address.
+  * \param[in] value Value to write. */
+asynStatus ViewScreenConfiguredNDPlugin::writeInt32 ( asynUser *pasynUser, epicsInt32 value ) {
+
+	int addr = 0;
+	int function = pasynUser->reason;
+	asynStatus status = asynSuccess;
+	static const char *functionName = "writeInt32";
+
+	if ( function != ViewScreenConfiguredNDPluginConfigurationSelect ) {
+
+		return NDPluginDriver::writeInt32 ( pasynUser, value );
+	}
+
+	status = getAddress ( pasynUser, &addr ); if ( asynSuccess != status ) return ( status );
+
+	if ( (0 > value) || (this->preloaded_configurations.size() <= (size_t)value) ) {
+
+		epicsSnprintf ( pasynUser->errorMessage, pasynUser->errorMessageSize, "%s:%s: no preloaded configuration with index %d", pluginName, functionName, value );
+		return asynError;
+	}
+
+	setIntegerParam ( addr, ViewScreenConfiguredNDPluginConfigurationSelect, value );
+
+	PreloadedConfiguration &selected = this->preloaded_configurations[(size_t)value];
+	const std::string filename = selected.filename;
+	setStringParam ( addr, ViewScreenConfiguredNDPluginConfigurationFile, filename.c_str() );
+
+	if ( selected.configuration ) {
+
+		++this->screens[addr].configuration_generation;
+		selected.last_used = ++this->preloaded_configuration_clock;
+
+		const ConfigurationStatus_t callback_status = this->activate_configuration ( addr, selected.configuration, selected.tables );
+		if ( ConfigurationStatusConfigured != callback_status ) {
+
+			asynPrint ( pasynUser, ASYN_TRACE_ERROR, "%s:%s: Configuration change callback returned with an error code.\n", pluginName, functionName );
+		}
+		setIntegerParam ( addr, ViewScreenConfiguredNDPluginConfigurationStatus, callback_status );
+
+		this->start_configuration_watcher ();
+	}
+	else {
+
+		asynPrint ( pasynUser, ASYN_TRACE_FLOW, "%s:%s: Configuration %s isn't prepared; loading it.\n", pluginName, functionName, filename.c_str() );
+		this->load_and_activate_configuration ( pasynUser, addr, filename );
+	}
+
+	/* Loading may have changed the preloaded configurations, which all screens report */
+	this->call_screen_param_callbacks ();
+
+	asynPrint ( pasynUser, ASYN_TRACEIO_DRIVER, "%s:%s: function=%d, addr=%d, value=%d\n", pluginName, functionName, function, addr, value );
+	return status;
+}
+
+
+/** Called when asyn clients call pasynFloat64Array->write().
+  * A write to CONVERSION_INPUT converts the interleaved pairs of points in the direction selected by CONVERSION_DIRECTION
+  * with the active configuration of the addressed screen; the result is published through CONVERSION_OUTPUT.
+  * \param[in] pasynUser pasynUser structure that encodes the reason and address.
+  * \param[in] value The interleaved pairs of points.
+  * \param[in] nElements The number of elements, twice the number of points. */
+asynStatus ViewScreenConfiguredNDPlugin::writeFloat64Array ( asynUser *pasynUser, epicsFloat64 *value, size_t nElements ) {
+
+	int addr = 0;
+	int function = pasynUser->reason;
+	static const char *functionName = "writeFloat64Array";
+
+	if ( function != ViewScreenConfiguredNDPluginConversionInput ) {
+
+		return NDPluginDriver::writeFloat64Array ( pasynUser, value, nElements );
+	}
+
+	const asynStatus status = getAddress ( pasynUser, &addr ); if ( asynSuccess != status ) return ( status );
+
+	if ( !this->is_configured ( addr ) ) {
+
+		epicsSnprintf ( pasynUser->errorMessage, pasynUser->errorMessageSize, "%s:%s: no configuration is loaded", pluginName, functionName );
+		return asynError;
+	}
+
+	if ( 0 != nElements % 2 ) {
+
+		epicsSnprintf ( pasynUser->errorMessage, pasynUser->errorMessageSize, "%s:%s: the number of elements (%lu) must be even", pluginName, functionName, (unsigned long)nElements );
+		return asynError;
+	}
+
+	int direction = ConversionIImageToBeamspace;
+	getIntegerParam ( addr, ViewScreenConfiguredNDPluginConversionDirection, &direction );
 
-						asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::load_configuration: XML Document Error; couldn't find the GUCoefficients element.\n", pluginName );
-						return this->xmlerror_to_pluginstatus ( doc.ErrorID() );
-					}
+	/* Convert the points with the configuration which is active now; the lock isn't needed for that */
+	const std::shared_ptr<const Configuration> configuration = this->screens[addr].configuration;
+	std::vector<epicsFloat64> output ( nElements );
 
-					stringstream cs( string( element->GetText() ) );
-					while ( cs.good() ) {
+	this->unlock ();
+	const bool converted = convert_coordinates ( *configuration, (ConversionDirection_t)direction, value, output.data(), nElements / 2 );
+	this->lock ();
 
-						double coefficient;
-						cs >> coefficient;
-						get<1>(*parameter)->push_back ( coefficient );
-					}
-				}
-			}
-		}
+	if ( !converted ) {
+
+		epicsSnprintf ( pasynUser->errorMessage, pasynUser->errorMessageSize, "%s:%s: unknown conversion direction %d", pluginName, functionName, direction );
+		return asynError;
 	}
 
-	/*cout << "Calibration\n-----------" << endl;
-	cout << "nx: " << nx << endl;
-	cout << "ny: " << nx << endl;
-	cout << "order: " << this->order << endl;
-	cout << "(xi,xf): (" << xi << "," << xf << ")" << endl;
-	cout << "(yi,yf): (" << yi << "," << yf << ")" << endl;
+	std::vector<epicsFloat64> &conversion_output = this->screens[addr].conversion_output;
+	conversion_output.swap ( output );
+	doCallbacksFloat64Array ( conversion_output.data(), conversion_output.size(), ViewScreenConfiguredNDPluginConversionOutput, addr );
 
-	cout << "guc: ";
-	for_each ( guc.begin(), guc.end(), [](float f){cout << f << ", ";} );
-	cout << endl;
+	asynPrint ( pasynUser, ASYN_TRACEIO_DRIVER, "%s:%s: function=%d, converted %lu points\n", pluginName, functionName, function, (unsigned long)(nElements / 2) );
+	return asynSuccess;
+}
 
-	cout << "gvc: ";
-	for_each ( gvc.begin(), gvc.end(), [](float f){cout << f << ", ";} );
-	cout << endl;
 
-	cout << "fxc: ";
-	for_each ( fxc.begin(), fxc.end(), [](float f){cout << f << ", ";} );
-	cout << endl;
+/** Called when asyn clients call pasynFloat64Array->read().
+  * Returns the points produced by the last write to CONVERSION_INPUT.
+  */
+asynStatus ViewScreenConfiguredNDPlugin::readFloat64Array ( asynUser *pasynUser, epicsFloat64 *value, size_t nElements, size_t *nIn ) {
 
-	cout << "fyc: ";
-	for_each ( fyc.begin(), fyc.end(), [](float f){cout << f << ", ";} );
-	cout << endl;*/
+	int addr = 0;
+	int function = pasynUser->reason;
 
-	return ConfigurationStatusConfigured;
+	if ( function != ViewScreenConfiguredNDPluginConversionOutput ) {
+
+		return NDPluginDriver::readFloat64Array ( pasynUser, value, nElements, nIn );
+	}
+
+	const asynStatus status = getAddress ( pasynUser, &addr ); if ( asynSuccess != status ) return ( status );
+
+	const std::vector<epicsFloat64> &conversion_output = this->screens[addr].conversion_output;
+	*nIn = std::min ( nElements, conversion_output.size() );
+	std::copy ( conversion_output.begin(), conversion_output.begin() + *nIn, value );
+
+	return asynSuccess;
 }
 
 
@@ -374,28 +1142,23 @@ asynStatus ViewScreenConfiguredNDPlugin::writeOctet( asynUser *pasynUser, const
 
 	if ( function == ViewScreenConfiguredNDPluginConfigurationFile ) {
 
-		setIntegerParam ( ViewScreenConfiguredNDPluginConfigurationStatus, ConfigurationStatusConfiguring );
-		this->callParamCallbacks (addr);
+		char filename[128] = "";
+		getStringParam ( addr, ViewScreenConfiguredNDPluginConfigurationFile, sizeof(filename), filename );
 
-		const ConfigurationStatus_t configuration_status = this->load_configuration ();
-		if ( ConfigurationStatusConfigured != configuration_status ) {
+		int selection = -1;
+		for ( size_t index = 0; index < this->preloaded_configurations.size(); index++ ) {
 
-			asynPrint ( pasynUser, ASYN_TRACE_ERROR, "%s:%s; Unable to load configuration: status=%d.\n", pluginName, functionName, configuration_status );
-			setIntegerParam ( ViewScreenConfiguredNDPluginConfigurationStatus, configuration_status );
+			if ( 0 == this->preloaded_configurations[index].filename.compare ( filename ) ) selection = (int)index;
 		}
-		else {
-
-			const ConfigurationStatus_t callback_status = this->configuration_change_callback();
-			if ( ConfigurationStatusConfigured != callback_status ) {
+		setIntegerParam ( addr, ViewScreenConfiguredNDPluginConfigurationSelect, selection );
 
-				asynPrint ( pasynUser, ASYN_TRACE_ERROR, "%s:%s; Configuration change callback returned with an error code.\n", pluginName, functionName );
-			}
-			setIntegerParam ( ViewScreenConfiguredNDPluginConfigurationStatus, callback_status );
-		}
+		/* Writing the file name always rereads the file, even if it was preloaded */
+		this->load_and_activate_configuration ( pasynUser, addr, std::string ( filename ) );
     }
     
      /* Do callbacks so higher layers see any changes */
     status = (asynStatus) callParamCallbacks ( addr );
+    if ( function == ViewScreenConfiguredNDPluginConfigurationFile ) this->call_screen_param_callbacks ();
 
     if (status) 
         epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize, 
@@ -409,7 +1172,7 @@ asynStatus ViewScreenConfiguredNDPlugin::writeOctet( asynUser *pasynUser, const
 }
 
 
-double ViewScreenConfiguredNDPlugin::fx ( const double u, const double v ) const {
+double ViewScreenConfiguredNDPlugin::Configuration::fx ( const double u, const double v ) const {
 
 	if ( this->order < 0 ) {
 		return 0.;
@@ -425,7 +1188,7 @@ double ViewScreenConfiguredNDPlugin::fx ( const double u, const double v ) const
 }
 
 
-double ViewScreenConfiguredNDPlugin::fy ( const double u, const double v ) const {
+double ViewScreenConfiguredNDPlugin::Configuration::fy ( const double u, const double v ) const {
 
 	if ( this->order < 0 ) {
 		return 0.;
@@ -441,7 +1204,7 @@ double ViewScreenConfiguredNDPlugin::fy ( const double u, const double v ) const
 }
 
 
-double ViewScreenConfiguredNDPlugin::gu ( const double x, const double y ) const {
+double ViewScreenConfiguredNDPlugin::Configuration::gu ( const double x, const double y ) const {
 
 	if ( this->order < 0 ) {
 		return 0.;
@@ -457,7 +1220,7 @@ double ViewScreenConfiguredNDPlugin::gu ( const double x, const double y ) const
 }
 
 
-double ViewScreenConfiguredNDPlugin::gv ( const double x, const double y ) const {
+double ViewScreenConfiguredNDPlugin::Configuration::gv ( const double x, const double y ) const {
 
 	if ( this->order < 0 ) {
 		return 0.;
@@ -472,36 +1235,126 @@ double ViewScreenConfiguredNDPlugin::gv ( const double x, const double y ) const
 	return gsl_poly_eval ( vc.data(), this->order+1, x );
 }
 
+/** The coefficients, in x, of the partial derivatives of a mapping polynomial at a fixed y.
+  * The polynomial is the sum of c[i*terms+j] x^i y^j, so d/dx has terms-1 coefficients and d/dy has terms.
+  */
+static void polynomial_gradient_coefficients ( const vector<double> &c, const size_t terms, const double y, double *d_dx, double *d_dy ) {
+
+	for ( size_t i = 0; i < terms; i++ ) {
+
+		const double *row = c.data() + i*terms;
+		double a = 0., b = 0.;
+
+		for ( size_t j = terms; j-- > 0; ) {
+
+			a = a*y + row[j];
+			if ( j > 0 ) b = b*y + j*row[j];
+		}
+
+		if ( i > 0 ) d_dx[i-1] = i*a;
+		d_dy[i] = b;
+	}
+}
+
+
+static void polynomial_gradient ( const vector<double> &c, const int order, const double x, const double y, double &d_dx, double &d_dy ) {
+
+	if ( order < 0 ) {
+
+		d_dx = d_dy = 0.;
+		return;
+	}
+
+	const size_t terms = (size_t)order + 1;
+	vector<double> x_coefficients ( terms ), y_coefficients ( terms );
+	polynomial_gradient_coefficients ( c, terms, y, x_coefficients.data(), y_coefficients.data() );
+
+	d_dx = (terms > 1)? gsl_poly_eval ( x_coefficients.data(), terms-1, x ): 0.;
+	d_dy = gsl_poly_eval ( y_coefficients.data(), terms, x );
+}
+
+
+void ViewScreenConfiguredNDPlugin::Configuration::gu_gradient ( const double x, const double y, double &du_dx, double &du_dy ) const {
+
+	polynomial_gradient ( this->guc, this->order, x, y, du_dx, du_dy );
+}
+
+
+void ViewScreenConfiguredNDPlugin::Configuration::gv_gradient ( const double x, const double y, double &dv_dx, double &dv_dy ) const {
+
+	polynomial_gradient ( this->gvc, this->order, x, y, dv_dx, dv_dy );
+}
+
 /* Output image -> beamspace */
-void ViewScreenConfiguredNDPlugin::oimage_to_beamspace ( const double u, const double v, double &x, double &y ) const {
+void ViewScreenConfiguredNDPlugin::Configuration::oimage_to_beamspace ( const double u, const double v, double &x, double &y ) const {
 
 	x = this->xi + (u + 0.5)*(this->xf - this->xi)/this->nx;
 	y = this->yf - (v + 0.5)*(this->yf - this->yi)/this->ny;
 }
 
 /* Beamspace -> output image */
-void ViewScreenConfiguredNDPlugin::beamspace_to_oimage ( const double x, const double y, double &u, double &v ) const {
+void ViewScreenConfiguredNDPlugin::Configuration::beamspace_to_oimage ( const double x, const double y, double &u, double &v ) const {
 
 	u = this->nx*(x - this->xi)/(this->xf - this->xi) - 0.5;
 	v = this->ny*(this->yf - y)/(this->yf - this->yi) - 0.5;
 }
 
 /* Input image (ccd) -> beamspace */
-void ViewScreenConfiguredNDPlugin::iimage_to_beamspace ( const double u, const double v, double &x, double &y ) const {
+void ViewScreenConfiguredNDPlugin::Configuration::iimage_to_beamspace ( const double u, const double v, double &x, double &y ) const {
 
 	x = this->fx ( u, v );
 	y = this->fy ( u, v );
 }
 
 /* Beamspace -> input image (ccd) */
-void ViewScreenConfiguredNDPlugin::beamspace_to_iimage ( const double x, const double y, double &u, double &v ) const {
+void ViewScreenConfiguredNDPlugin::Configuration::beamspace_to_iimage ( const double x, const double y, double &u, double &v ) const {
 
 	u = this->gu ( x, y );
 	v = this->gv ( x, y );
 }
 
 
-double ViewScreenConfiguredNDPlugin::ccd_area_covered_by_output_pixel ( const double u, const double v ) const {
+bool ViewScreenConfiguredNDPlugin::convert_coordinates ( const Configuration &configuration, const ConversionDirection_t direction, const epicsFloat64 *input, epicsFloat64 *output, const size_t npoints ) {
+
+	for ( size_t point = 0; point < npoints; point++ ) {
+
+		const double a = input[2*point];
+		const double b = input[2*point+1];
+		double &c = output[2*point];
+		double &d = output[2*point+1];
+		double x, y;
+
+		switch ( direction ) {
+			case ConversionIImageToBeamspace:
+				configuration.iimage_to_beamspace ( a, b, c, d );
+				break;
+			case ConversionBeamspaceToIImage:
+				configuration.beamspace_to_iimage ( a, b, c, d );
+				break;
+			case ConversionOImageToBeamspace:
+				configuration.oimage_to_beamspace ( a, b, c, d );
+				break;
+			case ConversionBeamspaceToOImage:
+				configuration.beamspace_to_oimage ( a, b, c, d );
+				break;
+			case ConversionIImageToOImage:
+				configuration.iimage_to_beamspace ( a, b, x, y );
+				configuration.beamspace_to_oimage ( x, y, c, d );
+				break;
+			case ConversionOImageToIImage:
+				configuration.oimage_to_beamspace ( a, b, x, y );
+				configuration.beamspace_to_iimage ( x, y, c, d );
+				break;
+			default:
+				return false;
+		}
+	}
+
+	return true;
+}
+
+
+double ViewScreenConfiguredNDPlugin::Configuration::ccd_area_covered_by_output_pixel ( const double u, const double v ) const {
 
 	array< tuple<double, double>, 5 > deltas = { make_tuple(0.,0.), make_tuple(-0.5,0.5), make_tuple(-0.5,-0.5), make_tuple(0.5,0.5), make_tuple(0.5,-0.5) };
 
@@ -589,10 +1442,262 @@ double ViewScreenConfiguredNDPlugin::ccd_area_covered_by_output_pixel ( const do
 }
 
 
-bool ViewScreenConfiguredNDPlugin::is_configured () const {
+void ViewScreenConfiguredNDPlugin::Configuration::oimage_corners_to_iimage ( std::vector<double> &corner_u, std::vector<double> &corner_v ) const {
+
+	const size_t width = this->get_output_image_width();
+	const size_t height = this->get_output_image_height();
+	const size_t stride = width + 1;
+
+	corner_u.assign ( stride * (height + 1), 0. );
+	corner_v.assign ( stride * (height + 1), 0. );
+
+	if ( this->order < 0 ) {
+		return;
+	}
+
+	const size_t terms = (size_t)this->order + 1;
+
+	/* Beamspace x only depends on the column of a corner, and y only on its row */
+	vector<double> x ( stride );
+	for ( size_t i = 0; i < stride; i++ ) {
+
+		double y;
+		this->oimage_to_beamspace ( (double)i - 0.5, -0.5, x[i], y );
+	}
+
+	vector<double> uc ( terms ), vc ( terms );
+
+	for ( size_t j = 0; j <= height; j++ ) {
+
+		double x0, y;
+		this->oimage_to_beamspace ( -0.5, (double)j - 0.5, x0, y );
+
+		/* Along a row, gu and gv are polynomials in x alone */
+		for ( size_t i = 0; i < terms; i++ ) {
+
+			uc[i] = gsl_poly_eval ( guc.data()+(i*terms), terms, y );
+			vc[i] = gsl_poly_eval ( gvc.data()+(i*terms), terms, y );
+		}
+
+		/* Horner's rule, one coefficient at a time across the row, so that the inner loops vectorize */
+		double *u = &corner_u[j*stride];
+		double *v = &corner_v[j*stride];
+
+		for ( size_t i = 0; i < stride; i++ ) {
+
+			u[i] = uc[terms-1];
+			v[i] = vc[terms-1];
+		}
+
+		for ( size_t term = terms - 1; term-- > 0; ) {
+
+			const double ut = uc[term];
+			const double vt = vc[term];
+
+			for ( size_t i = 0; i < stride; i++ ) {
+
+				u[i] = u[i]*x[i] + ut;
+				v[i] = v[i]*x[i] + vt;
+			}
+		}
+	}
+}
+
+
+void ViewScreenConfiguredNDPlugin::Configuration::ccd_areas_covered_by_output_pixels ( std::vector<double> &areas ) const {
+
+	const size_t width = this->get_output_image_width();
+	const size_t height = this->get_output_image_height();
+	const size_t stride = width + 1;
+
+	vector<double> corner_u, corner_v;
+	this->oimage_corners_to_iimage ( corner_u, corner_v );
+
+	areas.resize ( width * height );
+
+	for ( size_t j = 0; j < height; j++ ) {
+
+		const double *u0 = &corner_u[j*stride], *u1 = u0 + stride;
+		const double *v0 = &corner_v[j*stride], *v1 = v0 + stride;
+		double *area = &areas[j*width];
+
+		/* The corners of a pixel are already in order around it, so its diagonals join opposite lattice corners */
+		for ( size_t i = 0; i < width; i++ ) {
+
+			const double ACx = u1[i+1] - u0[i];
+			const double ACy = v1[i+1] - v0[i];
+			const double BDx = u1[i] - u0[i+1];
+			const double BDy = v1[i] - v0[i+1];
+
+			area[i] = 0.5 * fabs ( ACx*BDy - BDx*ACy );
+		}
+	}
+}
+
+
+/** The nodes and weights of the n-point Gauss-Legendre rule over a pixel: offsets from its centre in pixels, and weights summing to 1 */
+static bool gauss_legendre_rule ( const size_t n, vector<double> &nodes, vector<double> &weights ) {
+
+	/* The positive nodes and their weights on [-1, 1] */
+	static const double nodes_1[] = { 0. };
+	static const double weights_1[] = { 2. };
+	static const double nodes_2[] = { 0.5773502691896257 };
+	static const double weights_2[] = { 1. };
+	static const double nodes_3[] = { 0., 0.7745966692414834 };
+	static const double weights_3[] = { 0.8888888888888889, 0.5555555555555556 };
+	static const double nodes_4[] = { 0.3399810435848563, 0.8611363115940526 };
+	static const double weights_4[] = { 0.6521451548625461, 0.3478548451374538 };
+	static const double nodes_5[] = { 0., 0.5384693101056831, 0.9061798459386640 };
+	static const double weights_5[] = { 0.5688888888888889, 0.4786286704993665, 0.2369268850561891 };
+
+	static const double *rule_nodes[] = { NULL, nodes_1, nodes_2, nodes_3, nodes_4, nodes_5 };
+	static const double *rule_weights[] = { NULL, weights_1, weights_2, weights_3, weights_4, weights_5 };
+
+	if ( (1 > n) || (ViewScreenConfiguredNDPlugin::Configuration::max_quadrature_points < n) ) return false;
+
+	nodes.clear ();
+	weights.clear ();
+
+	for ( size_t k = 0; k < (n + 1) / 2; k++ ) {
+
+		const double node = rule_nodes[n][k] / 2.;
+		const double weight = rule_weights[n][k] / 2.;
+
+		nodes.push_back ( node );
+		weights.push_back ( weight );
+
+		if ( 0. != node ) {
+
+			nodes.push_back ( -node );
+			weights.push_back ( weight );
+		}
+	}
+
+	return true;
+}
+
+
+double ViewScreenConfiguredNDPlugin::Configuration::ccd_area_from_jacobian ( const double u, const double v, const size_t quadrature_points ) const {
+
+	vector<double> nodes, weights;
+	if ( !gauss_legendre_rule ( quadrature_points, nodes, weights ) ) return 0.;
+
+	double area = 0.;
+	for ( size_t a = 0; a < nodes.size(); a++ ) {
+
+		for ( size_t b = 0; b < nodes.size(); b++ ) {
+
+			double x, y, du_dx, du_dy, dv_dx, dv_dy;
+			this->oimage_to_beamspace ( u + nodes[a], v + nodes[b], x, y );
+			this->gu_gradient ( x, y, du_dx, du_dy );
+			this->gv_gradient ( x, y, dv_dx, dv_dy );
+
+			area += weights[a] * weights[b] * fabs ( du_dx*dv_dy - du_dy*dv_dx );
+		}
+	}
+
+	/* The Jacobian is per unit of beamspace area */
+	return area * fabs ( (this->xf - this->xi)/this->nx * (this->yf - this->yi)/this->ny );
+}
+
+
+void ViewScreenConfiguredNDPlugin::Configuration::ccd_areas_from_jacobian ( const size_t quadrature_points, std::vector<double> &areas ) const {
+
+	const size_t width = this->get_output_image_width();
+	const size_t height = this->get_output_image_height();
+
+	areas.assign ( width * height, 0. );
+
+	vector<double> nodes, weights;
+	if ( (this->order < 0) || !gauss_legendre_rule ( quadrature_points, nodes, weights ) ) {
+		return;
+	}
+
+	const size_t terms = (size_t)this->order + 1;
+	const size_t samples = nodes.size();
+
+	/* Beamspace x only depends on the column of a sample, and y only on its row */
+	vector<double> x ( samples * width );
+	for ( size_t a = 0; a < samples; a++ ) {
+
+		for ( size_t i = 0; i < width; i++ ) {
+
+			double y;
+			this->oimage_to_beamspace ( i + nodes[a], 0., x[a*width + i], y );
+		}
+	}
+
+	vector<double> u_x ( terms ), u_y ( terms ), v_x ( terms ), v_y ( terms );
+	vector<double> du_dx ( width ), du_dy ( width ), dv_dx ( width ), dv_dy ( width );
+
+	for ( size_t j = 0; j < height; j++ ) {
+
+		double *area = &areas[j*width];
+
+		for ( size_t b = 0; b < samples; b++ ) {
+
+			double x0, y;
+			this->oimage_to_beamspace ( 0., j + nodes[b], x0, y );
+
+			/* Along a row of samples, the derivatives are polynomials in x alone */
+			polynomial_gradient_coefficients ( this->guc, terms, y, u_x.data(), u_y.data() );
+			polynomial_gradient_coefficients ( this->gvc, terms, y, v_x.data(), v_y.data() );
+
+			for ( size_t a = 0; a < samples; a++ ) {
+
+				const double *xs = &x[a*width];
+
+				/* Horner's rule, one coefficient at a time across the row, so that the inner loops vectorize */
+				for ( size_t i = 0; i < width; i++ ) {
+
+					du_dx[i] = (terms > 1)? u_x[terms-2]: 0.;
+					dv_dx[i] = (terms > 1)? v_x[terms-2]: 0.;
+					du_dy[i] = u_y[terms-1];
+					dv_dy[i] = v_y[terms-1];
+				}
+
+				for ( size_t term = terms - 1; term-- > 0; ) {
+
+					const double uy = u_y[term];
+					const double vy = v_y[term];
+
+					for ( size_t i = 0; i < width; i++ ) {
+
+						du_dy[i] = du_dy[i]*xs[i] + uy;
+						dv_dy[i] = dv_dy[i]*xs[i] + vy;
+					}
+
+					if ( 0 == term ) continue;
+
+					const double ux = u_x[term-1];
+					const double vx = v_x[term-1];
+
+					for ( size_t i = 0; i < width; i++ ) {
+
+						du_dx[i] = du_dx[i]*xs[i] + ux;
+						dv_dx[i] = dv_dx[i]*xs[i] + vx;
+					}
+				}
+
+				const double weight = weights[a] * weights[b];
+				for ( size_t i = 0; i < width; i++ ) {
+
+					area[i] += weight * fabs ( du_dx[i]*dv_dy[i] - du_dy[i]*dv_dx[i] );
+				}
+			}
+		}
+	}
+
+	/* The Jacobian is per unit of beamspace area */
+	const double pixel_area = fabs ( (this->xf - this->xi)/this->nx * (this->yf - this->yi)/this->ny );
+	for ( size_t i = 0; i < areas.size(); i++ ) areas[i] *= pixel_area;
+}
+
+
+bool ViewScreenConfiguredNDPlugin::is_configured ( const int addr ) const {
 
 	ConfigurationStatus_t configuration_status = ConfigurationStatusUnconfigured;
-	if ( asynSuccess != const_cast<ViewScreenConfiguredNDPlugin*>(this)->getIntegerParam ( this->ViewScreenConfiguredNDPluginConfigurationStatus, (int*)&configuration_status ) ) {
+	if ( asynSuccess != const_cast<ViewScreenConfiguredNDPlugin*>(this)->getIntegerParam ( addr, this->ViewScreenConfiguredNDPluginConfigurationStatus, (int*)&configuration_status ) ) {
 
 		return false;
 	}
@@ -601,6 +1706,191 @@ bool ViewScreenConfiguredNDPlugin::is_configured () const {
 }
 
 
+/** Finds the screen which an NDArray belongs to.
+  * The screen is the Int32 value of the attribute named by SCREEN_ATTRIBUTE; without an attribute name, every
+  * array belongs to the first screen.
+  * This function should be called from a locked state.
+  * \param[in] pArray The array.
+  * \return The address of the screen, or -1 if the array should be dropped.
+  */
+int ViewScreenConfiguredNDPlugin::get_screen_address ( NDArray *pArray ) {
+
+	char attribute_name[128] = "";
+	getStringParam ( ViewScreenConfiguredNDPluginScreenAttribute, sizeof(attribute_name), attribute_name );
+
+	if ( '\0' == attribute_name[0] ) return 0;
+
+	NDAttribute *attribute = pArray->pAttributeList->find ( attribute_name );
+	epicsInt32 addr = -1;
+
+	if ( (NULL == attribute) || (ND_SUCCESS != attribute->getValue ( NDAttrInt32, &addr )) ) {
+
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::%s: The array has no attribute %s; dropping it.\n", pluginName, __func__, attribute_name );
+		return -1;
+	}
+
+	if ( (0 > addr) || (this->get_screen_count() <= addr) ) {
+
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_WARNING, "%s::%s: The array belongs to screen %d, but there are only %d screens; dropping it.\n", pluginName, __func__, addr, this->get_screen_count() );
+		return -1;
+	}
+
+	return addr;
+}
+
+
+epicsUInt16 ViewScreenConfiguredNDPlugin::CorrectionTable::float_to_half ( const float value ) {
+
+	union { float value; epicsUInt32 bits; } conversion;
+	conversion.value = value;
+
+	const epicsUInt16 sign = (epicsUInt16)((conversion.bits >> 16) & 0x8000);
+	epicsUInt32 magnitude = conversion.bits & 0x7fffffff;
+
+	if ( magnitude >= 0x477ff000 ) return sign | 0x7bff;	// rounds past 65504, the largest half; also infinities and NaNs
+	if ( magnitude < 0x38800000 ) return sign;				// below 2^-14, the smallest normal half
+
+	/* Rebias the exponent and round the mantissa to 10 bits, to nearest even; a carry correctly moves into the exponent */
+	magnitude += 0x0fff + ((magnitude >> 13) & 1);
+	return sign | (epicsUInt16)((magnitude - ((127 - 15) << 23)) >> 13);
+}
+
+
+void ViewScreenConfiguredNDPlugin::CorrectionTable::reduce_precision () {
+
+	if ( this->values.empty() ) return;
+
+	this->half_values.resize ( this->values.size() );
+
+	double error = 0.;
+	for ( size_t i = 0; i < this->values.size(); i++ ) {
+
+		this->half_values[i] = float_to_half ( this->values[i] );
+		if ( 0. == this->values[i] ) continue;
+
+		const double relative_error = std::fabs ( ((double)half_to_float ( this->half_values[i] ) - this->values[i]) / this->values[i] );
+		if ( relative_error > error ) error = relative_error;
+	}
+
+	/* The errors compound */
+	this->max_relative_error = (1. + this->max_relative_error) * (1. + error) - 1.;
+	std::vector<float> ().swap ( this->values );
+}
+
+
+bool ViewScreenConfiguredNDPlugin::check_correction_table_size ( NDArray *pArray, const size_t table_size ) {
+
+	NDArrayInfo_t ndarray_info;
+	pArray->getInfo ( &ndarray_info );
+
+	if ( (0 == table_size) || (table_size != ndarray_info.nElements) ) {
+
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::correct_array: Correction table size (%lu) does not match the array (%lu elements).\n", pluginName, table_size, ndarray_info.nElements );
+		return false;
+	}
+
+	return true;
+}
+
+
+NDArray *ViewScreenConfiguredNDPlugin::correct_array ( NDArray *pArray, const std::vector<float> *correction_table, const bool in_place ) {
+
+	if ( NULL == correction_table ) return this->correct_array ( pArray, (const float*)NULL, NULL, in_place );
+	if ( !this->check_correction_table_size ( pArray, correction_table->size() ) ) return NULL;
+
+	return this->correct_array ( pArray, &(*correction_table)[0], NULL, in_place );
+}
+
+
+NDArray *ViewScreenConfiguredNDPlugin::correct_array ( NDArray *pArray, const CorrectionTable *correction_table, const bool in_place ) {
+
+	if ( NULL == correction_table ) return this->correct_array ( pArray, (const float*)NULL, NULL, in_place );
+	if ( !this->check_correction_table_size ( pArray, correction_table->size() ) ) return NULL;
+
+	if ( correction_table->is_half_precision() ) return this->correct_array ( pArray, NULL, &correction_table->half_values[0], in_place );
+
+	return this->correct_array ( pArray, &correction_table->values[0], NULL, in_place );
+}
+
+
+NDArray *ViewScreenConfiguredNDPlugin::correct_array ( NDArray *pArray, const float *table, const epicsUInt16 *half_table, const bool in_place ) {
+
+	NDArrayInfo_t ndarray_info;
+	pArray->getInfo ( &ndarray_info );
+
+	const bool corrected = (NULL != table) || (NULL != half_table);
+	const size_t count = ndarray_info.nElements;
+
+	/* The input already has the output data type; correct its buffer rather than allocating and filling another frame */
+	if ( in_place && (NDFloat32 == pArray->dataType) ) {
+
+		pArray->reserve ();
+		if ( corrected ) correct_pixels<epicsFloat32> ( (const epicsFloat32*)pArray->pData, table, half_table, (float*)pArray->pData, count );
+		return pArray;
+	}
+
+	size_t dims[ND_ARRAY_MAX_DIMS];
+	for ( int dim = 0; dim < pArray->ndims; dim++ ) {
+
+		dims[dim] = pArray->dims[dim].size;
+	}
+
+	const size_t dataSize = 0;	// let alloc compute the required size
+	NDArray *pArrayOut = this->pNDArrayPool->alloc ( pArray->ndims, dims, NDFloat32, dataSize, NULL );
+
+	if ( NULL == pArrayOut ) {
+
+		asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s: Unable to allocate an output array.\n", pluginName, __func__ );
+		return NULL;
+	}
+
+	/* Keep everything but the data, as NDArrayPool::convert would */
+	for ( int dim = 0; dim < pArray->ndims; dim++ ) {
+
+		pArrayOut->dims[dim] = pArray->dims[dim];
+	}
+	pArray->pAttributeList->copy ( pArrayOut->pAttributeList );
+	pArrayOut->uniqueId = pArray->uniqueId;
+	pArrayOut->timeStamp = pArray->timeStamp;
+	pArrayOut->epicsTS = pArray->epicsTS;
+
+	float *output = (float*)pArrayOut->pData;
+
+	switch ( pArray->dataType ) {
+		case NDInt8:
+			correct_pixels<epicsInt8> ( (const epicsInt8*)pArray->pData, table, half_table, output, count );
+			break;
+		case NDUInt8:
+			correct_pixels<epicsUInt8> ( (const epicsUInt8*)pArray->pData, table, half_table, output, count );
+			break;
+		case NDInt16:
+			correct_pixels<epicsInt16> ( (const epicsInt16*)pArray->pData, table, half_table, output, count );
+			break;
+		case NDUInt16:
+			correct_pixels<epicsUInt16> ( (const epicsUInt16*)pArray->pData, table, half_table, output, count );
+			break;
+		case NDInt32:
+			correct_pixels<epicsInt32> ( (const epicsInt32*)pArray->pData, table, half_table, output, count );
+			break;
+		case NDUInt32:
+			correct_pixels<epicsUInt32> ( (const epicsUInt32*)pArray->pData, table, half_table, output, count );
+			break;
+		case NDFloat32:
+			correct_pixels<epicsFloat32> ( (const epicsFloat32*)pArray->pData, table, half_table, output, count );
+			break;
+		case NDFloat64:
+			correct_pixels<epicsFloat64> ( (const epicsFloat64*)pArray->pData, table, half_table, output, count );
+			break;
+		default:
+			asynPrint ( this->pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s: Unknown data type=%d.\n", pluginName, __func__, pArray->dataType );
+			pArrayOut->release ();
+			return NULL;
+	}
+
+	return pArrayOut;
+}
+
+
 /** Converts a tinyxml2::XMLError into an NDPluginMagnificationCorrectionConfigurationStatus_t
  */
 ViewScreenConfiguredNDPlugin::ConfigurationStatus_t ViewScreenConfiguredNDPlugin::xmlerror_to_pluginstatus ( const XMLError xml_error ) {
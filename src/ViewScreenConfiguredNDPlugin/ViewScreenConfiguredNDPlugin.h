@@ -14,33 +14,171 @@
 #include <map>
 #include <utility>
 #include <array>
+#include <memory>
+#include <set>
 
 /** Map parameter enums to strings that will be used to set up EPICS databases
   */
 #define ViewScreenConfiguredNDPluginConfigurationFileString	"CONFIGURATION_FILE"
 #define ViewScreenConfiguredNDPluginConfigurationStatusString	"CONFIGURATION_STATUS"
+#define ViewScreenConfiguredNDPluginConfigurationAutoReloadString	"CONFIGURATION_AUTO_RELOAD"
+#define ViewScreenConfiguredNDPluginConfigurationSelectString	"CONFIGURATION_SELECT"
+#define ViewScreenConfiguredNDPluginConfigurationPreloadedString	"CONFIGURATION_PRELOADED"
+#define ViewScreenConfiguredNDPluginConversionDirectionString	"CONVERSION_DIRECTION"
+#define ViewScreenConfiguredNDPluginConversionInputString		"CONVERSION_INPUT"
+#define ViewScreenConfiguredNDPluginConversionOutputString		"CONVERSION_OUTPUT"
+#define ViewScreenConfiguredNDPluginScreenAttributeString		"SCREEN_ATTRIBUTE"
+#define ViewScreenConfiguredNDPluginCorrectInPlaceString		"CORRECT_IN_PLACE"
 
-/** These plugins accept an XML configuration file. */
+/** These plugins accept an XML configuration file.
+ *  A plugin instance may serve several view screens; each screen has its own asyn address, configuration and tables,
+ *  and the screen of an NDArray is given by the value of the attribute named by SCREEN_ATTRIBUTE.
+ */
 
 class ViewScreenConfiguredNDPlugin: public NDPluginDriver {
 
 public:
 
-	ViewScreenConfiguredNDPlugin ( const char *portName, int queueSize, int blockingCallbacks, const char *NDArrayPort, int NDArrayAddr, int maxAddr, int numParams, int maxBuffers, size_t maxMemory, int interfaceMask, int interruptMask, int asynFlags, int autoConnect, int priority, int stackSize );
+	class TargetInfo {
+
+		public:
+			TargetInfo ( ): material ( "undefined" ), light_distribution ( "undefined" ) {};
+			TargetInfo ( const std::string material, const std::string light_distribution ): material ( material ), light_distribution ( light_distribution ) {};
+			std::string material;
+			std::string light_distribution;
+
+			bool operator< ( const TargetInfo &rhs ) const {
+
+				if ( material == rhs.material ) {
+
+					return ( light_distribution < rhs.light_distribution );
+				}
+				else return ( material < rhs.material );
+			}
+	};
+
+	/** The contents of a view screen configuration file.
+	 *  Once loaded, a configuration is never modified; a new file produces a new Configuration which replaces the active one.
+	 */
+	class Configuration {
+
+		public:
+			Configuration ();
+
+			/* The mapping functions */
+			double fx ( const double u, const double v ) const;
+			double fy ( const double u, const double v ) const;
+			double gu ( const double x, const double y ) const;
+			double gv ( const double x, const double y ) const;
+
+			/* The partial derivatives of the mapping from beamspace to the input image */
+			void gu_gradient ( const double x, const double y, double &du_dx, double &du_dy ) const;
+			void gv_gradient ( const double x, const double y, double &dv_dx, double &dv_dy ) const;
+
+			/* Coordinate conversions */
+			void oimage_to_beamspace ( const double u, const double v, double &x, double &y ) const;
+			void beamspace_to_oimage ( const double x, const double y, double &u, double &v ) const;
+			void iimage_to_beamspace ( const double u, const double v, double &x, double &y ) const;
+			void beamspace_to_iimage ( const double x, const double y, double &u, double &v ) const;
+
+			/** Helper function which calculates the area of input ccd covered by an output pixel **/
+			double ccd_area_covered_by_output_pixel ( const double u, const double v ) const;
+
+			/** Maps the corners of the output pixels to the input image; the (width+1)x(height+1) corners are stored row
+			 *  after row from the upper left corner of pixel (0,0), and each corner is shared by the pixels around it **/
+			void oimage_corners_to_iimage ( std::vector<double> &corner_u, std::vector<double> &corner_v ) const;
+
+			/** Calculates the area of input ccd covered by every output pixel, row after row, from the shared corners **/
+			void ccd_areas_covered_by_output_pixels ( std::vector<double> &areas ) const;
 
-	/* Coordinate conversions */
-	// output image <-> beamspace
-	void oimage_to_beamspace ( const double u, const double v, double &x, double &y ) const;
-	void beamspace_to_oimage ( const double x, const double y, double &u, double &v ) const;
-	// input image (ccd) <-> beamspace
-	void iimage_to_beamspace ( const double u, const double v, double &x, double &y ) const;
-	void beamspace_to_iimage ( const double x, const double y, double &u, double &v ) const;
+			/** The most points per axis of the Gauss-Legendre rules which integrate the Jacobian over an output pixel **/
+			static const size_t max_quadrature_points = 5;
 
-	/** Helper function which calculates the area of input ccd covered by an output pixel **/
-	double ccd_area_covered_by_output_pixel ( const double u, const double v ) const;
+			/** Calculates the area of input ccd covered by an output pixel by integrating the determinant of the Jacobian of
+			 *  the mapping over the pixel, with a quadrature_points Gauss-Legendre rule per axis; 1 evaluates it at the centre **/
+			double ccd_area_from_jacobian ( const double u, const double v, const size_t quadrature_points ) const;
+
+			/** As above for every output pixel, row after row; the derivatives are evaluated a row of samples at a time **/
+			void ccd_areas_from_jacobian ( const size_t quadrature_points, std::vector<double> &areas ) const;
+
+			size_t get_output_image_width () const { if ( this->nx < 0 ) return 0; return (size_t)this->nx; };
+			size_t get_output_image_height () const { if ( this->ny < 0 ) return 0; return (size_t)this->ny; };
+			size_t get_input_image_width () const { return 780; };
+			size_t get_input_image_height () const { return 580; };
+
+			TargetInfo get_target_info ( const size_t ) const;
+			std::string get_efficiency_map_directory ( const size_t target_number ) const;
+
+			size_t version;
+			std::string geometry;			// the geometry of this view screen unit
+			std::string orientation;		// the orientation of this view screen unit
+			int order;						// the order of the interpolating multivariate polynomial
+			int nx, ny;						// nx, ny: the width and height of the beamspace image
+			double xi, xf, yi, yf;			// xi, xf, yi, yf: the extents of the beamspace image
+			std::vector<double> fxc, fyc;		// fxc, fyc: the coefficients of interpolating multivariate polynomials
+			std::vector<double> guc, gvc;		// guc, gvc: the coefficients of interpolating multivariate polynomials
+
+			// orientation information
+			int x_orientation;				// the sign of the x-orientation of the view screen unit (+1 for positive x, -1 for negative x)
+			int y_orientation;				// the sign of the y-orientatino of the view screen unit (+1 for upward, -1 for downward)
+
+			std::array<TargetInfo,3>	targets;	// the targets in this view screen unit
+	};
+
+	/** Tables which a subclass derives from a Configuration (correction tables, efficiency grids, ...).
+	 *  Subclasses extend this class; like the Configuration, the tables are not modified once they are prepared.
+	 */
+	class ConfigurationTables {
+
+		public:
+			virtual ~ConfigurationTables () {};
+
+			/** The approximate number of bytes held by the tables; used to enforce the preloaded configuration memory limit */
+			virtual size_t memory_usage () const { return 0; };
+	};
+
+	/** One value per pixel of the output image, such as the correction factors of a frame. The values are kept as floats or,
+	 *  to halve the memory of the table and the bytes which a frame correction reads, as IEEE half-precision numbers,
+	 *  which keep a relative error below 2^-11 over the range 6.1e-5 to 65504. Not modified once it's published.
+	 */
+	class CorrectionTable {
+
+		public:
+			CorrectionTable (): max_relative_error ( 0. ) {};
+
+			size_t size () const { return half_values.empty()? values.size(): half_values.size(); };
+			bool is_half_precision () const { return !half_values.empty(); };
+			size_t memory_usage () const { return values.size() * sizeof(float) + half_values.size() * sizeof(epicsUInt16); };
+			float get ( const size_t i ) const { return half_values.empty()? values[i]: half_to_float ( half_values[i] ); };
+
+			/** Replaces the float values by half-precision ones, and adds the largest relative error of the conversion to max_relative_error */
+			void reduce_precision ();
+
+			/** Converts a float to the nearest half-precision number; magnitudes beyond the half-precision range saturate, and ones below it become zero */
+			static epicsUInt16 float_to_half ( const float value );
+
+			/** Converts a half-precision number which float_to_half produced; there are no branches, so loops using it can be vectorized */
+			static inline float half_to_float ( const epicsUInt16 half ) {
+
+				const epicsUInt32 magnitude = half & 0x7fff;
+				const epicsUInt32 normal = -(epicsUInt32)(magnitude >= 0x0400);	// zero is the only value with a zero exponent
+				union { epicsUInt32 bits; float value; } conversion;
+				conversion.bits = ((epicsUInt32)(half & 0x8000) << 16) | (((magnitude << 13) + ((127 - 15) << 23)) & normal);
+				return conversion.value;
+			};
+
+			std::vector<float> values;
+			std::vector<epicsUInt16> half_values;	// replace values in half-precision tables
+			double max_relative_error;	// of the values against the full precision ones they stand for
+	};
+
+	ViewScreenConfiguredNDPlugin ( const char *portName, int queueSize, int blockingCallbacks, const char *NDArrayPort, int NDArrayAddr, int maxAddr, int numParams, int maxBuffers, size_t maxMemory, int interfaceMask, int interruptMask, int asynFlags, int autoConnect, int priority, int stackSize );
 
     /* These methods override the virtual methods in the base class */
+	asynStatus writeInt32 ( asynUser *pasynUser, epicsInt32 value );
 	asynStatus writeOctet ( asynUser *pasynUser, const char *value, size_t nChars, size_t *nActual );
+	asynStatus writeFloat64Array ( asynUser *pasynUser, epicsFloat64 *value, size_t nElements );
+	asynStatus readFloat64Array ( asynUser *pasynUser, epicsFloat64 *value, size_t nElements, size_t *nIn );
 
 	/* These are used to register functions with the EPICS IOC Shell */
 	// The viewscreen_set_configuration_file_directory function definitions
@@ -57,6 +195,30 @@ public:
 	static const iocshFuncDef viewscreen_set_efficiency_map_directory_FuncDef;
 	static void viewscreen_set_efficiency_map_directory ( const iocshArgBuf *args );
 
+	// The viewscreen_preload_configurations function definitions
+	static const iocshArg viewscreen_preload_configurations_Arg0;
+	static const iocshArg viewscreen_preload_configurations_Arg1;
+	static const iocshArg viewscreen_preload_configurations_Arg2;
+	static const iocshArg *viewscreen_preload_configurations_Args[3];
+	static const iocshFuncDef viewscreen_preload_configurations_FuncDef;
+	static void viewscreen_preload_configurations ( const iocshArgBuf *args );
+
+	/** Watches the configuration file and efficiency map directories for changes; runs in its own thread */
+	void watch_configuration_files ();
+
+	/** Prepares the preloaded configurations in the background; runs in its own thread */
+	void preload_configurations ();
+
+	/** Returns the factors which this plugin currently multiplies the output images of the screen at addr by, for a plugin
+	 *  which folds the correction into its own pass; NULL if there are none for images of that many pixels. stale_table is set
+	 *  when the factors are those of a previous state, applied while the current ones are prepared. Takes the port lock,
+	 *  so it must be called without holding the lock of another plugin.
+	 */
+	virtual std::shared_ptr<const CorrectionTable> get_output_correction ( const int /* addr */, const size_t /* pixels */, bool &stale_table ) { stale_table = false; return std::shared_ptr<const CorrectionTable> (); };
+
+	/** Returns the plugin with the given port name, or NULL if there is none */
+	static ViewScreenConfiguredNDPlugin *find_plugin ( const std::string port_name );
+
 protected:
 
 	typedef enum {
@@ -69,78 +231,152 @@ protected:
 		ConfigurationStatusConfiguring
 	} ConfigurationStatus_t;
 
-	class TargetInfo {
+	/** The coordinate conversions offered through CONVERSION_INPUT and CONVERSION_OUTPUT */
+	typedef enum {
+		ConversionIImageToBeamspace,
+		ConversionBeamspaceToIImage,
+		ConversionOImageToBeamspace,
+		ConversionBeamspaceToOImage,
+		ConversionIImageToOImage,
+		ConversionOImageToIImage
+	} ConversionDirection_t;
 
-		public:
-			TargetInfo ( ): material ( "undefined" ), light_distribution ( "undefined" ) {};
-			TargetInfo ( const std::string material, const std::string light_distribution ): material ( material ), light_distribution ( light_distribution ) {};
-			std::string material;
-			std::string light_distribution;
+	/** Builds the tables which depend on a configuration.
+	 *  This is called without the port lock, possibly from the configuration watcher thread, so implementations
+	 *  must only use the configuration passed to them and must not touch the parameter library.
+	 */
+	virtual ConfigurationStatus_t prepare_configuration_tables ( const Configuration &configuration, std::shared_ptr<const ConfigurationTables> &tables );
 
-			bool operator< ( const TargetInfo &rhs ) const {
+	/** Subclasses whose tables are built from efficiency maps return true, so that changes to the maps trigger a reload */
+	virtual bool depends_on_efficiency_maps () const { return false; };
 
-				if ( material == rhs.material ) {
+	/** Called from a locked state once a new configuration and its tables are active on the screen at addr */
+	virtual ConfigurationStatus_t configuration_change_callback ( const int addr ) = 0;
+	bool is_configured ( const int addr ) const;
 
-					return ( light_distribution < rhs.light_distribution );
-				}
-				else return ( material < rhs.material );
-			}
-	};
+	/** The active configuration of the screen at addr and the tables prepared for it */
+	std::shared_ptr<const Configuration> get_configuration ( const int addr ) const { return this->screens[addr].configuration; };
+	std::shared_ptr<const ConfigurationTables> get_configuration_tables ( const int addr ) const { return this->screens[addr].tables; };
 
-	virtual ConfigurationStatus_t configuration_change_callback () = 0;
-	bool is_configured () const;
-
-	/* The mapping functions */
-	double fx ( const double u, const double v ) const;
-	double fy ( const double u, const double v ) const;
-	double gu ( const double x, const double y ) const;
-	double gv ( const double x, const double y ) const;
-
-	/* Get methods */
-	size_t get_version () { return this->version; };
-	std::string get_geometry () const { return this->geometry; };
-	double get_xi () const { return this->xi; };
-	double get_xf () const { return this->xf; };
-	double get_yi () const { return this->yi; };
-	double get_yf () const { return this->yf; };
-	size_t get_output_image_width () const { if ( this->nx < 0 ) return 0; return (size_t)this->nx; };
-	size_t get_output_image_height () const { if ( this->ny < 0 ) return 0; return (size_t)this->ny; };
-	size_t get_input_image_width () const { return 780; };
-	size_t get_input_image_height () const { return 580; };
-	std::string get_configuration_directory () const { return directory_configuration_files; };
-	int get_x_orientation () const { return this->x_orientation; };
-	int get_y_orientation () const { return this->y_orientation; };
+	/** The number of screens (asyn addresses) served by this plugin */
+	int get_screen_count () const { return (int)this->screens.size(); };
+
+	/** Returns the screen which an NDArray belongs to, or -1 if it can't be determined; called from a locked state */
+	int get_screen_address ( NDArray *pArray );
+
+	/** Calls the parameter callbacks of every screen; called from a locked state */
+	void call_screen_param_callbacks ();
 
-	TargetInfo get_target_info ( const size_t ) const;
-	size_t get_maximum_target_count () const { return this->targets.size(); };
-	std::string get_efficiency_map_directory ( const size_t target_number ) const;
+	/** Returns an NDFloat32 copy of pArray with every pixel multiplied by its factor in correction_table, converting
+	 *  from the input data type in the same pass; without a table, the array is only converted. The port lock isn't used.
+	 *  With in_place, an NDFloat32 input is corrected in its own buffer and returned with an extra reference instead;
+	 *  this is only safe when the plugin is the sole subscriber of its input port (see CORRECT_IN_PLACE), which isn't checked.
+	 */
+	NDArray *correct_array ( NDArray *pArray, const std::vector<float> *correction_table, const bool in_place );
+
+	/** As above, for a table of either precision; a half-precision table is converted to float inside the correction loop */
+	NDArray *correct_array ( NDArray *pArray, const CorrectionTable *correction_table, const bool in_place );
+
+	std::string get_configuration_directory () const { return directory_configuration_files; };
 
 	#define FIRST_ViewScreenConfiguredNDPlugin_PARAM ViewScreenConfiguredNDPluginConfigurationFile
 	int ViewScreenConfiguredNDPluginConfigurationFile;
 	int ViewScreenConfiguredNDPluginConfigurationStatus;
-	#define LAST_ViewScreenConfiguredNDPlugin_PARAM ViewScreenConfiguredNDPluginConfigurationStatus
+	int ViewScreenConfiguredNDPluginConfigurationAutoReload;
+	int ViewScreenConfiguredNDPluginConfigurationSelect;
+	int ViewScreenConfiguredNDPluginConfigurationPreloaded;
+	int ViewScreenConfiguredNDPluginConversionDirection;
+	int ViewScreenConfiguredNDPluginConversionInput;
+	int ViewScreenConfiguredNDPluginConversionOutput;
+	int ViewScreenConfiguredNDPluginScreenAttribute;
+	int ViewScreenConfiguredNDPluginCorrectInPlace;
+	#define LAST_ViewScreenConfiguredNDPlugin_PARAM ViewScreenConfiguredNDPluginCorrectInPlace
 
 private:
+	/** Returns whether a correction table of table_size factors fits pArray, and reports it if it doesn't */
+	bool check_correction_table_size ( NDArray *pArray, const size_t table_size );
+
+	/** Corrects pArray by factors given either as floats or as half-precision numbers, or by neither for a plain conversion */
+	NDArray *correct_array ( NDArray *pArray, const float *table, const epicsUInt16 *half_table, const bool in_place );
+
 	static std::string directory_configuration_files;
 	static std::map<std::pair<std::string,std::string>, std::string> efficiency_map_directories;
-	
-	ConfigurationStatus_t load_configuration ( );
+
+	// the plugins by port name, so that the IOC shell functions can find them
+	static std::map<std::string, ViewScreenConfiguredNDPlugin*> plugins;
+
+	/** The state of one view screen */
+	class Screen {
+
+		public:
+			Screen (): configuration ( new Configuration () ), configuration_generation ( 0 ) {};
+			std::shared_ptr<const Configuration> configuration;
+			std::shared_ptr<const ConfigurationTables> tables;
+
+			// incremented whenever an operator selects a configuration; a reload started before then is discarded
+			size_t configuration_generation;
+
+			// the points produced by the last write to CONVERSION_INPUT
+			std::vector<epicsFloat64> conversion_output;
+	};
+
+	/** A configuration file which may be selected by its index in the list of preloaded configurations; the list is shared by all screens */
+	class PreloadedConfiguration {
+
+		public:
+			PreloadedConfiguration ( const std::string filename ): filename ( filename ), status ( ConfigurationStatusUnconfigured ), last_used ( 0 ) {};
+			std::string filename;
+			std::shared_ptr<const Configuration> configuration;		// NULL until prepared, and once evicted
+			std::shared_ptr<const ConfigurationTables> tables;
+			ConfigurationStatus_t status;							// the result of the last preparation; Unconfigured if it hasn't been attempted
+			size_t last_used;
+	};
+
+	/** Parses a configuration file and prepares its tables; called without the port lock */
+	ConfigurationStatus_t prepare_configuration ( const std::string filename, std::shared_ptr<const Configuration> &configuration, std::shared_ptr<const ConfigurationTables> &tables );
+
+	/** Makes a prepared configuration the active one on the screen at addr; called from a locked state */
+	ConfigurationStatus_t activate_configuration ( const int addr, std::shared_ptr<const Configuration> configuration, std::shared_ptr<const ConfigurationTables> tables );
+
+	/** Prepares a configuration file without the port lock and makes it the active one on the screen at addr; called from a locked state */
+	ConfigurationStatus_t load_and_activate_configuration ( asynUser *pasynUser, const int addr, const std::string filename );
+
+	ConfigurationStatus_t load_configuration ( const std::string filename, Configuration &configuration );
 	ConfigurationStatus_t xmlerror_to_pluginstatus ( const tinyxml2::XMLError xml_error );
 
-	size_t version;
-	std::string geometry;			// the geometry of this view screen unit
-	std::string orientation;		// the orientation of this view screen unit
-	int order;						// the order of the interpolating multivariate polynomial
-	int nx, ny;						// nx, ny: the width and height of the beamspace image
-	double xi, xf, yi, yf;			// xi, xf, yi, yf: the extents of the beamspace image
-	std::vector<double> fxc, fyc;		// fxc, fyc: the coefficients of interpolating multivariate polynomials
-	std::vector<double> guc, gvc;		// guc, gvc: the coefficients of interpolating multivariate polynomials
-
-	// orientation information
-	int x_orientation;				// the sign of the x-orientation of the view screen unit (+1 for positive x, -1 for negative x)
-	int y_orientation;				// the sign of the y-orientatino of the view screen unit (+1 for upward, -1 for downward)
-	
-	std::array<TargetInfo,3>	targets;	// the targets in this view screen unit
+	/** Starts the configuration watcher thread, if it is not already running */
+	void start_configuration_watcher ();
+
+	/** Replaces the list of preloaded configurations and starts preparing them; called from the IOC shell */
+	void set_preloaded_configurations ( const std::vector<std::string> filenames, const size_t memory_limit );
+
+	/** Keeps a prepared configuration for later selection and evicts the least recently used ones beyond the memory limit; called from a locked state */
+	void store_preloaded_configuration ( const std::string filename, std::shared_ptr<const Configuration> configuration, std::shared_ptr<const ConfigurationTables> tables );
+
+	/** Drops the prepared tables of preloaded configurations which are stale, except the active one; called from a locked state */
+	void discard_preloaded_configurations ( const std::set<std::string> filenames, const bool all );
+
+	/** Reports whether a configuration is active on any screen; called from a locked state */
+	bool is_active_configuration ( const std::shared_ptr<const Configuration> &configuration ) const;
+
+	/** Returns the bytes held by the prepared preloaded configurations; called from a locked state */
+	size_t get_preloaded_configuration_memory_usage () const;
+
+	/** Updates the count of prepared preloaded configurations; called from a locked state */
+	void update_preloaded_configuration_count ();
+
+	/** Converts interleaved (u,v) or (x,y) pairs from one coordinate system to another; this doesn't use the port lock */
+	static bool convert_coordinates ( const Configuration &configuration, const ConversionDirection_t direction, const epicsFloat64 *input, epicsFloat64 *output, const size_t npoints );
+
+	// one per asyn address
+	std::vector<Screen> screens;
+
+	bool configuration_watcher_started;
+
+	std::vector<PreloadedConfiguration> preloaded_configurations;
+	size_t preloaded_configuration_memory_limit;	// bytes; 0 for no limit
+	size_t preloaded_configuration_clock;			// advanced whenever a preloaded configuration is prepared or selected
+	bool configuration_preloader_running;
 };
 
 #define NUM_ViewScreenConfiguredNDPlugin_PARAMS (&LAST_ViewScreenConfiguredNDPlugin_PARAM - &FIRST_ViewScreenConfiguredNDPlugin_PARAM + 1)
@@ -2,6 +2,17 @@
 #include "ViewScreenConfiguredNDPlugin.h"
 
 #include <sys/stat.h>
+#include <dirent.h>
+#include <cstring>
+#include <cstdlib>
+#include <sstream>
+#include <algorithm>
+
+static int select_configuration_file ( const struct dirent *entry ) {
+
+	const size_t length = strlen ( entry->d_name );
+	return ( (length > 4) && (0 == strcmp ( entry->d_name + length - 4, ".xml" )) );
+}
 
 // EPICS IOC shell functions for ViewScreenConfiguredNDPlugin
 const iocshArg ViewScreenConfiguredNDPlugin::viewscreen_set_configuration_file_directory_Arg0 = { "directory name (ending with '/')", iocshArgString };
@@ -47,10 +58,72 @@ void ViewScreenConfiguredNDPlugin::viewscreen_set_efficiency_map_directory ( con
 	errlogSevPrintf ( errlogInfo, "efficiency map directory location updated; geometry: %s, light distribution: %s, directory: %s\n", geometry.c_str(), light_distribution.c_str(), directory.c_str() );
 }
 
+const iocshArg ViewScreenConfiguredNDPlugin::viewscreen_preload_configurations_Arg0 = { "port name", iocshArgString };
+const iocshArg ViewScreenConfiguredNDPlugin::viewscreen_preload_configurations_Arg1 = { "configuration files (separated by spaces or commas; empty for every .xml file in the configuration directory)", iocshArgString };
+const iocshArg ViewScreenConfiguredNDPlugin::viewscreen_preload_configurations_Arg2 = { "memory limit in MB (0 for no limit)", iocshArgInt };
+const iocshArg *ViewScreenConfiguredNDPlugin::viewscreen_preload_configurations_Args[] = { &viewscreen_preload_configurations_Arg0, &viewscreen_preload_configurations_Arg1, &viewscreen_preload_configurations_Arg2 };
+const iocshFuncDef ViewScreenConfiguredNDPlugin::viewscreen_preload_configurations_FuncDef = { "viewscreen_preload_configurations", 3, ViewScreenConfiguredNDPlugin::viewscreen_preload_configurations_Args };
+void ViewScreenConfiguredNDPlugin::viewscreen_preload_configurations ( const iocshArgBuf *args ) {
+
+	const std::string port_name ( args[0].sval? args[0].sval: "" );
+	std::string file_list ( args[1].sval? args[1].sval: "" );
+	const int memory_limit = args[2].ival;
+
+	auto plugin = plugins.find ( port_name );
+	if ( plugin == plugins.end() ) {
+
+		errlogSevPrintf ( errlogMinor, "configurations not preloaded; no view screen plugin with port name: %s\n", port_name.c_str() );
+		return;
+	}
+
+	if ( memory_limit < 0 ) {
+
+		errlogSevPrintf ( errlogMinor, "configurations not preloaded; invalid memory limit: %d\n", memory_limit );
+		return;
+	}
+
+	std::vector<std::string> filenames;
+	std::replace ( file_list.begin(), file_list.end(), ',', ' ' );
+	std::istringstream stream ( file_list );
+	std::string filename;
+	while ( stream >> filename ) {
+
+		filenames.push_back ( filename );
+	}
+
+	/* Without a list, every configuration file in the configuration directory is preloaded */
+	if ( filenames.empty() ) {
+
+		struct dirent **entries = NULL;
+		const int n = scandir ( directory_configuration_files.c_str(), &entries, select_configuration_file, alphasort );
+
+		if ( n < 0 ) {
+
+			errlogSevPrintf ( errlogMinor, "configurations not preloaded; unable to read the configuration directory: %s\n", directory_configuration_files.c_str() );
+			return;
+		}
+
+		for ( int i = 0; i < n; i++ ) {
+
+			filenames.push_back ( std::string ( entries[i]->d_name ) );
+			free ( entries[i] );
+		}
+		free ( entries );
+	}
+
+	plugin->second->set_preloaded_configurations ( filenames, (size_t)memory_limit * 1024 * 1024 );
+
+	for ( size_t index = 0; index < filenames.size(); index++ ) {
+
+		errlogSevPrintf ( errlogInfo, "%s: preloading configuration %lu: %s\n", port_name.c_str(), (unsigned long)index, filenames[index].c_str() );
+	}
+}
+
 extern "C" void ViewScreenConfiguredNDPluginRegister ( void )
 {
 	iocshRegister ( &ViewScreenConfiguredNDPlugin::viewscreen_set_configuration_file_directory_FuncDef, ViewScreenConfiguredNDPlugin::viewscreen_set_configuration_file_directory );
 	iocshRegister ( &ViewScreenConfiguredNDPlugin::viewscreen_set_efficiency_map_directory_FuncDef, ViewScreenConfiguredNDPlugin::viewscreen_set_efficiency_map_directory );
+	iocshRegister ( &ViewScreenConfiguredNDPlugin::viewscreen_preload_configurations_FuncDef, ViewScreenConfiguredNDPlugin::viewscreen_preload_configurations );
 }
 
 extern "C" {